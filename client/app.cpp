@@ -1,14 +1,43 @@
 // Project headres
 #include "app.h"
+#include "imagestat.h"
+#include "commands.h"
+#include "latency.h"
 
 /* Let c++ write json messages in queue */
 #include "queue.h"
 
-const float MIN_TEMP = 0;
-const float MAX_TEMP = 50;
+#include <algorithm>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
 const int TIME = 10;
+// Writer stage: frames waiting to be saved and threads saving them
+const int WRITER_QUEUE_DEPTH = 2;
+const int WRITER_THREADS = 1;
+// Preview binning, 8x8 makes about 420x340 out of the full frame
+const int PREVIEW_BIN = 8;
+const int MAX_PREVIEW_BIN = 64;
+// Rows coded together in compressed .dat files, every band is coded on its own core
+const int RAW_BAND_ROWS = 64;
+// Master darks are kept and looked for here
+const char* CALIBRATION_DIR = "calib";
+// Commands from the server waiting for the command thread, more are answered with an error
+const int COMMAND_QUEUE_DEPTH = 16;
+// Telemetry sample period, the status goes to the server every STATUS_SEND_INTERVAL (main.c)
+const int TELEMETRY_PERIOD_MS = 1000;
+// Benchmark frames are written here, a frame may take this long over its exposure before the run is given up
+const char* BENCHMARK_DIR = "bench";
+const double BENCHMARK_FRAME_TIMEOUT = 30;
 static Camera CAMERA;
 
+static double threadCpuSec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
 std::string getCurrentTimeAsString()
 {
     auto now = std::chrono::system_clock::now();
@@ -23,12 +52,29 @@ Camera::Camera() : QSICamera()
 {
     m_doPhoto = false;
     m_doTransferring = false;
+    m_pipelined = true;
+    m_previewBin = PREVIEW_BIN;
+    m_compressRaw = false;
+    m_tiffMode = TiffDisplay8;
+    m_calibrate = false;
+    m_findClusters = false;
+    m_sensorX = m_sensorY = 0;
+    m_maxBin = 1;
+    m_keepRaw = true;
+    m_framesTaken = 0;
+    m_recordTimings = false;
     stop_flag = false;
 }
 
 Camera::~Camera()
 {
-    stop_flag = true;
+    m_telemetry.Stop();
+    m_writer.Stop();
+    {
+        // under the lock, so the worker can not miss it between its check and the wait
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        stop_flag = true;
+    }
     if (photoWorker.joinable())
     {
 	readyToRun.notify_one();
@@ -39,6 +85,7 @@ Camera::~Camera()
 bool Camera::Connect()
 {
     std::cout << "Connect .. " << std::endl;
+    std::unique_lock<std::recursive_mutex> usb(m_usbMutex);
     try
     {
 	bool isMain;
@@ -88,7 +135,11 @@ bool Camera::Connect()
 
 	// This app works only with 6 series
         if (modelNumber.substr(0,1) != "6")
-	    exit(1);
+	{
+	    std::cout << "Not a 6 series camera" << std::endl;
+	    put_Connected(false);
+	    return false;
+	}
 
         // Get the camera state
         // It should be idle at this point
@@ -96,7 +147,8 @@ bool Camera::Connect()
 	if (state == QSICamera::CameraError)
 	{
             std::cout << "--- Camera is in Error state at the init time. Better to reboot camera. ---" << std::endl;
-            exit(1);
+            put_Connected(false);
+            return false;
 	}
 
         put_SoundEnabled(true);
@@ -111,7 +163,8 @@ bool Camera::Connect()
 	if (!hasShutter)
 	{
 	    std::cout << "No shutter. This app works only with camera having the shutter" << std::endl;
-	    exit(1);
+	    put_Connected(false);
+	    return false;
 	}
 
 	std::cout << "Test shutter. Sometimes it get stuck.\n" << "If the camera beeps, that is the error. Reboot" << std::endl;
@@ -137,6 +190,18 @@ bool Camera::Connect()
         put_NumY(maxY);
         put_BinX(1);
         put_BinY(1);
+	m_sensorX = maxX;
+	m_sensorY = maxY;
+	m_readoutMode = ReadoutMode();
+	get_MaxBinX(&m_maxBin);
+
+	// Full frame and its 8-bit display copy are checked out of the pool for every shot.
+	// Frames are held by the photo worker, the writer queue and the writer threads
+	m_framePool.Reserve(sizeof(unsigned short) * maxX * maxY, WRITER_QUEUE_DEPTH + WRITER_THREADS + 1);
+	m_framePool.Reserve(maxX * maxY, WRITER_THREADS);
+
+	std::cout << "Image statistics: " << ImageStatBackend() << std::endl;
+	std::cout << "Master darks loaded: " << m_calibration.Load(CALIBRATION_DIR) << std::endl;
 
 	// Query various camera parameters
 	get_ElectronsPerADU(&eADU);
@@ -156,9 +221,7 @@ bool Camera::Connect()
 	//put_ManualShutterMode(true);
 	//put_ManualShutterOpen(true);
 
-	std::string lastError;
-	get_LastError(lastError);
-	std::cout << "Last Error: " << lastError << std::endl;
+	std::cout << "Last Error: " << lastError() << std::endl;
 
 	bool canSetTemp;
 	get_CanSetCCDTemperature(&canSetTemp);
@@ -174,18 +237,22 @@ bool Camera::Connect()
     {
         std::string text = err.what();
 	std::cout << text << "\n";
-	std::string last("");
-	get_LastError(last);
-	std::cout << last << "\n";
+	std::cout << lastError() << "\n";
 	std::cout << "exiting with errors\n";
 	return false;
     }
+    usb.unlock();
 
     m_doPhoto = false;
     m_doTransferring = false;
     stop_flag = false;
-    photoWorker = std::thread(&Camera::photoWorkerLoop, this);
-    photoWorker.detach();
+    m_writer.Start(WRITER_QUEUE_DEPTH, WRITER_THREADS, [this](FrameJob& job, double queueSec) {
+        writeFrame(job, queueSec);
+    });
+    // joined by Disconnect, a detached worker would still wait on readyToRun when the camera is destroyed
+    if (!photoWorker.joinable())
+        photoWorker = std::thread(&Camera::photoWorkerLoop, this);
+    m_telemetry.Start(TELEMETRY_PERIOD_MS, [this](TelemetrySnapshot& snapshot) { return readTelemetry(snapshot); });
 
     return true;
 }
@@ -203,13 +270,14 @@ void Camera::photoWorkerLoop()
 
 	task.m_startTime = getCurrentTimeAsString();
 	m_currentTask = task;
-	makePhoto(task.m_exposureTime, task.m_light, task.m_dir);
+	makePhoto(task.m_exposureTime, task.m_light, task.m_dir, task.m_mode);
+	m_framesTaken++;
     }
 
     std::cout << "Photo thread is stopped...\n";
 }
 
-bool Camera::PushTakeNPhoto(double exposureTime, int nPhoto, std::string dir, bool light)
+bool Camera::PushTakeNPhoto(double exposureTime, int nPhoto, std::string dir, bool light, const ReadoutMode& mode)
 {
     std::lock_guard<std::mutex> lock(queue_mutex);
     for (int i = 0; i < nPhoto; i++)
@@ -219,6 +287,7 @@ bool Camera::PushTakeNPhoto(double exposureTime, int nPhoto, std::string dir, bo
 	task.m_exposureTime = exposureTime;
 	task.m_dir = dir;
 	task.m_light = light;
+	task.m_mode = mode;
 	task.m_pushTime = getCurrentTimeAsString();
         queueTask.push(task);
     }
@@ -237,6 +306,8 @@ bool Camera::StopPhoto()
     try
     {
         std::cout << "Try to stop...\n";
+        // waits for a readout going on, an exposure is aborted right away
+        std::lock_guard<std::recursive_mutex> usb(m_usbMutex);
         bool canAbort;
         get_CanAbortExposure(&canAbort);
         if (canAbort)
@@ -244,15 +315,14 @@ bool Camera::StopPhoto()
             AbortExposure();
             m_doPhoto = false;
             m_doTransferring = false;
+            m_readyWaiter.Wake();
         }
     }
     catch (std::runtime_error& err)
     {
         std::string text = err.what();
 	std::cout << text << "\n";
-	std::string last("");
-	get_LastError(last);
-	std::cout << last << "\n";
+	std::cout << lastError() << "\n";
 	std::cout << "exiting with errors\n";
 	return false;
     }
@@ -260,13 +330,45 @@ bool Camera::StopPhoto()
     return true;
 }
 
+void Camera::RecordTimings(bool value)
+{
+    std::lock_guard<std::mutex> lock(m_timingsMutex);
+    m_timings.clear();
+    m_recordTimings = value;
+}
+
+std::vector<FrameTiming> Camera::GetTimings()
+{
+    std::lock_guard<std::mutex> lock(m_timingsMutex);
+    return m_timings;
+}
+
+bool Camera::readTelemetry(TelemetrySnapshot& snapshot)
+{
+    // never wait for a readout, the last values are good enough until it is over
+    std::unique_lock<std::recursive_mutex> usb(m_usbMutex, std::try_to_lock);
+    if (!usb.owns_lock() || m_doTransferring)
+        return false;
+
+    get_CCDTemperature(&snapshot.ccdTemp);
+    get_HeatSinkTemperature(&snapshot.sinkTemp);
+    get_CoolerPower(&snapshot.coolerPower);
+    get_SetCCDTemperature(&snapshot.setPoint);
+    get_CoolerOn(&snapshot.coolerOn);
+    QSICamera::FanMode fan;
+    get_FanMode(fan);
+    snapshot.fanMode = fan;
+    QSICamera::CameraState state;
+    get_CameraState(&state);
+    snapshot.cameraState = state;
+    return true;
+}
+
 CameraPhotoTask Camera::popTask()
 {
-    {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        readyToRun.wait(lock, [this](){ return !queueTask.empty() || stop_flag; });
-    }
-    
+    // Disconnect clears the queue and sets stop_flag from the command thread, so both are read under the lock
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    readyToRun.wait(lock, [this](){ return !queueTask.empty() || stop_flag; });
     if (stop_flag)
         return CameraPhotoTask();
 
@@ -275,8 +377,16 @@ CameraPhotoTask Camera::popTask()
     return task;
 }
 
-bool Camera::makePhoto(double exposureTime, bool light, std::string dir)
+bool Camera::makePhoto(double exposureTime, bool light, std::string dir, const ReadoutMode& mode)
 {
+    // released for the wait, the telemetry sampler reads the camera during the exposure
+    std::unique_lock<std::recursive_mutex> usb(m_usbMutex);
+    if (!applyReadoutMode(mode))
+        return false;
+    ReadoutModeStats& modeStats = m_modeStats[mode];
+    if (modeStats.id == 0)
+        modeStats.id = m_modeStats.size();
+
     m_doPhoto = true;
     m_exposureTime = exposureTime;
 
@@ -287,6 +397,7 @@ bool Camera::makePhoto(double exposureTime, bool light, std::string dir)
     std::cout << "Camera state: " << state << "...\n";
 
     clock_gettime(CLOCK_REALTIME, &start);
+    std::chrono::steady_clock::time_point exposureStart = std::chrono::steady_clock::now();
     end.tv_sec = start.tv_sec + exposureTime;
     QSICamera::ReadoutSpeed readout;
     get_ReadoutSpeed(readout);
@@ -301,9 +412,7 @@ bool Camera::makePhoto(double exposureTime, bool light, std::string dir)
         if (result != 0) 
         {
             std::cout << "StartExposure error \n";
-            std::string last("");
-            get_LastError(last);
-            std::cout << last << "\n";
+            std::cout << lastError() << "\n";
             return false;
         }
         std::cout << "Start Exposure Complete.  \nWaiting for Image Ready...\n";
@@ -312,41 +421,38 @@ bool Camera::makePhoto(double exposureTime, bool light, std::string dir)
     {
         std::string text = err.what();
 	std::cout << text << "\n";
-	std::string last("");
-	get_LastError(last);
-	std::cout << last << "\n";
+	std::cout << lastError() << "\n";
 	std::cout << "exiting with errors\n";
 	return false;
     }
 
-    //usleep(m_exposureTime);
+    usb.unlock();
 
-    bool imageReady = false;
-    result = get_ImageReady(&imageReady);
-    while(!imageReady)
+    // Sleep through most of the exposure and poll only around the predicted end
+    ReadyWaiter::Result ready;
+    try
     {
-	try
-	{
-            result = get_ImageReady(&imageReady);
-	}
-        catch (std::runtime_error &err)
-        {
-    	    std::string text = err.what();
-    	    std::cout << text << "\n";
-    	    std::string last("");
-    	    get_LastError(last);
-    	    std::cout << last << "\n";
-	    return false;
-	}
+        // the readout time depends on the mode too, so every mode learns its own overhead
+        ready = m_readyWaiter.Wait(exposureStart, m_exposureTime, {readout, modeStats.id},
+                                   [this](bool& imageReady) {
+                                       std::lock_guard<std::recursive_mutex> usb(m_usbMutex);
+                                       return get_ImageReady(&imageReady);
+                                   },
+                                   m_doPhoto);
+    }
+    catch (std::runtime_error &err)
+    {
+        std::string text = err.what();
+        std::cout << text << "\n";
+        std::cout << lastError() << "\n";
+        return false;
+    }
 
-        if (result != 0) 
-        {
-            std::cout << "get_ImageReady error \n";
-            std::string last("");
-            get_LastError(last);
-            std::cout << last << "\n";
-	    return false;
-	}
+    if (ready == ReadyWaiter::Failed)
+    {
+        std::cout << "get_ImageReady error \n";
+        std::cout << lastError() << "\n";
+        return false;
     }
     if (!m_doPhoto) // The exposre was aborted
     {
@@ -355,50 +461,166 @@ bool Camera::makePhoto(double exposureTime, bool light, std::string dir)
     }
 
     std::cout << "Image Ready...\n";
-
+    std::chrono::steady_clock::time_point readyTime = std::chrono::steady_clock::now();
+    ReadyWaiter::Stats waitStats = m_readyWaiter.GetLastStats();
+    LatencyRecordSec(LAT_EXPOSURE, waitStats.actualSec);
+    LatencyRecordSec(LAT_READY_WAIT, waitStats.actualSec - m_exposureTime);
+    printf("Ready wait: predicted %.3f, actual %.3f sec (error %+.3f), %d polls, cpu %.3f ms\n",
+           waitStats.predictedSec, waitStats.actualSec, waitStats.errorSec, waitStats.polls, waitStats.cpuSec * 1E3);
+
+    // the telemetry sampler stays off the USB until the frame is read out, the flag is cleared on every way out
     m_doTransferring = true;
-
+    struct TransferFlag {
+        std::atomic<bool>& flag;
+        ~TransferFlag() { flag = false; }
+    } transferring{m_doTransferring};
+    usb.lock();
     result = get_ImageArraySize(x, y, z);
     if (result != 0) 
     {
         std::cout << "get_ImageArraySize error \n";
-        std::string last("");
-        get_LastError(last);
-        std::cout << last << "\n";
+        std::cout << lastError() << "\n";
         return false;
     }
     std::cout << "Image Size " << x << " x " << y << " " << x * y << " Pixels...\n";
 
-    struct timespec startR, finishR;
-    clock_gettime(CLOCK_REALTIME, &startR);
+    ScopedLatency readTimer(LAT_READOUT);
+    double readCpu = threadCpuSec();
 
-    unsigned short* image = new unsigned short[x * y];
+    FramePool::Handle frame = m_framePool.Acquire(sizeof(unsigned short) * x * y);
+    if (!frame)
+    {
+        std::cout << "Can not allocate frame buffer \n";
+        return false;
+    }
+    unsigned short* image = frame.As<unsigned short>();
     // Retrieve the pending image from the camera
     result = get_ImageArray(image);
     if (result != 0) 
     {
         std::cout << "get_ImageArray error \n";
-        std::string last("");
-        get_LastError(last);
-        std::cout << last << "\n";
-        delete [] image;
+        std::cout << lastError() << "\n";
         return false;
     }
-    clock_gettime(CLOCK_REALTIME, &finishR);
-    printf("Read time %.9f sec\n", (finishR.tv_sec - startR.tv_sec) + (finishR.tv_nsec - startR.tv_nsec) * 1E-9);
+    double readSec = readTimer.Stop();
+    usb.unlock();
+    readCpu = threadCpuSec() - readCpu;
+
+    modeStats.frames++;
+    modeStats.readoutSec += readSec;
+    modeStats.bytes += sizeof(unsigned short) * x * y;
 
     m_doTransferring = false;
     m_doPhoto = false;
     m_currentTask.m_status = false;
 
-    std::cout << image[100] << " " << image[667] << std::endl;
-    
-    bool flag = SaveImage(image, x, y, dir);
+    std::chrono::steady_clock::time_point processStart = std::chrono::steady_clock::now();
+    double processCpu = threadCpuSec();
+    CalibrationStats calibration;
+    bool calibrated = false;
+    FrameInfo info = collectFrameInfo(x, y, dir);
+    if (!light)
+        m_calibration.AddDark(m_exposureTime, image, x, y, info.startX, info.startY, info.bin);
+    else if (m_calibrate && (calibrated = m_calibration.Apply(m_exposureTime, image, x, y, info.startX, info.startY,
+                                                              info.bin, calibration)))
+    {
+        LatencyRecordSec(LAT_CALIBRATION, calibration.seconds);
+        size_t frames, overBudget;
+        m_calibration.GetCounters(frames, overBudget);
+        printf("Calibration: master %.3f sec, %zu hot pixels, %.3f ms (budget %d ms, %zu/%zu frames over)\n",
+               calibration.masterExposure, calibration.hotPixels, calibration.seconds * 1E3,
+               CALIBRATION_BUDGET_MS, overBudget, frames);
+    }
+
+    ClusterStats clusters;
+    bool clustersSent = false;
+    if (light && m_findClusters)
+    {
+        clustersSent = m_clusterFinder.Push(image, x, y, info.startX, info.startY, info.bin, calibrated,
+                                            m_exposureTime, clusters);
+        LatencyRecordSec(LAT_CLUSTERS, clusters.seconds);
+        printf("Clusters: %zu (%zu pixels, %zu dropped), %zu bytes in %.3f ms%s\n", clusters.clusters,
+               clusters.pixels, clusters.dropped, clusters.bytes, clusters.seconds * 1E3,
+               clusters.noiseMap ? "" : ", flat threshold");
+    }
+
+    FrameJob job;
+    job.info = info;
+    if (calibrated)
+        job.info.masterExposure = calibration.masterExposure;
+    // a frame is never lost because its clusters could not be sent
+    job.keepRaw = m_keepRaw || !clustersSent;
+    job.exposureSec = std::chrono::duration<double>(readyTime - exposureStart).count();
+    job.readoutSec = readSec;
+    job.frame = std::move(frame);
+    job.readyTime = readyTime;
+    job.timing.wallSec[StageWait] = job.exposureSec;
+    job.timing.cpuSec[StageWait] = waitStats.cpuSec;
+    job.timing.wallSec[StageReadout] = readSec;
+    job.timing.cpuSec[StageReadout] = readCpu;
+    job.timing.wallSec[StageProcess] = std::chrono::duration<double>(std::chrono::steady_clock::now() - processStart).count();
+    job.timing.cpuSec[StageProcess] = threadCpuSec() - processCpu;
+
+    // Hand the frame over and go on with the next exposure, the push blocks if the writer falls behind
+    if (m_pipelined && m_writer.Push(job))
+    {
+        BoundedStage<FrameJob>::Stats stats = m_writer.GetStats();
+        printf("Writer queue %zu/%d (max %zu), photo worker blocked %.3f sec in total\n",
+               stats.depth, WRITER_QUEUE_DEPTH, stats.maxDepth, stats.blockedSec);
+        return true;
+    }
+
+    return writeFrame(job, 0);
+}
+
+bool Camera::writeFrame(FrameJob& job, double queueSec)
+{
+    const FrameInfo& info = job.info;
+    unsigned short* image = job.frame.As<unsigned short>();
+
+    LatencyRecordSec(LAT_QUEUE_WAIT, queueSec);
+    std::chrono::steady_clock::time_point writeStart = std::chrono::steady_clock::now();
+    double writeCpu = threadCpuSec();
+    bool flag = true;
+    if (job.keepRaw)
+    {
+        ScopedLatency save(LAT_SAVE);
+        flag = SaveImage(image, info);
+    }
+
+    std::string filename = info.dir + "/photo_" + info.date + ".tif";
+    TiffMode tiffMode = job.keepRaw ? m_tiffMode.load() : TiffOff;
+    if (tiffMode != TiffOff)
+    {
+        // no sample at all for frames without a TIFF
+        ScopedLatency tiffTimer(LAT_TIFF);
+        if (tiffMode == TiffDisplay8)
+            WriteTIFF(image, info.cols, info.rows, &filename[0]);
+        else
+        {
+            TiffCompression compression = tiffMode == Tiff16Deflate ? TIFF_COMPRESS_DEFLATE
+                                        : tiffMode == Tiff16Lzw ? TIFF_COMPRESS_LZW : TIFF_COMPRESS_NONE;
+            TiffStats tiff;
+            if (m_tiffWriter.Write(image, info.cols, info.rows, filename, compression, tiff))
+                printf("TIFF %d strips, %zu bytes\n", tiff.strips, tiff.bytes);
+        }
+    }
+
+    PreviewStats preview;
+    if (m_previewBin > 0 && m_preview.Push(image, info.cols, info.rows, m_previewBin, preview))
+        LatencyRecordSec(LAT_PREVIEW, preview.seconds);
+    job.frame.Release();
 
-    char filename[256] = "";
-    sprintf(filename, "qsiimage%d.tif", 1);
-    WriteTIFF(image, x, y, filename);
-    delete [] image;
+    if (m_recordTimings)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        job.timing.wallSec[StageQueue] = queueSec;
+        job.timing.wallSec[StageWrite] = std::chrono::duration<double>(now - writeStart).count();
+        job.timing.cpuSec[StageWrite] = threadCpuSec() - writeCpu;
+        job.timing.readyToDiskSec = std::chrono::duration<double>(now - job.readyTime).count();
+        std::lock_guard<std::mutex> lock(m_timingsMutex);
+        m_timings.push_back(job.timing);
+    }
 
     return flag;
 }
@@ -406,16 +628,18 @@ bool Camera::makePhoto(double exposureTime, bool light, std::string dir)
 int Camera::WriteTIFF(unsigned short* buffer, int cols, int rows, char* filename)
 {
 	TIFF *image;
-	unsigned char *out;
-	out = new unsigned char[cols*rows];
+	FramePool::Handle preview = m_framePool.Acquire(cols*rows);
+	if (!preview)
+		return -1;
+	unsigned char *out = preview.Data();
 
 	AdjustImage(buffer, cols, rows, out);
 
 	// Open the TIFF file
 	if((image = TIFFOpen(filename, "w")) == NULL)
 	{
-		printf("Could not open output.tif for writing\n");
-		exit(42);
+		printf("Could not open %s for writing\n", filename);
+		return -1;
 	}
 	
 	// We need to set some values for basic tags before we can add any data
@@ -442,7 +666,6 @@ int Camera::WriteTIFF(unsigned short* buffer, int cols, int rows, char* filename
 	
 	// Close the file
 	TIFFClose(image);
-	delete[] (out);
 	return 0;
 }
 
@@ -452,61 +675,58 @@ void Camera::AdjustImage(unsigned short * buffer, int x, int y, unsigned char *
 	// adjust the image to better display and
 	// covert to a byte array
 	//
-	// Compute the average pixel value and the standard deviation
-	double avg = 0;
-	double total = 0;
-	double deltaSquared = 0;
-	double std = 0;
-
-	for (int j = 0; j < y; j++)
-		for (int i = 0; i < x; i++)
-			total += (double)buffer[((j * x) + i)];
-
-	avg = total / (x * y);
+	// Compute the average pixel value and the standard deviation in one pass
+	ScopedLatency timer(LAT_STATS);
 
-	for (int j = 0; j < y; j++)
-		for (int i = 0; i < x; i++)
-			deltaSquared += std::pow((avg - buffer[((j * x) + i)]), 2);
-
-	std = std::sqrt(deltaSquared / ((x * y) - 1));
+	size_t count = (size_t)x * y;
+	ImageStat stat = ComputeImageStat(buffer, count);
 	
 	// re-scale scale pixels to three standard deviations for display
-	double minVal = avg - std*3;
+	double minVal = stat.mean - stat.std*3;
 	if (minVal < 0) minVal = 0;
-	double maxVal = avg + std*3;
+	double maxVal = stat.mean + stat.std*3;
 	if (maxVal > 65535) maxVal = 65535;
-	double range = maxVal - minVal;
-	if (range == 0)
-		range = 1;
-	double spread = 65535 / range;
 	//
 	// Copy image to bitmap for display and scale during the copy
 	//
-	int pix;
-	double pl;
-	unsigned char level;
-	
-	for (int j = 0; j < y; j++)
-	{
-		for (int i = 0; i < x; i++)
-		{
-			pix = ((j * x) + i);
-			pl = (double)buffer[pix];
-			// Spread out pixel values for better viewing
-			pl = (pl - minVal) * spread;
-			// Scale pixel value
-			pl = (pl*255)/65535;
-			if (pl > 255) pl = 255;
-			//
-			level = (unsigned char)pl;
-			out[pix] = level;
-		}
-	}
+	StretchImage(buffer, count, minVal, maxVal, out);
 	return;
 }
 
+std::string Camera::lastError()
+{
+    std::lock_guard<std::recursive_mutex> usb(m_usbMutex);
+    std::string last("");
+    get_LastError(last);
+    return last;
+}
+
+bool Camera::SetCooling(QSICamera::FanMode fan, double setPoint, bool coolerOn)
+{
+    if (setPoint < MIN_TEMP || setPoint > MAX_TEMP)
+        return false;
+    try
+    {
+        // quick calls, but not in the middle of a readout
+        std::lock_guard<std::recursive_mutex> usb(m_usbMutex);
+        put_FanMode(fan);
+        put_SetCCDTemperature(setPoint);
+        put_CoolerOn(coolerOn);
+    }
+    catch (std::runtime_error &err)
+    {
+        std::string text = err.what();
+        std::cout << text << "\n";
+        std::cout << lastError() << "\n";
+        return false;
+    }
+    printf("Cooling: fan %d, set point %.1f, cooler %s\n", fan, setPoint, coolerOn ? "on" : "off");
+    return true;
+}
+
 bool Camera::ChangeShutterMode(bool isOpen)
 {
+    std::lock_guard<std::recursive_mutex> usb(m_usbMutex);
     put_ManualShutterMode(true);
     put_ManualShutterOpen(isOpen);
     put_ManualShutterMode(false);
@@ -514,6 +734,63 @@ bool Camera::ChangeShutterMode(bool isOpen)
     return true;
 }
 
+bool Camera::SetPreviewBinning(int bin)
+{
+    if (bin < 0 || bin > MAX_PREVIEW_BIN)
+        return false;
+
+    m_previewBin = bin;
+    return true;
+}
+
+bool Camera::applyReadoutMode(const ReadoutMode& mode)
+{
+    if (mode == m_readoutMode)
+        return true;
+
+    int bin = mode.bin;
+    if (bin < 1 || bin > m_maxBin || mode.startX < 0 || mode.startY < 0 ||
+        mode.startX >= m_sensorX || mode.startY >= m_sensorY || mode.numX < 0 || mode.numY < 0)
+    {
+        std::cout << "Wrong readout mode\n";
+        return false;
+    }
+    // the camera takes the window in binned pixels
+    long width = m_sensorX - mode.startX;
+    long height = m_sensorY - mode.startY;
+    if (mode.numX > 0 && mode.numX < width)
+        width = mode.numX;
+    if (mode.numY > 0 && mode.numY < height)
+        height = mode.numY;
+    if (width < bin || height < bin)
+    {
+        std::cout << "Readout window is smaller than one binned pixel\n";
+        return false;
+    }
+
+    try
+    {
+        std::lock_guard<std::recursive_mutex> usb(m_usbMutex);
+        put_BinX(bin);
+        put_BinY(bin);
+        put_StartX(mode.startX / bin);
+        put_StartY(mode.startY / bin);
+        put_NumX(width / bin);
+        put_NumY(height / bin);
+    }
+    catch (std::runtime_error &err)
+    {
+        std::string text = err.what();
+        std::cout << text << "\n";
+        std::cout << lastError() << "\n";
+        return false;
+    }
+
+    m_readoutMode = mode;
+    printf("Readout mode: %ldx%ld from (%d, %d), bin %d\n", width / bin, height / bin, mode.startX, mode.startY, bin);
+    return true;
+}
+
 bool Camera::SetExposureTime(double& value)
 {
     if (value > m_maxExposureTime)
@@ -528,8 +805,23 @@ bool Camera::SetExposureTime(double& value)
 
 bool Camera::Disconnect()
 {
+    m_telemetry.Stop();
+    // no new task may start on a camera going away: queued ones are dropped, the one running is finished
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        while (!queueTask.empty())
+            queueTask.pop();
+        stop_flag = true;
+    }
+    readyToRun.notify_one();
+    if (photoWorker.joinable())
+        photoWorker.join();
+    // Let the writer put the frames it still holds on disk
+    m_writer.Stop();
+
     try
     {
+        std::lock_guard<std::recursive_mutex> usb(m_usbMutex);
         put_FanMode(QSICamera::fanFull);
 	bool coolerOn;
 	int result = get_CoolerOn(&coolerOn);
@@ -544,147 +836,377 @@ bool Camera::Disconnect()
     {
 	std::string text = err.what();
 	std::cout << text << "\n";
-	std::string last("");
-	get_LastError(last);
-	std::cout << last << "\n";
+	std::cout << lastError() << "\n";
 	std::cout << "exiting with errors\n";
 	return false;
     }
 
-    stop_flag = true;
-    if (photoWorker.joinable())
-    {
-	readyToRun.notify_one();
-        photoWorker.join();
-    }
-
     return true;
 }
 
+FrameInfo Camera::collectFrameInfo(int cols, int rows, const std::string& dir)
+{
+    FrameInfo info;
+    std::lock_guard<std::recursive_mutex> usb(m_usbMutex);
+    get_LastExposureStartTime(info.date);
+    info.exposureTime = m_exposureTime;
+    get_ShutterPriority(&info.shutterPriority);
+    get_ReadoutSpeed(info.readoutSpeed);
+    get_CameraGain(&info.gain);
+    get_ElectronsPerADU(&info.ePerADU);
+    get_CCDTemperature(&info.ccdTemp);
+    info.cols = cols;
+    info.rows = rows;
+    // the camera starts the window on a whole binned pixel
+    info.bin = m_readoutMode.bin;
+    info.startX = m_readoutMode.startX / info.bin * info.bin;
+    info.startY = m_readoutMode.startY / info.bin * info.bin;
+    info.dir = dir;
+    info.compressed = m_compressRaw;
+    return info;
+}
+
 bool Camera::SaveImage(unsigned short* image, int cols, int rows, std::string dir)
 {
-    std::string last_time;
-    get_LastExposureStartTime(last_time);
-    std::string filename = dir + "/photo_" + last_time + ".dat";
+    return SaveImage(image, collectFrameInfo(cols, rows, dir));
+}
+
+bool Camera::SaveImage(const unsigned short* image, const FrameInfo& info)
+{
+    std::string filename = info.dir + "/photo_" + info.date + ".dat";
     std::cout << "Wrtie objects to " << filename << std::endl;
 
     std::ofstream fout(filename, std::ios::binary);
     if (!fout.is_open())
         return false;
 
-    struct timespec start, finish;
-    clock_gettime(CLOCK_REALTIME, &start);
-
-    fout << "date " << last_time << std::endl;
+    fout << "date " << info.date << std::endl;
 
-    fout << "exposureTime " << m_exposureTime << std::endl;
+    fout << "exposureTime " << info.exposureTime << std::endl;
 
     fout << "shutterPriority ";
-    QSICamera::ShutterPriority priority;
-    get_ShutterPriority(&priority);
-    if (priority == 0)
+    if (info.shutterPriority == 0)
         fout << "ShutterPriorityMechanical" << std::endl;
     else
         fout << "ShutterPriorityElectronic" << std::endl;
 
     fout << "readoutSpeed ";
-    QSICamera::ReadoutSpeed readout;
-    get_ReadoutSpeed(readout);
-    if (readout == 0)
+    if (info.readoutSpeed == 0)
         fout << "HighImageQuality" << std::endl;
     else
         fout << "FastReadout" << std::endl;
 
     fout << "gain ";
-    QSICamera::CameraGain gain;
-    get_CameraGain(&gain);
-    if (gain == 0)
+    if (info.gain == 0)
         fout << "HighGain" << std::endl;
-    else if (gain == 1)
+    else if (info.gain == 1)
         fout << "LowGain" << std::endl;
     else
         fout << "AutoGain" << std::endl;
     
-    double eADU;
-    get_ElectronsPerADU(&eADU);
-    fout << "ePerADU " << eADU << std::endl;
+    fout << "ePerADU " << info.ePerADU << std::endl;
 
-    double ccdTemp;
-    get_CCDTemperature(&ccdTemp);
-    fout << "ccdTemp " << ccdTemp << std::endl;
+    fout << "ccdTemp " << info.ccdTemp << std::endl;
 
-    fout << "xSize " << cols << std::endl;
-    fout << "ySize " << rows << std::endl;
+    fout << "startX " << info.startX << std::endl;
+    fout << "startY " << info.startY << std::endl;
+    fout << "bin " << info.bin << std::endl;
 
-    fout.write((char const*)image, sizeof(image[0]) * cols * rows);
+    if (info.masterExposure >= 0)
+    {
+        fout << "masterExposure " << info.masterExposure << std::endl;
+        fout << "pedestal " << CALIBRATION_PEDESTAL << std::endl;
+    }
+
+    // ySize has to stay the last header line, the pixels start right after it
+    if (info.compressed)
+    {
+        fout << "compression " << RAWCODEC_NAME << std::endl;
+        fout << "bandRows " << RAW_BAND_ROWS << std::endl;
+    }
+
+    // The pixels start at a multiple of 8 bytes so readers can use the mapped file in place
+    std::string sizeLines = "xSize " + std::to_string(info.cols) + "\nySize " + std::to_string(info.rows) + "\n";
+    long offset = (long)fout.tellp() + sizeLines.size();
+    if (offset % 8 != 0)
+        fout << "pad " << std::string((8 - (offset + 5) % 8) % 8, '0') << std::endl;
+    fout << sizeLines;
+
+    size_t rawBytes = sizeof(image[0]) * info.cols * info.rows;
+    if (info.compressed)
+    {
+        // table of compressed band sizes (little endian uint32) followed by the bands
+        std::lock_guard<std::mutex> lock(m_rawBandsMutex);
+        uint64_t encodeStart = LATENCY_Now();
+        EncodeRawBands(image, info.cols, info.rows, RAW_BAND_ROWS, m_rawBands);
+        double sec = (LATENCY_Now() - encodeStart) * 1E-9;
+
+        std::vector<uint32_t> sizes;
+        size_t packedBytes = 0;
+        for (const auto& band : m_rawBands)
+        {
+            sizes.push_back(band.size());
+            packedBytes += band.size();
+        }
+        fout.write((char const*)sizes.data(), sizeof(sizes[0]) * sizes.size());
+        for (const auto& band : m_rawBands)
+            fout.write((char const*)band.data(), band.size());
+
+        printf("Compressed %zu -> %zu bytes (ratio %.2f) at %.1f MB/s\n",
+               rawBytes, packedBytes, (double)rawBytes / packedBytes, rawBytes / sec * 1E-6);
+    }
+    else
+        fout.write((char const*)image, rawBytes);
 
     fout.close();
 
     std::cout << "Finish saving" << std::endl;
-    clock_gettime(CLOCK_REALTIME, &finish);
-    printf("Converting time %.9f sec\n", (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) * 1E-9);
 
     return true;
 }
 
 
 
+/* Command from the server waiting for the command thread */
+struct ServerCommand {
+    ParsedCommand parsed;
+    ParseStatus status = PARSE_EMPTY;
+    uint64_t receivedNs = 0;    // LATENCY_Now() in the receive callback
+};
+
+// Defined after CAMERA, so the command thread is stopped before the camera is destroyed
+static BoundedStage<ServerCommand> COMMANDS;
+static unsigned long NEXT_COMMAND_ID = 1;
+
 /* This is used for adding json-type string in queue */
-static void add_answer_to_queue(const std::string& command, bool success) {
-    std::string json = "{\"type\":\"answer\",\"status\":\""
-                     + (success ? std::string("success") : std::string("error"))
-                     + "\",\"oncommand\":\""
-                     + command
-                     + "\"}";
-    QUEUE_NewMsg(json.c_str()); // queue.c
+static void add_answer_to_queue(const ServerCommand& command, bool success) {
+    uint64_t latencyNs = LATENCY_Now() - command.receivedNs;
+    LATENCY_Record(LAT_COMMAND, latencyNs);
+    char json[192];
+    snprintf(json, sizeof(json),
+             "{\"type\":\"answer\",\"status\":\"%s\",\"oncommand\":\"%s\",\"id\":%lu,\"latency\":%.3f}",
+             success ? "success" : "error", command.parsed.name, command.parsed.id, latencyNs / 1E6);
+    QUEUE_NewMsg(json); // queue.c
 }
 
-/* Functions which are called from main.c */
-#include <cstring>
-void handle_server_command(const char* msg, size_t len) {
-    if (!msg || len == 0) {
-		return;
-    }
+/* Handlers run on the command thread, camera calls here may take seconds of USB I/O */
+static bool run_connect(const ParsedCommand&) {
+    return CAMERA.Connect();
+}
 
-	/* get command TODO get params*/
-    const char* space = static_cast<const char*>(memchr(msg, ' ', len));
-    size_t cmd_len = space ? static_cast<size_t>(space - msg) : len;
+static bool run_disconnect(const ParsedCommand&) {
+    return CAMERA.Disconnect();
+}
 
-    std::string command(msg, cmd_len);
+static bool run_cancel(const ParsedCommand&) {
+    return CAMERA.StopPhoto();
+}
 
-    /* Command handling */
-    if (command == "connect") {
-        bool status = CAMERA.Connect();
-        add_answer_to_queue("connect", status);
+static bool run_set(const ParsedCommand& command) {
+    const SetArgs& set = command.set;
+    return CAMERA.SetCooling((QSICamera::FanMode)set.fan, set.setPoint, set.cooler);
+}
 
+static bool run_phototask(const ParsedCommand& command) {
+    const PhotoTaskArgs& photo = command.photo;
+    ReadoutMode mode;
+    if (photo.roi) {
+        mode.startX = photo.startX;
+        mode.startY = photo.startY;
+        mode.numX = photo.width;
+        mode.numY = photo.height;
     }
-    else if (command == "disconnect") {
-        bool status = CAMERA.Disconnect();
-        add_answer_to_queue("disconnect", status);
+    mode.bin = photo.bin;
+    return CAMERA.PushTakeNPhoto(photo.exposureMs / 1E3, photo.count, "pics", photo.light, mode);
+}
 
-    }
-    else if (command == "cancel") {
-        bool status = CAMERA.StopPhoto();
-        add_answer_to_queue("cancel", status);
+static bool run_latency(const ParsedCommand& command) {
+    LATENCY_PushSnapshot(command.reset);
+    return true;
+}
+
+static bool run_calib(const ParsedCommand& command) {
+    const CalibArgs& calib = command.calib;
+    if (calib.collect)
+        CAMERA.CollectMasterDarks(calib.frames, (CombineMethod)calib.method);
+    else
+        CAMERA.SetCalibration(calib.on);
+    return true;
+}
 
+static bool run_clusters(const ParsedCommand& command) {
+    const ClusterArgs& clusters = command.clusters;
+    // a map that does not load leaves the finder as it was
+    if (clusters.noiseMap[0] && !CAMERA.LoadNoiseMap(clusters.noiseMap, clusters.noiseExposureMs / 1E3, clusters.nSigma)) {
+        std::cout << "No noise map for " << clusters.noiseExposureMs << " ms in " << clusters.noiseMap << "\n";
+        return false;
     }
-	else if (command == "set") {
-		// TODO установить параметры
-		add_answer_to_queue("set", true);
-	}
-    else if (command == "phototask") {
-        // TODO запуск фотографии
-        add_answer_to_queue("phototask", true);
+    CAMERA.SetClusterFinding(clusters.on, clusters.keepRaw);
+    return true;
+}
+
+static bool run_compress(const ParsedCommand& command) {
+    CAMERA.SetRawCompression(command.compress);
+    return true;
+}
+
+static bool run_tiff(const ParsedCommand& command) {
+    CAMERA.SetTiffMode((Camera::TiffMode)command.tiffMode);
+    return true;
+}
+
+typedef bool (*command_handler_t)(const ParsedCommand& command);
+
+/* Handler of every CommandId (commands.h), false - error answer */
+static constexpr command_handler_t COMMAND_HANDLERS[CMD_COUNT] = {
+    nullptr, run_connect, run_disconnect, run_cancel, run_set, run_phototask, run_latency, run_calib,
+    run_clusters, run_compress, run_tiff
+};
+// the latency snapshot is the answer itself
+static constexpr bool COMMAND_ANSWERED[CMD_COUNT] = {true, true, true, true, true, true, false, true, true, true, true};
+
+static void run_server_command(const ServerCommand& command) {
+    CommandId id = command.parsed.command;
+    bool status = command.status == PARSE_OK && COMMAND_HANDLERS[id](command.parsed);
+    if (command.status != PARSE_OK || COMMAND_ANSWERED[id])
+        add_answer_to_queue(command, status);
+}
+
+/* Functions which are called from main.c */
+void handle_server_command(const char* msg, size_t len) {
+    if (!msg || len == 0) {
+		return;
     }
-    else {
-        // shit happens
+
+    // Only parse and queue here, this is the websocket service thread
+    ServerCommand command;
+    command.receivedNs = LATENCY_Now();
+    command.status = ParseCommand(msg, len, command.parsed);
+    if (command.status == PARSE_EMPTY)
+        return;
+    if (command.parsed.id == 0)
+        command.parsed.id = NEXT_COMMAND_ID++;
+    // unknown commands and bad arguments never reach the camera
+    if (command.status != PARSE_OK) {
+        add_answer_to_queue(command, false);
         return;
     }
-}
 
+    if (!COMMANDS.Running())
+        COMMANDS.Start(COMMAND_QUEUE_DEPTH, 1, [](ServerCommand& queued, double) { run_server_command(queued); });
+    // a full queue means the camera is stuck, better an error now than a stalled service loop
+    if (!COMMANDS.TryPush(command))
+        add_answer_to_queue(command, false);
+}
 
 void get_camera_status(void) {
+    // only cached values, the websocket loop must not wait on the camera
+    TelemetrySnapshot telemetry = CAMERA.GetTelemetry();
+    if (!telemetry.valid)
+        return;
 
+    static const char* FAN_NAMES[] = {"off", "quiet", "full"};
+    const char* fan = telemetry.fanMode >= 0 && telemetry.fanMode < 3 ? FAN_NAMES[telemetry.fanMode] : "unknown";
+    char json[320];
+    snprintf(json, sizeof(json),
+             "{\"type\":\"info\",\"ccd\":%.2f,\"sink\":%.2f,\"fan\":\"%s\",\"cooler\":%s,\"power\":%.1f,"
+             "\"setpoint\":%.2f,\"state\":%d,\"age\":%.3f}",
+             telemetry.ccdTemp, telemetry.sinkTemp, fan, telemetry.coolerOn ? "true" : "false",
+             telemetry.coolerPower, telemetry.setPoint, telemetry.cameraState,
+             (LATENCY_Now() - telemetry.sampleNs) * 1E-9);
+    // a newer status replaces one which is not sent yet
+    QUEUE_NewMsgLane(QUEUE_LANE_TELEMETRY, json);
+}
 
+/* value below which p percent of the sorted values are */
+static double percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t i = std::min(sorted.size() - 1, (size_t)std::ceil(p / 100. * sorted.size()) - (p > 0));
+    return sorted[i];
 }
 
+static double processCpuSec()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1E-6;
+}
+
+int run_benchmark(int frames, double exposureMs)
+{
+    if (frames <= 0 || !CAMERA.Connect())
+        return 1;
+    mkdir(BENCHMARK_DIR, 0755);
+
+    double exposureSec = exposureMs / 1E3;
+    CAMERA.SetExposureTime(exposureSec);
+    size_t takenBefore = CAMERA.GetFramesTaken();
+    size_t writtenBefore = CAMERA.GetWriterStats().processed;
+    CAMERA.RecordTimings(true);
+
+    double cpuStart = processCpuSec();
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point deadline = begin + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(frames * (exposureSec + BENCHMARK_FRAME_TIMEOUT)));
+    CAMERA.PushTakeNPhoto(exposureSec, frames, BENCHMARK_DIR, true);
+
+    // done when every task is taken and the writer has nothing left
+    bool done = false;
+    while (!done && std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        BoundedStage<FrameJob>::Stats writer = CAMERA.GetWriterStats();
+        done = CAMERA.GetFramesTaken() - takenBefore >= (size_t)frames && writer.pushed == writer.processed;
+    }
+    double elapsedSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    double cpuSec = processCpuSec() - cpuStart;
+    std::vector<FrameTiming> timings = CAMERA.GetTimings();
+    CAMERA.RecordTimings(false);
+    CAMERA.StopPhoto();
+    CAMERA.Disconnect();
+    std::map<ReadoutMode, ReadoutModeStats> modes = CAMERA.GetModeStats();
+
+    std::vector<double> latencies;
+    FrameTiming total;
+    for (const FrameTiming& timing : timings)
+    {
+        latencies.push_back(timing.readyToDiskSec);
+        for (int stage = 0; stage < STAGE_COUNT; stage++)
+        {
+            total.wallSec[stage] += timing.wallSec[stage];
+            total.cpuSec[stage] += timing.cpuSec[stage];
+        }
+    }
+    std::sort(latencies.begin(), latencies.end());
+    size_t written = timings.size();
+
+    printf("Benchmark: %zu of %d frames of %.3f sec in %.3f sec, %.2f fps%s\n", written, frames, exposureSec,
+           elapsedSec, written / elapsedSec, done ? "" : ", timed out");
+    printf("Writer: %zu frames, pipelined %d\n", CAMERA.GetWriterStats().processed - writtenBefore, CAMERA.IsPipelined());
+    printf("ImageReady to disk: p50 %.1f, p90 %.1f, p99 %.1f, max %.1f ms\n", percentile(latencies, 50) * 1E3,
+           percentile(latencies, 90) * 1E3, percentile(latencies, 99) * 1E3, percentile(latencies, 100) * 1E3);
+
+    static const char* STAGE_NAMES[STAGE_COUNT] = {"wait", "readout", "process", "queue", "write"};
+    printf("%-8s %12s %12s\n", "stage", "wall ms", "cpu ms");
+    for (int stage = 0; stage < STAGE_COUNT && written > 0; stage++)
+        printf("%-8s %12.2f %12.2f\n", STAGE_NAMES[stage], total.wallSec[stage] / written * 1E3,
+               total.cpuSec[stage] / written * 1E3);
+    printf("Process CPU: %.3f sec, %.0f%% of one core\n", cpuSec, cpuSec / elapsedSec * 100);
+    FramePool::Counters pool = CAMERA.GetFramePoolCounters();
+    printf("Frame pool: %zu allocations (%zu MB) for %zu checkouts\n", pool.allocations, pool.bytesAllocated >> 20,
+           pool.acquires);
+    for (const auto& item : modes)
+    {
+        const ReadoutModeStats& mode = item.second;
+        if (mode.frames == 0)
+            continue;
+        printf("Mode %d (%dx%d from (%d, %d), bin %d): %zu frames, %zu bytes per frame, readout %.3f sec on average\n",
+               mode.id, item.first.numX, item.first.numY, item.first.startX, item.first.startY, item.first.bin,
+               mode.frames, mode.bytes / mode.frames, mode.readoutSec / mode.frames);
+    }
+    printf("%s\n", LatencySnapshotJson(false).c_str());
+
+    return done && written == (size_t)frames ? 0 : 1;
+}
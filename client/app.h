@@ -18,12 +18,56 @@
 #include <mutex>
 #include <thread>
 #include <queue>
+#include <map>
+#include <tuple>
 
 // Save
 #include "tiffio.h"
 
-// QSI Camera
+// QSI Camera, or its simulation for running the client without one
+#ifdef CAMERA_SIMULATED
+#include "simcamera.h"
+#else
 #include "qsiapi.h"
+#endif
+
+// Frame buffers
+#include "framepool.h"
+#include "rawcodec.h"
+#include "pipeline.h"
+#include "readywait.h"
+#include "preview.h"
+#include "tiffwriter.h"
+#include "calibration.h"
+#include "clusterfind.h"
+#include "telemetry.h"
+
+/* Part of the sensor to read out: window in unbinned sensor pixels and hardware binning.
+ * numX/numY 0 - up to the sensor edge, so the default is the full frame */
+struct ReadoutMode {
+    int startX = 0;
+    int startY = 0;
+    int numX = 0;
+    int numY = 0;
+    int bin = 1;
+
+    bool operator==(const ReadoutMode& other) const
+    {
+        return std::tie(startX, startY, numX, numY, bin) == std::tie(other.startX, other.startY, other.numX, other.numY, other.bin);
+    }
+    bool operator<(const ReadoutMode& other) const
+    {
+        return std::tie(startX, startY, numX, numY, bin) < std::tie(other.startX, other.startY, other.numX, other.numY, other.bin);
+    }
+};
+
+/* Readout time and size of the frames taken in one mode */
+struct ReadoutModeStats {
+    int id = 0;
+    size_t frames = 0;
+    double readoutSec = 0;
+    size_t bytes = 0;
+};
 
 struct CameraPhotoTask {
     bool m_status = false;
@@ -32,9 +76,69 @@ struct CameraPhotoTask {
     std::string m_dir;
     std::string m_pushTime;
     std::string m_startTime;
+    ReadoutMode m_mode;
+};
+
+/* Everything SaveImage needs to know about a frame, captured right after readout */
+struct FrameInfo {
+    std::string date;
+    double exposureTime = 0;
+    QSICamera::ShutterPriority shutterPriority;
+    QSICamera::ReadoutSpeed readoutSpeed;
+    QSICamera::CameraGain gain;
+    double ePerADU = 0;
+    double ccdTemp = 0;
+    int cols = 0;
+    int rows = 0;
+    int startX = 0;         // first pixel on the sensor, unbinned
+    int startY = 0;
+    int bin = 1;
+    std::string dir;
+    bool compressed = false;   // pixels coded with rawcodec instead of raw
+    double masterExposure = -1;   // master dark subtracted on the client, < 0 - raw frame
+};
+
+/* Stages of a frame in the client, timed while benchmarking */
+enum FrameStage {
+    StageWait,              // exposure and the wait for ImageReady
+    StageReadout,           // get_ImageArray
+    StageProcess,           // calibration and cluster finding
+    StageQueue,             // waiting for the writer
+    StageWrite,             // .dat, TIFF and preview
+    STAGE_COUNT
+};
+
+/* Wall and CPU time of one frame per stage. CPU is the time of the thread running the stage,
+ * helper threads of ParallelFor are not counted */
+struct FrameTiming {
+    double readyToDiskSec = 0;      // from ImageReady to the end of the write stage
+    double wallSec[STAGE_COUNT] = {};
+    double cpuSec[STAGE_COUNT] = {};
+};
+
+/* A finished frame handed from the photo worker to the writer stage */
+struct FrameJob {
+    FramePool::Handle frame;
+    FrameInfo info;
+    double exposureSec = 0;
+    double readoutSec = 0;
+    bool keepRaw = true;    // false - only the cluster records of this frame are kept
+    std::chrono::steady_clock::time_point readyTime;
+    FrameTiming timing;
 };
 
 class Camera: public QSICamera {
+public:
+    /* What goes to photo_<date>.tif next to the .dat file */
+    enum TiffMode {
+        TiffOff,
+        TiffDisplay8,       // 8-bit image stretched for viewing
+        Tiff16,             // full 16-bit data
+        Tiff16Deflate,
+        Tiff16Lzw
+    };
+
+private:
     double m_exposureTime, m_minExposureTime, m_maxExposureTime;
     std::atomic<bool> m_doPhoto, m_doTransferring;
     std::atomic<bool> stop_flag;;
@@ -45,8 +149,43 @@ class Camera: public QSICamera {
     CameraPhotoTask popTask();
     CameraPhotoTask m_currentTask;
     std::thread photoWorker;
+    FramePool m_framePool;
+    BoundedStage<FrameJob> m_writer;
+    std::atomic<bool> m_pipelined;
+    ReadyWaiter m_readyWaiter;
+    PreviewGenerator m_preview;
+    std::atomic<int> m_previewBin;
+    std::atomic<bool> m_compressRaw;
+    std::vector<std::vector<uint8_t>> m_rawBands;
+    std::mutex m_rawBandsMutex;
+    std::atomic<TiffMode> m_tiffMode;
+    TiffWriter m_tiffWriter;
+    Calibration m_calibration;
+    std::atomic<bool> m_calibrate;
+    ClusterFinder m_clusterFinder;
+    std::atomic<bool> m_findClusters;
+    std::atomic<bool> m_keepRaw;
+    long m_sensorX, m_sensorY;
+    short m_maxBin;
+    ReadoutMode m_readoutMode;
+    std::map<ReadoutMode, ReadoutModeStats> m_modeStats;
+    std::atomic<size_t> m_framesTaken;
+    std::atomic<bool> m_recordTimings;
+    std::mutex m_timingsMutex;
+    std::vector<FrameTiming> m_timings;
+    // every camera call, recursive so helpers like lastError can be called with it held. The telemetry
+    // sampler only tries it
+    std::recursive_mutex m_usbMutex;
+    TelemetrySampler m_telemetry;
     void photoWorkerLoop();
-    bool makePhoto(double exposureTime, bool light = true, std::string dir = "pics");
+    bool makePhoto(double exposureTime, bool light = true, std::string dir = "pics", const ReadoutMode& mode = ReadoutMode());
+    /* Reconfigures the camera only if mode differs from the current one */
+    bool applyReadoutMode(const ReadoutMode& mode);
+    FrameInfo collectFrameInfo(int cols, int rows, const std::string& dir);
+    bool readTelemetry(TelemetrySnapshot& snapshot);
+    /* get_LastError under the USB lock */
+    std::string lastError();
+    bool writeFrame(FrameJob& job, double queueSec);
 
 public:
     Camera();
@@ -54,10 +193,30 @@ public:
     bool Connect();
     bool Disconnect();
     bool ChangeShutterMode(bool isOpen = false);
+    /* Fan mode, cooler set point (MIN_TEMP..MAX_TEMP, commands.h) and cooler on/off */
+    bool SetCooling(QSICamera::FanMode fan, double setPoint, bool coolerOn);
     bool SetExposureTime(double& value);
-    bool PushTakeNPhoto(double exposureTime, int nPhoto, std::string dir = "pics", bool light = true);
+    bool PushTakeNPhoto(double exposureTime, int nPhoto, std::string dir = "pics", bool light = true,
+                        const ReadoutMode& mode = ReadoutMode());
     bool StopPhoto();
     bool SaveImage(unsigned short* image, int cols, int rows, std::string dir = "pics");
+    bool SaveImage(const unsigned short* image, const FrameInfo& info);
+    /* In pipelined mode frames are saved by the writer stage while the next exposure runs */
+    void SetPipelined(bool value) {m_pipelined = value;};
+    bool IsPipelined() {return m_pipelined;};
+    /* Binning of the preview sent to the server after every frame, 0 - no preview */
+    bool SetPreviewBinning(int bin);
+    /* Lossless compressed pixels in the .dat files */
+    void SetRawCompression(bool value) {m_compressRaw = value;};
+    void SetTiffMode(TiffMode mode) {m_tiffMode = mode;};
+    /* Dark subtraction and hot pixel masking of light frames right after readout */
+    void SetCalibration(bool value) {m_calibrate = value;};
+    /* The next frames darks of every exposure time are combined into its master dark */
+    void CollectMasterDarks(int frames, CombineMethod method = COMBINE_MEDIAN) {m_calibration.CollectDarks(frames, method);};
+    /* Cluster records of every light frame are sent to the server, the raw frame is saved only if keepRaw */
+    void SetClusterFinding(bool value, bool keepRaw = true) {m_findClusters = value; m_keepRaw = keepRaw;};
+    /* Noise map for the cluster threshold from a .planes file made by the analysis macros */
+    bool LoadNoiseMap(const std::string& planesPath, double exposureTime, double nSigma) {return m_clusterFinder.LoadNoiseMap(planesPath, exposureTime, nSigma);};
     double GetMinExposureTime() {return m_minExposureTime;};
     double GetMaxExposureTime() {return m_maxExposureTime;};
     int WriteTIFF(unsigned short* buffer, int cols, int rows, char* filename);
@@ -67,6 +226,20 @@ public:
     bool DoTransferring() {return m_doTransferring;};
     struct timespec GetTaskStartTime() {return start;};
     struct timespec GetTaskPreliminaryEndTime() {return end;};
+    /* Prediction error, polls and CPU time of the last wait for ImageReady */
+    ReadyWaiter::Stats GetLastReadyWaitStats() {return m_readyWaiter.GetLastStats();};
+    /* Last telemetry sample, valid is false while not connected */
+    TelemetrySnapshot GetTelemetry() {return m_telemetry.Get();};
+    void SetTelemetryPeriod(int periodMs) {m_telemetry.SetPeriod(periodMs);};
+    /* Photo tasks done by the photo worker, failed ones included */
+    size_t GetFramesTaken() {return m_framesTaken;};
+    BoundedStage<FrameJob>::Stats GetWriterStats() {return m_writer.GetStats();};
+    FramePool::Counters GetFramePoolCounters() {return m_framePool.GetCounters();};
+    /* Only while no photo is taken, the photo worker updates them unlocked */
+    std::map<ReadoutMode, ReadoutModeStats> GetModeStats() {return m_modeStats;};
+    /* Keep the stage times of every written frame from now on, value = false drops them */
+    void RecordTimings(bool value);
+    std::vector<FrameTiming> GetTimings();
 };
 
 #endif
@@ -80,23 +253,39 @@ extern "C" {
 #endif
 
 /**
- * @brief: handle commands from server by calling c++ camera's API functions, and add new msg with answer to queue
- * @param command: it goes from server and can be one of this several types:
+ * @brief: queue a command from server for the command thread, which calls c++ camera's API functions and adds new
+ * msg with answer to queue. Returns at once, the websocket loop is never blocked by the camera
+ * @param command: "[@<id> ]<name> [params]", the answer has the id (one is made up if none) and the time from
+ * receive to answer in ms. Unknown commands and bad params are answered with an error at once.
+ * The name can be one of this several types (see commands.h):
  *                     1) connect
  *                     2) disconnect
- *                     3) set + params (example 'set 10 10 off' )
- *                     4) phototask + params
+ *                     3) set <off|quiet|full> <set point> [on|off] (example 'set quiet 10')
+ *                     4) phototask <exposure ms> <count> [roi <x> <y> <width> <height>] [bin <n>] [dark]
  *                     5) cancel
- * @return int (bool) 0 - fail  or 1 - success cause it goes to c-func. this value is usually send to server
+ *                     6) latency [reset] - stage latency histograms (latency.h)
+ *                     7) calib <on|off> - dark subtraction of light frames, calib collect <frames> [median|sigmaclip] -
+ *                        combine the next darks of every exposure into its master (calibration.h)
+ *                     8) clusters <on|off> [keep|drop] [noisemap <file.planes> <exposure ms> <nsigma>] - cluster
+ *                        records of light frames, keep or drop the raw frame, threshold from a noise map (clusterfind.h)
+ *                     9) compress <on|off> - lossless compressed pixels in the .dat files (rawcodec.h)
+ *                    10) tiff <off|display|16|deflate|lzw> - the TIFF saved next to every .dat file (tiffwriter.h)
  */
 void handle_server_command(const char* command, size_t len);
 
 /**
- * @brief add new msg with status to queue
- * @return int (bool) 0 -fail or 1 -success
+ * @brief add an info msg with the last telemetry sample (ccd, sink, fan, cooler...) to queue,
+ * nothing while the camera is not connected. Never calls the camera itself
  */
 void get_camera_status(void);
 
+/**
+ * @brief take frames light frames of exposureMs with the connected (or simulated) camera and print
+ * frames per second, ImageReady to disk latency percentiles and the time of every stage
+ * @return 0 - success, the process exit code
+ */
+int run_benchmark(int frames, double exposureMs);
+
 #ifdef __cplusplus
     }
 #endif
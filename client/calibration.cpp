@@ -0,0 +1,439 @@
+// Project headers
+#include "calibration.h"
+#include "datreader.h"
+#include "hist16.h"
+#include "pipeline.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CALIBRATION_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define CALIBRATION_NEON
+#include <arm_neon.h>
+#endif
+
+// Every dark of a series is held until the master is built, 32 full frames are about 600 MB
+static const int MAX_SERIES_FRAMES = 32;
+static const double CLIP_SIGMA = 3;
+static const int CLIP_ITERATIONS = 3;
+// A master pixel this many sigma above the median is hot
+static const double HOT_SIGMA = 5;
+// Rows subtracted together by one thread
+static const int APPLY_BAND_ROWS = 64;
+
+typedef void (*subtract_kernel_t)(unsigned short*, const unsigned short*, size_t, unsigned short);
+
+/* image = image + pedestal - master, clamped to [0, 65535]. The vector kernels get the same result with
+ * saturating ops only as (p -sat m) +sat (pedestal -sat (m -sat p)): clipping p + pedestal first would
+ * make bright pixels depend on the kernel */
+static void subtractScalar(unsigned short* p, const unsigned short* m, size_t n, unsigned short pedestal)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        int v = (int)p[i] + pedestal - m[i];
+        p[i] = v < 0 ? 0 : v > 65535 ? 65535 : v;
+    }
+}
+
+#ifdef CALIBRATION_X86
+
+static void subtractSse2(unsigned short* p, const unsigned short* m, size_t n, unsigned short pedestal)
+{
+    const __m128i ped = _mm_set1_epi16((short)pedestal);
+    size_t vecEnd = n & ~(size_t)7;
+    for (size_t i = 0; i < vecEnd; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i d = _mm_loadu_si128((const __m128i*)(m + i));
+        _mm_storeu_si128((__m128i*)(p + i), _mm_adds_epu16(_mm_subs_epu16(v, d), _mm_subs_epu16(ped, _mm_subs_epu16(d, v))));
+    }
+    subtractScalar(p + vecEnd, m + vecEnd, n - vecEnd, pedestal);
+}
+
+__attribute__((target("avx2")))
+static void subtractAvx2(unsigned short* p, const unsigned short* m, size_t n, unsigned short pedestal)
+{
+    const __m256i ped = _mm256_set1_epi16((short)pedestal);
+    size_t vecEnd = n & ~(size_t)15;
+    for (size_t i = 0; i < vecEnd; i += 16)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(m + i));
+        _mm256_storeu_si256((__m256i*)(p + i),
+                            _mm256_adds_epu16(_mm256_subs_epu16(v, d), _mm256_subs_epu16(ped, _mm256_subs_epu16(d, v))));
+    }
+    subtractScalar(p + vecEnd, m + vecEnd, n - vecEnd, pedestal);
+}
+
+#endif // CALIBRATION_X86
+
+#ifdef CALIBRATION_NEON
+
+static void subtractNeon(unsigned short* p, const unsigned short* m, size_t n, unsigned short pedestal)
+{
+    const uint16x8_t ped = vdupq_n_u16(pedestal);
+    size_t vecEnd = n & ~(size_t)7;
+    for (size_t i = 0; i < vecEnd; i += 8)
+    {
+        uint16x8_t v = vld1q_u16(p + i);
+        uint16x8_t d = vld1q_u16(m + i);
+        vst1q_u16(p + i, vqaddq_u16(vqsubq_u16(v, d), vqsubq_u16(ped, vqsubq_u16(d, v))));
+    }
+    subtractScalar(p + vecEnd, m + vecEnd, n - vecEnd, pedestal);
+}
+
+#endif // CALIBRATION_NEON
+
+static subtract_kernel_t selectSubtract()
+{
+#if defined(CALIBRATION_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return subtractAvx2;
+    if (__builtin_cpu_supports("sse2"))
+        return subtractSse2;
+#elif defined(CALIBRATION_NEON)
+    return subtractNeon;
+#endif
+    return subtractScalar;
+}
+
+static void subtract(unsigned short* p, const unsigned short* m, size_t n, unsigned short pedestal)
+{
+    static const subtract_kernel_t kernel = selectSubtract();
+    kernel(p, m, n, pedestal);
+}
+
+static const char* combineName(CombineMethod method)
+{
+    return method == COMBINE_SIGMA_CLIP ? "sigmaclip" : "median";
+}
+
+/* true if the master has the binning of the frame and covers its window */
+static bool covers(const MasterFrame& master, int cols, int rows, int startX, int startY, int bin)
+{
+    return master.bin == bin && master.startX <= startX && master.startY <= startY &&
+           startX + cols * bin <= master.startX + master.cols * bin &&
+           startY + rows * bin <= master.startY + master.rows * bin;
+}
+
+static std::string masterPath(const std::string& dir, double exposureTime)
+{
+    return dir + "/master_" + std::to_string(DatExposureKey(exposureTime)) + "ms.dat";
+}
+
+int Calibration::Load(const std::string& dir)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_dir = dir;
+    m_masters.clear();
+    m_scaled.clear();
+
+    int loaded = 0;
+    for (const auto& group : IndexDatDirectory(dir))
+    {
+        for (const auto& path : group.second)
+        {
+            if (path.find("/master_") == std::string::npos)
+                continue;
+            DatFile file(path);
+            const DatMeta* meta = file.Meta();
+            const uint16_t* pixels = file.Pixels();
+            if (meta == nullptr || pixels == nullptr)
+                continue;
+
+            MasterFrame master;
+            master.exposureTime = meta->exposureTime;
+            master.cols = meta->xSize;
+            master.rows = meta->ySize;
+            master.frames = 1;
+            for (const auto& field : meta->fields)
+            {
+                if (field.first == "frames")
+                    master.frames = std::max(1, atoi(field.second.c_str()));
+                else if (field.first == "combine" && field.second == combineName(COMBINE_SIGMA_CLIP))
+                    master.method = COMBINE_SIGMA_CLIP;
+                else if (field.first == "startX")
+                    master.startX = atoi(field.second.c_str());
+                else if (field.first == "startY")
+                    master.startY = atoi(field.second.c_str());
+                else if (field.first == "bin")
+                    master.bin = std::max(1, atoi(field.second.c_str()));
+            }
+            master.pixels.assign(pixels, pixels + (size_t)master.cols * master.rows);
+            findHotPixels(master);
+            printf("Master %.3f sec: %d frames (%s), %zu hot pixels\n", master.exposureTime, master.frames,
+                   combineName(master.method), master.hotPixels.size());
+            m_masters[group.first] = std::move(master);
+            loaded++;
+        }
+    }
+    return loaded;
+}
+
+void Calibration::CollectDarks(int frames, CombineMethod method)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_seriesLength = std::min(std::max(frames, 0), MAX_SERIES_FRAMES);
+    m_method = method;
+    m_series.clear();
+    m_seriesMode.clear();
+}
+
+bool Calibration::Collecting()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_seriesLength > 0;
+}
+
+bool Calibration::AddDark(double exposureTime, const unsigned short* image, int cols, int rows,
+                          int startX, int startY, int bin)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_seriesLength == 0)
+        return false;
+
+    long key = DatExposureKey(exposureTime);
+    // a series is of one geometry, a dark of another one starts it over
+    std::vector<std::vector<uint16_t>>& series = m_series[key];
+    if (!series.empty() && (m_seriesMode[key] != std::vector<int>{cols, rows, startX, startY, bin}))
+        series.clear();
+    m_seriesMode[key] = {cols, rows, startX, startY, bin};
+    series.emplace_back(image, image + (size_t)cols * rows);
+    if ((int)series.size() < m_seriesLength)
+        return false;
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    MasterFrame master;
+    master.exposureTime = exposureTime;
+    master.frames = series.size();
+    master.method = m_method;
+    master.cols = cols;
+    master.rows = rows;
+    master.startX = startX;
+    master.startY = startY;
+    master.bin = bin;
+    combine(series, master);
+    findHotPixels(master);
+    m_series.erase(key);
+    m_seriesMode.erase(key);
+
+    // scaled masters were made from the old set
+    m_scaled.clear();
+
+    bool saved = save(master);
+    printf("Master %.3f sec from %d frames (%s): %zu hot pixels, %.2f sec%s\n", exposureTime, master.frames,
+           combineName(master.method), master.hotPixels.size(),
+           std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count(),
+           saved ? "" : ", NOT SAVED");
+    m_masters[key] = std::move(master);
+    return true;
+}
+
+void Calibration::combine(const std::vector<std::vector<uint16_t>>& series, MasterFrame& master)
+{
+    size_t count = (size_t)master.cols * master.rows;
+    master.pixels.resize(count);
+    int frames = series.size();
+
+    ParallelFor(master.rows, 0, [&](int row) {
+        std::vector<uint16_t> values(frames);
+        for (size_t i = (size_t)row * master.cols; i < (size_t)(row + 1) * master.cols; i++)
+        {
+            for (int f = 0; f < frames; f++)
+                values[f] = series[f][i];
+
+            if (master.method == COMBINE_MEDIAN)
+            {
+                std::nth_element(values.begin(), values.begin() + frames / 2, values.end());
+                int median = values[frames / 2];
+                if (frames % 2 == 0)
+                    median = (median + *std::max_element(values.begin(), values.begin() + frames / 2) + 1) / 2;
+                master.pixels[i] = median;
+                continue;
+            }
+
+            // sigma clip: drop the values far from the mean of the ones kept so far
+            double low = 0, high = 65535, mean = 0;
+            for (int it = 0; it < CLIP_ITERATIONS; it++)
+            {
+                double sum = 0, sumSquares = 0;
+                int kept = 0;
+                for (int f = 0; f < frames; f++)
+                    if (values[f] >= low && values[f] <= high)
+                    {
+                        sum += values[f];
+                        sumSquares += (double)values[f] * values[f];
+                        kept++;
+                    }
+                if (kept == 0)
+                    break;
+                mean = sum / kept;
+                double sigma = std::sqrt(std::max(sumSquares / kept - mean * mean, 0.0));
+                low = mean - CLIP_SIGMA * sigma;
+                high = mean + CLIP_SIGMA * sigma;
+            }
+            master.pixels[i] = (uint16_t)std::lround(mean);
+        }
+    });
+}
+
+void Calibration::findHotPixels(MasterFrame& master)
+{
+    // robust spread from the histogram, the hot pixels themselves do not widen it
+    Hist16 hist;
+    hist.Fill(master.pixels.data(), master.pixels.size());
+    int median = hist.Percentile(50);
+    double sigma = std::max(1.0, (hist.Percentile(84.13) - hist.Percentile(15.87)) / 2.);
+    int threshold = std::min(65535.0, median + HOT_SIGMA * sigma);
+
+    master.hotPixels.clear();
+    for (size_t i = 0; i < master.pixels.size(); i++)
+        if (master.pixels[i] > threshold)
+            master.hotPixels.push_back(i);
+}
+
+const MasterFrame* Calibration::masterFor(double exposureTime, int cols, int rows, int startX, int startY, int bin)
+{
+    long key = DatExposureKey(exposureTime);
+    auto exact = m_masters.find(key);
+    if (exact != m_masters.end() && covers(exact->second, cols, rows, startX, startY, bin))
+        return &exact->second;
+    auto scaledKey = std::make_tuple(key, cols, rows, startX, startY, bin);
+    auto cached = m_scaled.find(scaledKey);
+    if (cached != m_scaled.end())
+        return &cached->second;
+
+    // the shortest master is the bias, the dark nearest to the exposure gives the thermal signal
+    const MasterFrame* bias = nullptr;
+    const MasterFrame* dark = nullptr;
+    for (const auto& item : m_masters)
+    {
+        const MasterFrame& master = item.second;
+        if (!covers(master, cols, rows, startX, startY, bin))
+            continue;
+        if (bias == nullptr)
+            bias = &master;
+        else if (master.cols != bias->cols || master.rows != bias->rows || master.startX != bias->startX ||
+                 master.startY != bias->startY)
+            continue;   // scaling needs both in one geometry
+        else if (dark == nullptr || std::fabs(master.exposureTime - exposureTime) < std::fabs(dark->exposureTime - exposureTime))
+            dark = &master;
+    }
+    if (bias == nullptr)
+        return nullptr;
+
+    MasterFrame scaled = *bias;
+    scaled.exposureTime = exposureTime;
+    scaled.frames = 0;
+    if (dark != nullptr)
+    {
+        double scale = (exposureTime - bias->exposureTime) / (dark->exposureTime - bias->exposureTime);
+        for (size_t i = 0; i < scaled.pixels.size(); i++)
+        {
+            double v = bias->pixels[i] + ((double)dark->pixels[i] - bias->pixels[i]) * scale;
+            scaled.pixels[i] = v < 0 ? 0 : v > 65535 ? 65535 : (uint16_t)std::lround(v);
+        }
+    }
+    findHotPixels(scaled);
+    printf("Master %.3f sec scaled from %.3f and %.3f sec\n", exposureTime, bias->exposureTime,
+           dark ? dark->exposureTime : bias->exposureTime);
+    return &(m_scaled[scaledKey] = std::move(scaled));
+}
+
+bool Calibration::Apply(double exposureTime, unsigned short* image, int cols, int rows, int startX, int startY, int bin,
+                        CalibrationStats& stats)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    const MasterFrame* master = masterFor(exposureTime, cols, rows, startX, startY, bin);
+    if (master == nullptr)
+        return false;
+
+    // the frame window inside the master
+    int left = (startX - master->startX) / bin;
+    int top = (startY - master->startY) / bin;
+    bool whole = left == 0 && top == 0 && cols == master->cols;
+
+    int bands = (rows + APPLY_BAND_ROWS - 1) / APPLY_BAND_ROWS;
+    ParallelFor(bands, 0, [&](int band) {
+        int first = band * APPLY_BAND_ROWS;
+        int height = std::min(APPLY_BAND_ROWS, rows - first);
+        if (whole)
+        {
+            size_t offset = (size_t)first * cols;
+            subtract(image + offset, master->pixels.data() + offset, (size_t)height * cols, CALIBRATION_PEDESTAL);
+            return;
+        }
+        for (int y = first; y < first + height; y++)
+            subtract(image + (size_t)y * cols, master->pixels.data() + (size_t)(top + y) * master->cols + left,
+                     cols, CALIBRATION_PEDESTAL);
+    });
+
+    // hot pixels take the mean of their left and right neighbours
+    size_t hotPixels = 0;
+    for (uint32_t m : master->hotPixels)
+    {
+        int x = (int)(m % master->cols) - left;
+        int y = (int)(m / master->cols) - top;
+        if (x < 0 || y < 0 || x >= cols || y >= rows || cols < 2)
+            continue;
+        size_t i = (size_t)y * cols + x;
+        hotPixels++;
+        int before = x > 0 ? image[i - 1] : image[i + 1];
+        int after = x + 1 < cols ? image[i + 1] : image[i - 1];
+        image[i] = (before + after + 1) / 2;
+    }
+
+    stats.masterExposure = master->exposureTime;
+    stats.hotPixels = hotPixels;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    stats.overBudget = stats.seconds * 1E3 > CALIBRATION_BUDGET_MS;
+    m_frames++;
+    if (stats.overBudget)
+        m_overBudget++;
+    return true;
+}
+
+size_t Calibration::MasterCount()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_masters.size();
+}
+
+void Calibration::GetCounters(size_t& frames, size_t& overBudget)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    frames = m_frames;
+    overBudget = m_overBudget;
+}
+
+bool Calibration::save(const MasterFrame& master)
+{
+    std::ofstream fout(masterPath(m_dir, master.exposureTime), std::ios::binary);
+    if (!fout.is_open())
+        return false;
+
+    // same layout as the frames from Camera::SaveImage, so datreader and the macros can read it
+    fout << "exposureTime " << master.exposureTime << std::endl;
+    fout << "frames " << master.frames << std::endl;
+    fout << "combine " << combineName(master.method) << std::endl;
+    fout << "hotPixels " << master.hotPixels.size() << std::endl;
+    fout << "startX " << master.startX << std::endl;
+    fout << "startY " << master.startY << std::endl;
+    fout << "bin " << master.bin << std::endl;
+
+    std::string sizeLines = "xSize " + std::to_string(master.cols) + "\nySize " + std::to_string(master.rows) + "\n";
+    long offset = (long)fout.tellp() + sizeLines.size();
+    if (offset % 8 != 0)
+        fout << "pad " << std::string((8 - (offset + 5) % 8) % 8, '0') << std::endl;
+    fout << sizeLines;
+    fout.write((char const*)master.pixels.data(), sizeof(master.pixels[0]) * master.pixels.size());
+    return fout.good();
+}
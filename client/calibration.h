@@ -0,0 +1,100 @@
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+/** Dark/bias calibration done on the client right after readout.
+ * Dark frames are collected per exposure time and combined (median or sigma clip) into master
+ * frames, which are kept in the calibration directory as .dat files. The shortest master is the
+ * bias; exposures without a master of their own get the bias plus the scaled thermal signal of
+ * the nearest dark. A light frame becomes light + pedestal - master (saturating SIMD arithmetic),
+ * then the hot pixels of the master are replaced by the mean of their row neighbours
+ **/
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Added to every calibrated pixel so the noise around zero is not clipped
+#define CALIBRATION_PEDESTAL 100
+// Correction time per frame the photo worker can afford
+#define CALIBRATION_BUDGET_MS 20
+
+enum CombineMethod {
+    COMBINE_MEDIAN,
+    COMBINE_SIGMA_CLIP      // mean of the values within 3 sigma, 3 iterations
+};
+
+struct MasterFrame {
+    double exposureTime = 0;
+    int frames = 0;         // 0 - scaled from other masters, cached apart and not saved
+    CombineMethod method = COMBINE_MEDIAN;
+    int cols = 0;
+    int rows = 0;
+    int startX = 0;         // window on the sensor, unbinned pixels
+    int startY = 0;
+    int bin = 1;
+    std::vector<uint16_t> pixels;
+    std::vector<uint32_t> hotPixels;   // sorted pixel indices
+};
+
+struct CalibrationStats {
+    double masterExposure = 0;
+    size_t hotPixels = 0;
+    double seconds = 0;
+    bool overBudget = false;
+};
+
+class Calibration {
+public:
+    /**
+     * @brief use dir for the master frames and load the ones already there
+     * @return number of masters loaded
+     */
+    int Load(const std::string& dir);
+
+    /* The next dark frames are collected, a master is built after frames darks of one exposure */
+    void CollectDarks(int frames, CombineMethod method);
+    bool Collecting();
+
+    /**
+     * @brief dark frame right after readout, ignored unless collecting
+     * @param startX, startY, bin: where the frame is on the sensor
+     * @return true if it completed a master frame
+     */
+    bool AddDark(double exposureTime, const unsigned short* image, int cols, int rows, int startX, int startY, int bin);
+
+    /**
+     * @brief subtract the master for exposureTime and mask hot pixels, in place.
+     * A master with the same binning covering the frame window is used, e.g. a full frame master for a ROI
+     * @return false if there is no such master, the image is untouched then
+     */
+    bool Apply(double exposureTime, unsigned short* image, int cols, int rows, int startX, int startY, int bin,
+               CalibrationStats& stats);
+
+    size_t MasterCount();
+    /* frames corrected and how many of them took longer than the budget */
+    void GetCounters(size_t& frames, size_t& overBudget);
+
+private:
+    std::mutex m_mutex;
+    std::string m_dir = "calib";
+    std::map<long, MasterFrame> m_masters;    // by exposure in ms, one geometry per exposure
+    // scaled masters by exposure in ms and the requested cols, rows, startX, startY, bin
+    std::map<std::tuple<long, int, int, int, int, int>, MasterFrame> m_scaled;
+    std::map<long, std::vector<std::vector<uint16_t>>> m_series;
+    std::map<long, std::vector<int>> m_seriesMode;  // cols, rows, startX, startY, bin of every series
+    int m_seriesLength = 0;                  // 0 - not collecting
+    CombineMethod m_method = COMBINE_MEDIAN;
+    size_t m_frames = 0;
+    size_t m_overBudget = 0;
+
+    void combine(const std::vector<std::vector<uint16_t>>& series, MasterFrame& master);
+    void findHotPixels(MasterFrame& master);
+    const MasterFrame* masterFor(double exposureTime, int cols, int rows, int startX, int startY, int bin);
+    bool save(const MasterFrame& master);
+};
+
+#endif //CALIBRATION_H
@@ -0,0 +1,289 @@
+// Project headers
+#include "clusterfind.h"
+#include "calibration.h"
+#include "hist16.h"
+#include "pipeline.h"
+#include "statplanes.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#include "queue.h"
+
+// Rows labelled together by one thread
+static const int BAND_ROWS = 64;
+// About 2.4 MB of records, a frame with more clusters than this is noise, not beam
+static const size_t MAX_MSG_CLUSTERS = 100000;
+
+struct ClusterSum {
+    double x = 0;
+    double y = 0;
+    uint64_t charge = 0;
+    uint32_t size = 0;
+    int xMin = 0, yMin = 0, xMax = 0, yMax = 0;
+};
+
+template <typename RunT>
+static int findRoot(std::vector<RunT>& runs, int i)
+{
+    while (runs[i].parent != i)
+    {
+        runs[i].parent = runs[runs[i].parent].parent;
+        i = runs[i].parent;
+    }
+    return i;
+}
+
+template <typename RunT>
+static void unite(std::vector<RunT>& runs, int a, int b)
+{
+    a = findRoot(runs, a);
+    b = findRoot(runs, b);
+    if (a < b)
+        runs[b].parent = a;
+    else if (b < a)
+        runs[a].parent = b;
+}
+
+/* Joins runs of one row [rowBegin, rowEnd) with the runs of the row above [prevBegin, prevEnd), 8-connected */
+template <typename RunT>
+static void joinRows(std::vector<RunT>& runs, size_t prevBegin, size_t prevEnd, size_t rowBegin, size_t rowEnd)
+{
+    size_t p = prevBegin;
+    for (size_t c = rowBegin; c < rowEnd; c++)
+    {
+        while (p < prevEnd && runs[p].end < runs[c].start - 1)
+            p++;
+        for (size_t q = p; q < prevEnd && runs[q].start <= runs[c].end + 1; q++)
+            unite(runs, q, c);
+    }
+}
+
+bool ClusterFinder::LoadNoiseMap(const std::string& planesPath, double exposureTime, double nSigma)
+{
+    StatPlanes planes(planesPath);
+    int k = planes.Find(exposureTime);
+    if (k < 0 || !planes.Mean(k) || !planes.Dev(k))
+        return false;
+
+    const StatPlaneEntry& entry = planes.Entry(k);
+    const float* mean = planes.Mean(k);
+    const float* dev = planes.Dev(k);
+    size_t count = (size_t)entry.cols * entry.rows;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_mapCols = entry.cols;
+    m_mapRows = entry.rows;
+    m_baseline.resize(count);
+    m_offset.resize(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        m_baseline[i] = (uint16_t)std::min(65535.f, std::max(0.f, std::round(mean[i])));
+        m_offset[i] = (uint16_t)std::min(65535., std::max(1., std::ceil(nSigma * dev[i])));
+    }
+    return true;
+}
+
+void ClusterFinder::Find(const unsigned short* image, int cols, int rows, bool calibrated,
+                         std::vector<ClusterRecord>& clusters, ClusterStats& stats)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    find(image, cols, rows, calibrated, clusters, stats);
+}
+
+void ClusterFinder::find(const unsigned short* image, int cols, int rows, bool calibrated,
+                         std::vector<ClusterRecord>& clusters, ClusterStats& stats)
+{
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    bool useMap = !m_baseline.empty() && m_mapCols == cols && m_mapRows == rows;
+    int flatBaseline = CALIBRATION_PEDESTAL;
+    if (!useMap && !calibrated)
+    {
+        Hist16 hist;
+        hist.Fill(image, (size_t)cols * rows);
+        flatBaseline = hist.Percentile(50);
+    }
+    // baseline and threshold of pixel i
+    auto baseline = [&](size_t i) { return useMap && !calibrated ? (int)m_baseline[i] : flatBaseline; };
+    auto threshold = [&](size_t i) { return baseline(i) + (useMap ? (int)m_offset[i] : m_threshold); };
+
+    // runs of hot pixels, joined inside every band
+    int bands = (rows + BAND_ROWS - 1) / BAND_ROWS;
+    m_bandRuns.resize(bands);
+    ParallelFor(bands, 0, [&](int band) {
+        std::vector<Run>& runs = m_bandRuns[band];
+        runs.clear();
+        int first = band * BAND_ROWS;
+        int last = std::min(rows, first + BAND_ROWS);
+        size_t prevBegin = 0, prevEnd = 0;
+        for (int y = first; y < last; y++)
+        {
+            size_t rowBegin = runs.size();
+            const unsigned short* row = image + (size_t)y * cols;
+            size_t offset = (size_t)y * cols;
+            for (int x = 0; x < cols; x++)
+            {
+                if (row[x] <= threshold(offset + x))
+                    continue;
+                int start = x;
+                while (x + 1 < cols && row[x + 1] > threshold(offset + x + 1))
+                    x++;
+                runs.push_back({y, start, x, (int)runs.size()});
+            }
+            if (y > first)
+                joinRows(runs, prevBegin, prevEnd, rowBegin, runs.size());
+            prevBegin = rowBegin;
+            prevEnd = runs.size();
+        }
+    });
+
+    // all runs in one list with global parents, then the seams between bands
+    m_runs.clear();
+    std::vector<size_t> bandBegin(bands + 1, 0);
+    for (int band = 0; band < bands; band++)
+    {
+        bandBegin[band] = m_runs.size();
+        for (const Run& run : m_bandRuns[band])
+            m_runs.push_back({run.row, run.start, run.end, run.parent + (int)bandBegin[band]});
+    }
+    bandBegin[bands] = m_runs.size();
+
+    for (int band = 1; band < bands; band++)
+    {
+        int seam = band * BAND_ROWS;
+        size_t prevEnd = bandBegin[band];
+        size_t prevBegin = prevEnd;
+        while (prevBegin > bandBegin[band - 1] && m_runs[prevBegin - 1].row == seam - 1)
+            prevBegin--;
+        size_t rowBegin = bandBegin[band];
+        size_t rowEnd = rowBegin;
+        while (rowEnd < bandBegin[band + 1] && m_runs[rowEnd].row == seam)
+            rowEnd++;
+        joinRows(m_runs, prevBegin, prevEnd, rowBegin, rowEnd);
+    }
+
+    // sum up every cluster, roots get the cluster numbers in scan order
+    std::vector<int> clusterOf(m_runs.size(), -1);
+    std::vector<ClusterSum> sums;
+    stats.pixels = 0;
+    for (size_t i = 0; i < m_runs.size(); i++)
+    {
+        int root = findRoot(m_runs, i);
+        if (clusterOf[root] < 0)
+        {
+            clusterOf[root] = sums.size();
+            ClusterSum sum;
+            sum.xMin = m_runs[i].start;
+            sum.xMax = m_runs[i].end;
+            sum.yMin = sum.yMax = m_runs[i].row;
+            sums.push_back(sum);
+        }
+        ClusterSum& sum = sums[clusterOf[root]];
+        const Run& run = m_runs[i];
+        size_t offset = (size_t)run.row * cols;
+        for (int x = run.start; x <= run.end; x++)
+        {
+            uint32_t charge = image[offset + x] - baseline(offset + x);
+            sum.x += (double)x * charge;
+            sum.y += (double)run.row * charge;
+            sum.charge += charge;
+        }
+        sum.size += run.end - run.start + 1;
+        sum.xMin = std::min(sum.xMin, run.start);
+        sum.xMax = std::max(sum.xMax, run.end);
+        sum.yMin = std::min(sum.yMin, run.row);
+        sum.yMax = std::max(sum.yMax, run.row);
+        stats.pixels += run.end - run.start + 1;
+    }
+
+    clusters.resize(std::min(sums.size(), MAX_MSG_CLUSTERS));
+    for (size_t c = 0; c < clusters.size(); c++)
+    {
+        const ClusterSum& sum = sums[c];
+        ClusterRecord& record = clusters[c];
+        record.x = sum.x / sum.charge;
+        record.y = sum.y / sum.charge;
+        record.size = sum.size;
+        record.charge = (uint32_t)std::min<uint64_t>(sum.charge, UINT32_MAX);
+        record.xMin = sum.xMin;
+        record.yMin = sum.yMin;
+        record.xMax = sum.xMax;
+        record.yMax = sum.yMax;
+    }
+
+    stats.clusters = sums.size();
+    stats.dropped = sums.size() - clusters.size();
+    stats.noiseMap = useMap;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+
+bool ClusterFinder::Push(const unsigned short* image, int cols, int rows, int startX, int startY, int bin,
+                         bool calibrated, double exposureTime, ClusterStats& stats)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    find(image, cols, rows, calibrated, m_clusters, stats);
+
+    size_t records = sizeof(ClusterRecord) * m_clusters.size();
+    msg_queue_item_t* item = QUEUE_AllocBinary(4 + sizeof(ClusterMsgHeader) + records);
+    if (item == NULL)
+        return false;
+
+    ClusterMsgHeader header;
+    header.cols = cols;
+    header.rows = rows;
+    header.count = m_clusters.size();
+    header.dropped = stats.dropped;
+    header.exposureTime = exposureTime;
+    header.startX = startX;
+    header.startY = startY;
+    header.bin = bin;
+
+    unsigned char* out = item->payload;
+    memcpy(out, CLUSTER_MSG_TAG, 4);
+    memcpy(out + 4, &header, sizeof(header));
+    memcpy(out + 4 + sizeof(header), m_clusters.data(), records);
+    stats.bytes = item->len;
+    QUEUE_Push(item);
+    return true;
+}
+
+void AddSyntheticTracks(unsigned short* image, int cols, int rows, int count, int maxLength, int charge,
+                        unsigned int seed, std::vector<SyntheticTrack>& tracks)
+{
+    // small LCG, the same seed gives the same tracks on every platform
+    auto next = [&seed]() {
+        seed = seed * 1664525u + 1013904223u;
+        return seed >> 8;
+    };
+    auto uniform = [&next]() { return (next() & 0xFFFF) / 65536.f; };
+
+    tracks.clear();
+    for (int t = 0; t < count; t++)
+    {
+        SyntheticTrack track;
+        track.x0 = uniform() * cols;
+        track.y0 = uniform() * rows;
+        float length = 1 + uniform() * (maxLength - 1);
+        float angle = uniform() * 6.2831853f;
+        track.x1 = std::min(cols - 1.f, std::max(0.f, track.x0 + length * std::cos(angle)));
+        track.y1 = std::min(rows - 1.f, std::max(0.f, track.y0 + length * std::sin(angle)));
+        track.charge = charge;
+
+        int steps = std::max(1, (int)std::ceil(std::max(std::fabs(track.x1 - track.x0), std::fabs(track.y1 - track.y0))));
+        int lastX = -1, lastY = -1;
+        for (int s = 0; s <= steps; s++)
+        {
+            int x = (int)(track.x0 + (track.x1 - track.x0) * s / steps);
+            int y = (int)(track.y0 + (track.y1 - track.y0) * s / steps);
+            if (x == lastX && y == lastY)
+                continue;
+            unsigned short& pixel = image[(size_t)y * cols + x];
+            pixel = std::min(65535, pixel + charge);
+            lastX = x;
+            lastY = y;
+        }
+        tracks.push_back(track);
+    }
+}
@@ -0,0 +1,109 @@
+#ifndef CLUSTERFIND_H
+#define CLUSTERFIND_H
+
+/** Event extraction for beam runs: pixels above a per-pixel threshold are grouped into
+ * 8-connected clusters and only the cluster records leave the client.
+ * The frame is cut into bands of rows, every band finds its runs of hot pixels and joins them
+ * on its own core, then the runs touching the band seams are joined and the clusters summed up
+ **/
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* Binary message: tag, ClusterMsgHeader, count ClusterRecords (little endian) */
+#define CLUSTER_MSG_TAG "HITS"
+
+#pragma pack(push, 1)
+struct ClusterMsgHeader {
+    uint32_t cols;
+    uint32_t rows;
+    uint32_t count;
+    uint32_t dropped;       // clusters over the message limit
+    float exposureTime;
+    uint32_t startX;        // frame window on the sensor, records are in frame pixels
+    uint32_t startY;
+    uint32_t bin;
+};
+
+struct ClusterRecord {
+    float x;                // charge weighted centroid
+    float y;
+    uint32_t size;          // pixels
+    uint32_t charge;        // ADU above the baseline
+    uint16_t xMin, yMin, xMax, yMax;
+};
+#pragma pack(pop)
+
+struct ClusterStats {
+    size_t clusters = 0;
+    size_t pixels = 0;      // pixels above threshold
+    size_t dropped = 0;
+    size_t bytes = 0;       // message size
+    bool noiseMap = false;
+    double seconds = 0;
+};
+
+class ClusterFinder {
+public:
+    /**
+     * @brief per-pixel baseline and threshold from the mean and dev planes of a dark run (see statplanes.h)
+     * @param nSigma: a pixel is hot above mean + nSigma * dev
+     * @return false if the file has no planes for this exposure
+     */
+    bool LoadNoiseMap(const std::string& planesPath, double exposureTime, double nSigma);
+
+    /* Without a noise map (or for frames of another geometry than the map) the baseline is the frame median and a pixel is hot adu above it */
+    void SetThreshold(int adu) {m_threshold = adu;};
+
+    /**
+     * @brief clusters of the frame, calibrated frames have the calibration pedestal as baseline
+     */
+    void Find(const unsigned short* image, int cols, int rows, bool calibrated,
+              std::vector<ClusterRecord>& clusters, ClusterStats& stats);
+
+    /**
+     * @brief find the clusters and add them to the client message queue
+     * @return false if there is no memory for the message
+     */
+    bool Push(const unsigned short* image, int cols, int rows, int startX, int startY, int bin, bool calibrated,
+              double exposureTime, ClusterStats& stats);
+
+private:
+    struct Run {
+        int row;
+        int start;
+        int end;            // last pixel
+        int parent;
+    };
+
+    std::mutex m_mutex;
+    int m_threshold = 50;
+    int m_mapCols = 0;
+    int m_mapRows = 0;
+    std::vector<uint16_t> m_baseline;
+    std::vector<uint16_t> m_offset;
+    std::vector<std::vector<Run>> m_bandRuns;
+    std::vector<Run> m_runs;
+    std::vector<ClusterRecord> m_clusters;
+
+    void find(const unsigned short* image, int cols, int rows, bool calibrated,
+              std::vector<ClusterRecord>& clusters, ClusterStats& stats);
+};
+
+/* Straight track painted by AddSyntheticTracks */
+struct SyntheticTrack {
+    float x0, y0, x1, y1;
+    int charge;             // ADU per pixel
+};
+
+/**
+ * @brief add random straight tracks to a frame, for efficiency and throughput checks of the finder
+ * @param maxLength: tracks are 1 to maxLength pixels long
+ */
+void AddSyntheticTracks(unsigned short* image, int cols, int rows, int count, int maxLength, int charge,
+                        unsigned int seed, std::vector<SyntheticTrack>& tracks);
+
+#endif //CLUSTERFIND_H
@@ -0,0 +1,428 @@
+// Project headers
+#include "commands.h"
+#include "latency.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// More tokens than this is not a command of ours
+static const int MAX_TOKENS = 16;
+// QSI 6-series limit, 240 minutes
+static const double MAX_EXPOSURE_MS = 240 * 60 * 1E3;
+// Window coordinates beyond any sensor
+static const int MAX_COORDINATE = 1 << 16;
+// Cluster threshold of a noise map, sigmas above the mean
+static const double MAX_NSIGMA = 100;
+
+static bool parseInt(std::string_view token, int min, int max, int& out)
+{
+    int value;
+    const char* end = token.data() + token.size();
+    std::from_chars_result result = std::from_chars(token.data(), end, value);
+    if (result.ec != std::errc() || result.ptr != end || value < min || value > max)
+        return false;
+    out = value;
+    return true;
+}
+
+static bool parseDouble(std::string_view token, double min, double max, double& out)
+{
+    // strtod needs a terminated string, numbers are short so a copy on the stack does
+    char text[32];
+    if (token.empty() || token.size() >= sizeof(text))
+        return false;
+    memcpy(text, token.data(), token.size());
+    text[token.size()] = 0;
+    char* end;
+    double value = strtod(text, &end);
+    if (end != text + token.size() || !std::isfinite(value) || value < min || value > max)
+        return false;
+    out = value;
+    return true;
+}
+
+static bool parseNone(const std::string_view* args, int count, ParsedCommand& out)
+{
+    return count == 0;
+}
+
+static bool parseLatency(const std::string_view* args, int count, ParsedCommand& out)
+{
+    out.reset = count == 1 && args[0] == "reset";
+    return count == 0 || out.reset;
+}
+
+static bool parseCompress(const std::string_view* args, int count, ParsedCommand& out)
+{
+    out.compress = count == 1 && args[0] == "on";
+    return count == 1 && (out.compress || args[0] == "off");
+}
+
+static bool parseTiff(const std::string_view* args, int count, ParsedCommand& out)
+{
+    // the order of Camera::TiffMode
+    static constexpr std::string_view TIFF_MODES[] = {"off", "display", "16", "deflate", "lzw"};
+    if (count != 1)
+        return false;
+    const std::string_view* mode = std::find(std::begin(TIFF_MODES), std::end(TIFF_MODES), args[0]);
+    out.tiffMode = mode - std::begin(TIFF_MODES);
+    return mode != std::end(TIFF_MODES);
+}
+
+static bool parseSet(const std::string_view* args, int count, ParsedCommand& out)
+{
+    // the order of QSICamera::FanMode
+    static constexpr std::string_view FAN_MODES[] = {"off", "quiet", "full"};
+    if (count < 2 || count > 3)
+        return false;
+    const std::string_view* fan = std::find(std::begin(FAN_MODES), std::end(FAN_MODES), args[0]);
+    if (fan == std::end(FAN_MODES) || !parseDouble(args[1], MIN_TEMP, MAX_TEMP, out.set.setPoint))
+        return false;
+    out.set.fan = fan - std::begin(FAN_MODES);
+    out.set.cooler = true;
+    if (count == 3)
+    {
+        if (args[2] != "on" && args[2] != "off")
+            return false;
+        out.set.cooler = args[2] == "on";
+    }
+    return true;
+}
+
+static bool parsePhotoTask(const std::string_view* args, int count, ParsedCommand& out)
+{
+    PhotoTaskArgs& photo = out.photo;
+    if (count < 2 || !parseDouble(args[0], 0, MAX_EXPOSURE_MS, photo.exposureMs) || photo.exposureMs <= 0 ||
+        !parseInt(args[1], 1, MAX_PHOTO_COUNT, photo.count))
+        return false;
+
+    for (int i = 2; i < count; )
+    {
+        if (args[i] == "roi" && !photo.roi && i + 4 < count)
+        {
+            photo.roi = parseInt(args[i + 1], 0, MAX_COORDINATE, photo.startX) &&
+                        parseInt(args[i + 2], 0, MAX_COORDINATE, photo.startY) &&
+                        parseInt(args[i + 3], 1, MAX_COORDINATE, photo.width) &&
+                        parseInt(args[i + 4], 1, MAX_COORDINATE, photo.height);
+            if (!photo.roi)
+                return false;
+            i += 5;
+        }
+        else if (args[i] == "bin" && i + 1 < count)
+        {
+            if (!parseInt(args[i + 1], 1, MAX_COMMAND_BIN, photo.bin))
+                return false;
+            i += 2;
+        }
+        else if (args[i] == "dark")
+        {
+            photo.light = false;
+            i++;
+        }
+        else
+            return false;
+    }
+    return true;
+}
+
+static bool parseCalib(const std::string_view* args, int count, ParsedCommand& out)
+{
+    // the order of CombineMethod
+    static constexpr std::string_view METHODS[] = {"median", "sigmaclip"};
+    CalibArgs& calib = out.calib;
+    if (count == 1 && (args[0] == "on" || args[0] == "off"))
+    {
+        calib.on = args[0] == "on";
+        return true;
+    }
+    if (count < 2 || count > 3 || args[0] != "collect" || !parseInt(args[1], 1, MAX_CALIB_FRAMES, calib.frames))
+        return false;
+    calib.collect = true;
+    if (count == 3)
+    {
+        const std::string_view* method = std::find(std::begin(METHODS), std::end(METHODS), args[2]);
+        if (method == std::end(METHODS))
+            return false;
+        calib.method = method - std::begin(METHODS);
+    }
+    return true;
+}
+
+/* A .planes file name of plain characters, no way out of the working directory */
+static bool planesPath(std::string_view token)
+{
+    static constexpr std::string_view SUFFIX = ".planes";
+    if (token.size() <= SUFFIX.size() || token.substr(token.size() - SUFFIX.size()) != SUFFIX ||
+        token[0] == '/' || token.find("..") != std::string_view::npos)
+        return false;
+    return std::all_of(token.begin(), token.end(), [](char c) {
+        return isalnum((unsigned char)c) || c == '_' || c == '-' || c == '.' || c == '/';
+    });
+}
+
+static bool parseClusters(const std::string_view* args, int count, ParsedCommand& out)
+{
+    ClusterArgs& clusters = out.clusters;
+    if (count < 1 || (args[0] != "on" && args[0] != "off"))
+        return false;
+    clusters.on = args[0] == "on";
+    int i = 1;
+    if (i < count && (args[i] == "keep" || args[i] == "drop"))
+        clusters.keepRaw = args[i++] == "keep";
+    if (i < count && args[i] == "noisemap" && i + 3 < count)
+    {
+        if (args[i + 1].size() >= sizeof(clusters.noiseMap) || !planesPath(args[i + 1]) ||
+            !parseDouble(args[i + 2], 0, MAX_EXPOSURE_MS, clusters.noiseExposureMs) || clusters.noiseExposureMs <= 0 ||
+            !parseDouble(args[i + 3], 0, MAX_NSIGMA, clusters.nSigma) || clusters.nSigma <= 0)
+            return false;
+        memcpy(clusters.noiseMap, args[i + 1].data(), args[i + 1].size());
+        i += 4;
+    }
+    return i == count;
+}
+
+struct CommandSpec {
+    std::string_view name;
+    CommandId command;
+    bool (*parse)(const std::string_view* args, int count, ParsedCommand& out);
+};
+
+// In CommandId order, so the id is also the index
+static constexpr CommandSpec COMMAND_TABLE[] = {
+    {"", CMD_UNKNOWN, nullptr},
+    {"connect", CMD_CONNECT, parseNone},
+    {"disconnect", CMD_DISCONNECT, parseNone},
+    {"cancel", CMD_CANCEL, parseNone},
+    {"set", CMD_SET, parseSet},
+    {"phototask", CMD_PHOTOTASK, parsePhotoTask},
+    {"latency", CMD_LATENCY, parseLatency},
+    {"calib", CMD_CALIB, parseCalib},
+    {"clusters", CMD_CLUSTERS, parseClusters},
+    {"compress", CMD_COMPRESS, parseCompress},
+    {"tiff", CMD_TIFF, parseTiff},
+};
+
+static constexpr bool tableInOrder()
+{
+    for (int i = 0; i < CMD_COUNT; i++)
+        if (COMMAND_TABLE[i].command != i)
+            return false;
+    return sizeof(COMMAND_TABLE) / sizeof(COMMAND_TABLE[0]) == CMD_COUNT;
+}
+static_assert(tableInOrder(), "COMMAND_TABLE must have every CommandId at its index");
+
+int TokenizeCommand(const char* msg, size_t len, std::string_view* tokens, int maxTokens)
+{
+    auto isSpace = [](char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; };
+    int count = 0;
+    size_t i = 0;
+    while (true)
+    {
+        while (i < len && isSpace(msg[i]))
+            i++;
+        if (i == len)
+            return count;
+        if (count == maxTokens)
+            return -1;
+        size_t start = i;
+        while (i < len && !isSpace(msg[i]))
+            i++;
+        tokens[count++] = std::string_view(msg + start, i - start);
+    }
+}
+
+ParseStatus ParseCommand(const char* msg, size_t len, ParsedCommand& out)
+{
+    out = ParsedCommand();
+    std::string_view tokens[MAX_TOKENS];
+    int count = TokenizeCommand(msg, len, tokens, MAX_TOKENS);
+    // too many tokens still gives the id and the name for the answer
+    bool tooMany = count < 0;
+    if (tooMany)
+        count = MAX_TOKENS;
+
+    int first = 0;
+    if (count > 0 && tokens[0][0] == '@')
+    {
+        unsigned long id;
+        const char* end = tokens[0].data() + tokens[0].size();
+        std::from_chars_result result = std::from_chars(tokens[0].data() + 1, end, id);
+        if (result.ec == std::errc() && result.ptr == end)
+            out.id = id;
+        first = 1;
+    }
+    if (first >= count)
+        return PARSE_EMPTY;
+
+    // the name goes back in a JSON answer, so only plain characters are kept
+    std::string_view name = tokens[first];
+    size_t n = std::min(name.size(), sizeof(out.name) - 1);
+    for (size_t i = 0; i < n; i++)
+        out.name[i] = isalnum((unsigned char)name[i]) || name[i] == '_' || name[i] == '-' ? name[i] : '?';
+
+    for (int c = 1; c < CMD_COUNT; c++)
+    {
+        const CommandSpec& spec = COMMAND_TABLE[c];
+        if (spec.name != name)
+            continue;
+        out.command = spec.command;
+        if (tooMany || !spec.parse(tokens + first + 1, count - first - 1, out))
+            return PARSE_BAD_ARGS;
+        return PARSE_OK;
+    }
+    return PARSE_UNKNOWN;
+}
+
+const char* CommandName(CommandId command)
+{
+    return command > CMD_UNKNOWN && command < CMD_COUNT ? COMMAND_TABLE[command].name.data() : "";
+}
+
+/* Ranges every successfully parsed command has to be in */
+static bool parsedValid(const ParsedCommand& command)
+{
+    if (command.command <= CMD_UNKNOWN || command.command >= CMD_COUNT)
+        return false;
+    if (memchr(command.name, 0, sizeof(command.name)) == NULL || strcmp(command.name, CommandName(command.command)) != 0)
+        return false;
+    const PhotoTaskArgs& photo = command.photo;
+    if (command.command == CMD_PHOTOTASK &&
+        (!(photo.exposureMs > 0 && photo.exposureMs <= MAX_EXPOSURE_MS) || photo.count < 1 ||
+         photo.count > MAX_PHOTO_COUNT || photo.bin < 1 || photo.bin > MAX_COMMAND_BIN ||
+         (photo.roi && (photo.startX < 0 || photo.startY < 0 || photo.width < 1 || photo.height < 1))))
+        return false;
+    const SetArgs& set = command.set;
+    if (command.command == CMD_SET &&
+        (set.fan < 0 || set.fan > 2 || !(set.setPoint >= MIN_TEMP && set.setPoint <= MAX_TEMP)))
+        return false;
+    const CalibArgs& calib = command.calib;
+    if (command.command == CMD_CALIB && calib.collect &&
+        (calib.frames < 1 || calib.frames > MAX_CALIB_FRAMES || calib.method < 0 || calib.method > 1))
+        return false;
+    const ClusterArgs& clusters = command.clusters;
+    if (command.command == CMD_CLUSTERS && clusters.noiseMap[0] &&
+        (memchr(clusters.noiseMap, 0, sizeof(clusters.noiseMap)) == NULL || !planesPath(clusters.noiseMap) ||
+         !(clusters.noiseExposureMs > 0 && clusters.noiseExposureMs <= MAX_EXPOSURE_MS) ||
+         !(clusters.nSigma > 0 && clusters.nSigma <= MAX_NSIGMA)))
+        return false;
+    if (command.command == CMD_TIFF && (command.tiffMode < 0 || command.tiffMode > 4))
+        return false;
+    return true;
+}
+
+int COMMANDS_Bench(long iterations)
+{
+    static const char* CORPUS[] = {
+        "connect", "@12 disconnect", "cancel", "set quiet 10", "@3 set full 25.5 off", "phototask 100 5",
+        "@99 phototask 30000 2 roi 100 200 512 512 bin 2", "phototask 1000 1 bin 4 dark", "latency",
+        "@7 latency reset", "calib on", "@8 calib collect 16 sigmaclip", "clusters on drop",
+        "@4 clusters on keep noisemap darks/run1.planes 1000 5", "compress on", "tiff deflate"
+    };
+    const int corpusSize = sizeof(CORPUS) / sizeof(CORPUS[0]);
+    int failures = 0;
+
+    ParsedCommand command;
+    for (int i = 0; i < corpusSize; i++)
+        if (ParseCommand(CORPUS[i], strlen(CORPUS[i]), command) != PARSE_OK || !parsedValid(command))
+        {
+            printf("Corpus command '%s' is not parsed\n", CORPUS[i]);
+            failures++;
+        }
+    ParseCommand(CORPUS[6], strlen(CORPUS[6]), command);
+    if (command.id != 99 || command.photo.exposureMs != 30000 || command.photo.count != 2 || !command.photo.roi ||
+        command.photo.width != 512 || command.photo.bin != 2 || !command.photo.light)
+    {
+        printf("Phototask arguments are wrong\n");
+        failures++;
+    }
+
+    // throughput over the corpus
+    size_t lengths[corpusSize];
+    for (int i = 0; i < corpusSize; i++)
+        lengths[i] = strlen(CORPUS[i]);
+    long sink = 0;
+    uint64_t begin = LATENCY_Now();
+    for (long i = 0; i < iterations; i++)
+    {
+        ParseCommand(CORPUS[i % corpusSize], lengths[i % corpusSize], command);
+        sink += command.command;
+    }
+    double ns = (double)(LATENCY_Now() - begin) / std::max(1L, iterations);
+    printf("Parser: %.1f ns per command, %.2f M commands/s (%ld)\n", ns, 1E3 / ns, sink % 2);
+
+    // fuzz: corpus commands with random edits, and random bytes
+    static const char ALPHABET[] = "0123456789 -.@eEroibnsdkfqulat\t\x01\xff";
+    unsigned int seed = 12345;
+    auto next = [&seed]() {
+        seed = seed * 1664525u + 1013904223u;
+        return seed >> 8;
+    };
+    char text[256];
+    long parsed = 0, rejected = 0;
+    for (long i = 0; i < iterations; i++)
+    {
+        size_t len;
+        if (next() % 8 == 0)
+        {
+            len = next() % 64;
+            for (size_t k = 0; k < len; k++)
+                text[k] = (char)next();
+        }
+        else
+        {
+            int pick = next() % corpusSize;
+            len = lengths[pick];
+            memcpy(text, CORPUS[pick], len);
+            int edits = 1 + next() % 4;
+            for (int e = 0; e < edits; e++)
+            {
+                size_t at = len ? next() % len : 0;
+                char c = next() % 3 ? ALPHABET[next() % (sizeof(ALPHABET) - 1)] : (char)next();
+                switch (next() % 4)
+                {
+                case 0:     // replace
+                    if (len)
+                        text[at] = c;
+                    break;
+                case 1:     // insert
+                    if (len + 1 < sizeof(text))
+                    {
+                        memmove(text + at + 1, text + at, len - at);
+                        text[at] = c;
+                        len++;
+                    }
+                    break;
+                case 2:     // delete
+                    if (len)
+                    {
+                        memmove(text + at, text + at + 1, len - at - 1);
+                        len--;
+                    }
+                    break;
+                default:    // cut
+                    len = at;
+                }
+            }
+        }
+
+        ParseStatus status = ParseCommand(text, len, command);
+        if (status == PARSE_OK)
+        {
+            parsed++;
+            if (!parsedValid(command))
+            {
+                printf("Fuzz: '%.*s' parsed out of range\n", (int)len, text);
+                failures++;
+            }
+        }
+        else
+            rejected++;
+    }
+    printf("Fuzz: %ld commands, %ld parsed, %ld rejected, %d failures\n", iterations, parsed, rejected, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,114 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+/** Parsing of the server commands "[@<id>] <name> [args]". The message is split into tokens in
+ * place (string views into the receive buffer), the name is looked up in a constexpr table and
+ * the arguments are parsed into typed, range checked fields, all without allocating. Execution
+ * is left to the caller (app.cpp), which keys its handlers by CommandId
+ **/
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief fuzz the parser with mutated commands and measure its throughput, see --bench-commands
+ * @return 0 - no invariant broken
+ */
+int COMMANDS_Bench(long iterations);
+
+#ifdef __cplusplus
+}
+
+#include <string_view>
+
+// Accepted cooler set point range, deg C, and binning: the limits server/main.py checks
+static const float MIN_TEMP = 0;
+static const float MAX_TEMP = 30;
+static const int MAX_COMMAND_BIN = 8;
+// Photos in one phototask
+static const int MAX_PHOTO_COUNT = 10000;
+// Darks in one master dark series, calibration.cpp keeps no more
+static const int MAX_CALIB_FRAMES = 32;
+
+enum CommandId {
+    CMD_UNKNOWN,
+    CMD_CONNECT,
+    CMD_DISCONNECT,
+    CMD_CANCEL,
+    CMD_SET,            // set <off|quiet|full> <set point> [on|off]
+    CMD_PHOTOTASK,      // phototask <exposure ms> <count> [roi <x> <y> <width> <height>] [bin <n>] [dark]
+    CMD_LATENCY,        // latency [reset]
+    CMD_CALIB,          // calib <on|off> | calib collect <frames> [median|sigmaclip]
+    CMD_CLUSTERS,       // clusters <on|off> [keep|drop] [noisemap <file.planes> <exposure ms> <nsigma>]
+    CMD_COMPRESS,       // compress <on|off>
+    CMD_TIFF,           // tiff <off|display|16|deflate|lzw>
+    CMD_COUNT
+};
+
+enum ParseStatus {
+    PARSE_OK,
+    PARSE_EMPTY,
+    PARSE_UNKNOWN,      // no such command
+    PARSE_BAD_ARGS      // wrong number, type or range of the arguments
+};
+
+struct PhotoTaskArgs {
+    double exposureMs = 0;
+    int count = 0;
+    bool roi = false;
+    int startX = 0, startY = 0, width = 0, height = 0;  // sensor pixels
+    int bin = 1;
+    bool light = true;
+};
+
+struct SetArgs {
+    int fan = 0;            // QSICamera::FanMode
+    double setPoint = 0;
+    bool cooler = true;
+};
+
+struct CalibArgs {
+    bool collect = false;   // start a master dark series, else switch the correction
+    int frames = 0;
+    int method = 0;         // CombineMethod
+    bool on = false;
+};
+
+struct ClusterArgs {
+    bool on = false;
+    bool keepRaw = true;    // the raw frame is saved too
+    char noiseMap[64] = {}; // .planes file, "" - keep the current threshold
+    double noiseExposureMs = 0;
+    double nSigma = 0;
+};
+
+/* Everything is a plain value, so a parsed command can be queued as it is */
+struct ParsedCommand {
+    unsigned long id = 0;   // "@<id>" in front, 0 - none
+    CommandId command = CMD_UNKNOWN;
+    char name[16] = {};     // the name as received (cut), for the answer
+    PhotoTaskArgs photo;
+    SetArgs set;
+    CalibArgs calib;
+    ClusterArgs clusters;
+    bool reset = false;
+    bool compress = false;
+    int tiffMode = 0;       // Camera::TiffMode
+};
+
+/**
+ * @brief split msg at spaces and tabs
+ * @return number of tokens, -1 if there are more than maxTokens
+ */
+int TokenizeCommand(const char* msg, size_t len, std::string_view* tokens, int maxTokens);
+
+ParseStatus ParseCommand(const char* msg, size_t len, ParsedCommand& out);
+
+/* Table name of the command, "" for CMD_UNKNOWN */
+const char* CommandName(CommandId command);
+#endif
+
+#endif //COMMANDS_H
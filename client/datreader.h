@@ -0,0 +1,256 @@
+#ifndef DATREADER_H
+#define DATREADER_H
+
+/** Reader for the .dat frames written by Camera::SaveImage: "key value" text lines ending with
+ * "ySize N", then the pixel block. The file is mmapped, the header is parsed on first use and
+ * uncompressed pixels are returned in place (no copy). Compressed files are decoded once.
+ * Header-only so the ROOT macros can include it directly.
+ **/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rawcodec.h"
+
+// The header is a few hundred bytes, anything longer is not a frame
+#define DAT_MAX_HEADER 4096
+
+struct DatMeta {
+    std::string date;
+    double exposureTime = 0;
+    std::string shutterPriority;
+    std::string readoutSpeed;
+    std::string gain;
+    double ePerADU = 0;
+    double ccdTemp = 0;
+    int xSize = 0;
+    int ySize = 0;
+    int startX = 0;             // window on the sensor, unbinned pixels
+    int startY = 0;
+    int bin = 1;
+    std::string compression;    // empty for raw pixels
+    int bandRows = 0;
+    size_t dataOffset = 0;      // first byte after the header
+    std::vector<std::pair<std::string, std::string>> fields;   // every header line as it is
+};
+
+/* Exposure time in ms, the key the analysis groups frames by */
+inline long DatExposureKey(double exposureTime)
+{
+    return std::lround(exposureTime * 1e3);
+}
+
+/**
+ * @brief parse "key value" lines up to and including ySize
+ * @return false if there is no ySize line within size bytes
+ */
+inline bool ParseDatHeader(const char* data, size_t size, DatMeta& meta)
+{
+    size_t pos = 0;
+    while (pos < size)
+    {
+        const char* line = data + pos;
+        const char* eol = static_cast<const char*>(memchr(line, '\n', size - pos));
+        if (eol == NULL)
+            return false;
+        pos = eol - data + 1;
+
+        const char* space = static_cast<const char*>(memchr(line, ' ', eol - line));
+        std::string key(line, space ? space : eol);
+        std::string value = space ? std::string(space + 1, eol) : std::string();
+        meta.fields.push_back({key, value});
+
+        if (key == "date") meta.date = value;
+        else if (key == "exposureTime") meta.exposureTime = atof(value.c_str());
+        else if (key == "shutterPriority") meta.shutterPriority = value;
+        else if (key == "readoutSpeed") meta.readoutSpeed = value;
+        else if (key == "gain") meta.gain = value;
+        else if (key == "ePerADU") meta.ePerADU = atof(value.c_str());
+        else if (key == "ccdTemp") meta.ccdTemp = atof(value.c_str());
+        else if (key == "compression") meta.compression = value;
+        else if (key == "bandRows") meta.bandRows = atoi(value.c_str());
+        else if (key == "startX") meta.startX = atoi(value.c_str());
+        else if (key == "startY") meta.startY = atoi(value.c_str());
+        else if (key == "bin") meta.bin = atoi(value.c_str());
+        else if (key == "xSize") meta.xSize = atoi(value.c_str());
+        else if (key == "ySize")
+        {
+            meta.ySize = atoi(value.c_str());
+            meta.dataOffset = pos;
+            return meta.xSize > 0 && meta.ySize > 0;
+        }
+    }
+    return false;
+}
+
+class DatFile {
+    std::string m_path;
+    const unsigned char* m_map = nullptr;
+    size_t m_size = 0;
+    bool m_parsed = false;
+    bool m_valid = false;
+    DatMeta m_meta;
+    std::vector<uint16_t> m_decoded;   // only for compressed or misaligned files
+
+public:
+    DatFile() = default;
+    explicit DatFile(const std::string& path) { Open(path); }
+    DatFile(const DatFile&) = delete;
+    DatFile& operator=(const DatFile&) = delete;
+    ~DatFile() { Close(); }
+
+    bool Open(const std::string& path)
+    {
+        Close();
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED)
+            {
+                m_map = static_cast<const unsigned char*>(map);
+                m_size = st.st_size;
+            }
+        }
+        close(fd);
+        m_path = path;
+        return m_map != nullptr;
+    }
+
+    void Close()
+    {
+        if (m_map)
+            munmap(const_cast<unsigned char*>(m_map), m_size);
+        m_map = nullptr;
+        m_size = 0;
+        m_parsed = false;
+        m_valid = false;
+        m_meta = DatMeta();
+        m_decoded.clear();
+    }
+
+    const std::string& Path() const { return m_path; }
+    size_t FileSize() const { return m_size; }
+
+    /* Header of the file, parsed on the first call. NULL if the file is not a frame */
+    const DatMeta* Meta()
+    {
+        if (!m_parsed && m_map)
+        {
+            m_parsed = true;
+            size_t limit = m_size < DAT_MAX_HEADER ? m_size : DAT_MAX_HEADER;
+            m_valid = ParseDatHeader(reinterpret_cast<const char*>(m_map), limit, m_meta);
+        }
+        return m_valid ? &m_meta : nullptr;
+    }
+
+    /* true if Pixels() points straight into the mapped file */
+    bool IsZeroCopy()
+    {
+        const DatMeta* meta = Meta();
+        return meta && meta->compression.empty() && meta->dataOffset % alignof(uint16_t) == 0;
+    }
+
+    /**
+     * @brief xSize * ySize pixels, row by row
+     * @return NULL if the file is cut or damaged
+     */
+    const uint16_t* Pixels()
+    {
+        const DatMeta* meta = Meta();
+        if (meta == nullptr)
+            return nullptr;
+        if (!m_decoded.empty())
+            return m_decoded.data();
+
+        size_t count = (size_t)meta->xSize * meta->ySize;
+        const unsigned char* data = m_map + meta->dataOffset;
+        size_t available = m_size - meta->dataOffset;
+
+        if (meta->compression.empty())
+        {
+            if (available < count * sizeof(uint16_t))
+                return nullptr;
+            madvise(const_cast<unsigned char*>(m_map), m_size, MADV_SEQUENTIAL);
+            if (IsZeroCopy())
+                return reinterpret_cast<const uint16_t*>(data);
+            // files from before the header padding may start the pixels at an odd offset
+            m_decoded.resize(count);
+            memcpy(m_decoded.data(), data, count * sizeof(uint16_t));
+            return m_decoded.data();
+        }
+
+        if (meta->compression != RAWCODEC_NAME || meta->bandRows <= 0)
+            return nullptr;
+        int bands = RawBandCount(meta->ySize, meta->bandRows);
+        if (available < bands * sizeof(uint32_t))
+            return nullptr;
+        std::vector<uint32_t> sizes(bands);
+        memcpy(sizes.data(), data, bands * sizeof(uint32_t));
+        size_t packed = 0;
+        for (uint32_t size : sizes)
+            packed += size;
+        if (available - bands * sizeof(uint32_t) < packed)
+            return nullptr;
+
+        m_decoded.resize(count);
+        if (!DecodeRawBands(data + bands * sizeof(uint32_t), sizes.data(), meta->xSize, meta->ySize,
+                            meta->bandRows, m_decoded.data()))
+        {
+            m_decoded.clear();
+            return nullptr;
+        }
+        return m_decoded.data();
+    }
+};
+
+/**
+ * @brief headers of all frames in dir grouped by DatExposureKey, the pixel data is not read
+ * @return exposure key -> file paths (sorted by name)
+ */
+inline std::map<long, std::vector<std::string>> IndexDatDirectory(const std::string& dir, const std::string& ext = ".dat")
+{
+    std::map<long, std::vector<std::string>> index;
+    DIR* d = opendir(dir.c_str());
+    if (d == NULL)
+        return index;
+
+    std::vector<std::string> names;
+    while (struct dirent* entry = readdir(d))
+    {
+        std::string name = entry->d_name;
+        if (name.size() > ext.size() && name.compare(name.size() - ext.size(), ext.size(), ext) == 0)
+            names.push_back(name);
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+
+    for (const auto& name : names)
+    {
+        std::string path = dir + "/" + name;
+        // only the first page of the mapping is touched
+        DatFile file(path);
+        if (const DatMeta* meta = file.Meta())
+            index[DatExposureKey(meta->exposureTime)].push_back(path);
+    }
+    return index;
+}
+
+#endif //DATREADER_H
@@ -0,0 +1,124 @@
+// Project headers
+#include "framepool.h"
+
+#include <cstdlib>
+#include <unistd.h>
+
+static size_t pageSize()
+{
+    static const size_t size = (size_t)sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+/* Buffers are keyed by their size rounded up to whole pages */
+static size_t sizeClass(size_t bytes)
+{
+    size_t page = pageSize();
+    return (bytes + page - 1) / page * page;
+}
+
+FramePool::Handle::Handle(Handle&& other) noexcept
+    : m_pool(other.m_pool), m_index(other.m_index), m_data(other.m_data), m_size(other.m_size)
+{
+    other.m_pool = nullptr;
+    other.m_data = nullptr;
+    other.m_size = 0;
+}
+
+FramePool::Handle& FramePool::Handle::operator=(Handle&& other) noexcept
+{
+    if (this != &other)
+    {
+        Release();
+        m_pool = other.m_pool;
+        m_index = other.m_index;
+        m_data = other.m_data;
+        m_size = other.m_size;
+        other.m_pool = nullptr;
+        other.m_data = nullptr;
+        other.m_size = 0;
+    }
+    return *this;
+}
+
+void FramePool::Handle::Release()
+{
+    if (m_pool)
+        m_pool->release(m_index);
+    m_pool = nullptr;
+    m_data = nullptr;
+    m_size = 0;
+}
+
+FramePool::~FramePool()
+{
+    for (auto& block : m_blocks)
+        free(block.data);
+}
+
+bool FramePool::allocate(size_t bytes)
+{
+    size_t capacity = sizeClass(bytes);
+    void* data = nullptr;
+    if (posix_memalign(&data, pageSize(), capacity) != 0)
+        return false;
+
+    m_blocks.push_back({static_cast<unsigned char*>(data), capacity, false});
+    m_counters.allocations++;
+    m_counters.bytesAllocated += capacity;
+    return true;
+}
+
+void FramePool::Reserve(size_t bytes, int count)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t capacity = sizeClass(bytes);
+    int available = 0;
+    for (const auto& block : m_blocks)
+        if (block.capacity == capacity)
+            available++;
+
+    for (; available < count; available++)
+        if (!allocate(bytes))
+            return;
+}
+
+FramePool::Handle FramePool::Acquire(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_counters.acquires++;
+
+    size_t best = m_blocks.size();
+    for (size_t i = 0; i < m_blocks.size(); i++)
+    {
+        const Block& block = m_blocks[i];
+        if (block.inUse || block.capacity < bytes)
+            continue;
+        if (best == m_blocks.size() || block.capacity < m_blocks[best].capacity)
+            best = i;
+    }
+
+    if (best == m_blocks.size())
+    {
+        m_counters.misses++;
+        if (!allocate(bytes))
+            return Handle();
+    }
+
+    m_blocks[best].inUse = true;
+    m_counters.inUse++;
+    return Handle(this, best, m_blocks[best].data, bytes);
+}
+
+void FramePool::release(size_t index)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_blocks[index].inUse = false;
+    m_counters.inUse--;
+}
+
+FramePool::Counters FramePool::GetCounters()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_counters;
+}
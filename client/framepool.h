@@ -0,0 +1,81 @@
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+/** Pool of page-aligned buffers for frames and preview images. The buffers are allocated once
+ * (at Connect) and checked out per shot, so a long series does not go through the allocator
+ **/
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+class FramePool {
+    struct Block {
+        unsigned char* data;
+        size_t capacity;
+        bool inUse;
+    };
+
+public:
+    /* RAII handle for a checked-out buffer, returns it to the pool on destruction */
+    class Handle {
+        FramePool* m_pool = nullptr;
+        size_t m_index = 0;
+        unsigned char* m_data = nullptr;
+        size_t m_size = 0;
+
+        friend class FramePool;
+        Handle(FramePool* pool, size_t index, unsigned char* data, size_t size)
+            : m_pool(pool), m_index(index), m_data(data), m_size(size) {}
+
+    public:
+        Handle() = default;
+        Handle(const Handle&) = delete;
+        Handle& operator=(const Handle&) = delete;
+        Handle(Handle&& other) noexcept;
+        Handle& operator=(Handle&& other) noexcept;
+        ~Handle() { Release(); }
+
+        void Release();
+        unsigned char* Data() const { return m_data; }
+        template <typename T> T* As() const { return reinterpret_cast<T*>(m_data); }
+        size_t Size() const { return m_size; }
+        explicit operator bool() const { return m_data != nullptr; }
+    };
+
+    struct Counters {
+        size_t allocations = 0;   // heap allocations done by the pool
+        size_t acquires = 0;      // buffers checked out
+        size_t misses = 0;        // checkouts which needed a new allocation
+        size_t bytesAllocated = 0;
+        size_t inUse = 0;
+    };
+
+    FramePool() = default;
+    FramePool(const FramePool&) = delete;
+    FramePool& operator=(const FramePool&) = delete;
+    ~FramePool();
+
+    /**
+     * @brief make sure at least count buffers of the size class of bytes exist
+     */
+    void Reserve(size_t bytes, int count);
+
+    /**
+     * @brief check out the smallest free buffer that holds bytes, allocate a new one only if there is none
+     * @return empty handle if the allocation failed
+     */
+    Handle Acquire(size_t bytes);
+
+    Counters GetCounters();
+
+private:
+    std::mutex m_mutex;
+    std::vector<Block> m_blocks;
+    Counters m_counters;
+
+    bool allocate(size_t bytes);
+    void release(size_t index);
+};
+
+#endif //FRAMEPOOL_H
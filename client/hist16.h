@@ -0,0 +1,121 @@
+#ifndef HIST16_H
+#define HIST16_H
+
+/** Full 65536-bin histogram of 16-bit frames. Every thread fills its own part of the frame into
+ * four lane histograms (pixel i goes to lane i % 4), so repeated values in a row do not wait
+ * on the store of the previous increment; lanes and threads are summed at the end.
+ * Header-only so the ROOT macros can include it directly, TH1I export is left to the caller.
+ **/
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "pipeline.h"
+
+class Hist16 {
+public:
+    static const int BINS = 65536;
+
+    Hist16() : m_bins(BINS, 0) {}
+
+    /* 0 - all cores */
+    void SetThreads(int threads) { m_threads = threads; }
+
+    void Reset()
+    {
+        std::fill(m_bins.begin(), m_bins.end(), 0);
+        m_count = 0;
+    }
+
+    /* adds count 16-bit values to the histogram */
+    template <typename T>
+    void Fill(const T* image, size_t count)
+    {
+        const int LANES = 4;
+        // no point in a thread for less than a 64K-pixel slice
+        int threads = m_threads > 0 ? m_threads : std::max(1u, std::thread::hardware_concurrency());
+        int parts = (int)std::max<size_t>(1, std::min<size_t>(threads, count / 65536));
+        size_t partSize = (count + parts - 1) / parts;
+
+        m_lanes.resize((size_t)parts * LANES * BINS);
+        ParallelFor(parts, threads, [&](int part) {
+            uint32_t* lanes = m_lanes.data() + (size_t)part * LANES * BINS;
+            std::fill(lanes, lanes + LANES * BINS, 0);
+            uint32_t* h0 = lanes;
+            uint32_t* h1 = lanes + BINS;
+            uint32_t* h2 = lanes + 2 * BINS;
+            uint32_t* h3 = lanes + 3 * BINS;
+
+            size_t i = std::min(count, part * partSize);
+            size_t end = std::min(count, i + partSize);
+            for (; i + LANES <= end; i += LANES)
+            {
+                h0[(uint16_t)image[i]]++;
+                h1[(uint16_t)image[i + 1]]++;
+                h2[(uint16_t)image[i + 2]]++;
+                h3[(uint16_t)image[i + 3]]++;
+            }
+            for (; i < end; i++)
+                h0[(uint16_t)image[i]]++;
+        });
+
+        // sum the lanes of all parts, every thread takes a range of bins
+        const int BLOCK = 4096;
+        int sublists = parts * LANES;
+        ParallelFor(BINS / BLOCK, threads, [&](int block) {
+            for (int bin = block * BLOCK; bin < (block + 1) * BLOCK; bin++)
+            {
+                uint64_t sum = 0;
+                for (int lane = 0; lane < sublists; lane++)
+                    sum += m_lanes[(size_t)lane * BINS + bin];
+                m_bins[bin] += sum;
+            }
+        });
+        m_count += count;
+    }
+
+    uint64_t Count() const { return m_count; }
+    uint64_t Bin(int value) const { return m_bins[value]; }
+    const std::vector<uint64_t>& Bins() const { return m_bins; }
+
+    /* smallest value with at least p percent of the pixels at or below it */
+    int Percentile(double p) const
+    {
+        if (m_count == 0)
+            return 0;
+        uint64_t target = std::max<uint64_t>(1, (uint64_t)(p / 100. * m_count + 0.5));
+        uint64_t sum = 0;
+        for (int value = 0; value < BINS; value++)
+        {
+            sum += m_bins[value];
+            if (sum >= target)
+                return value;
+        }
+        return BINS - 1;
+    }
+
+    /* number of pixels at or above level, 65535 by default (saturated ADC) */
+    uint64_t Saturated(int level = BINS - 1) const
+    {
+        uint64_t sum = 0;
+        for (int value = std::max(0, level); value < BINS; value++)
+            sum += m_bins[value];
+        return sum;
+    }
+
+    /* most frequent value, the lowest one on a tie */
+    int Mode() const
+    {
+        return std::max_element(m_bins.begin(), m_bins.end()) - m_bins.begin();
+    }
+
+private:
+    int m_threads = 0;
+    uint64_t m_count = 0;
+    std::vector<uint64_t> m_bins;
+    std::vector<uint32_t> m_lanes;   // kept between frames
+};
+
+#endif //HIST16_H
@@ -0,0 +1,376 @@
+// Project headers
+#include "imagestat.h"
+#include "latency.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define IMAGESTAT_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define IMAGESTAT_NEON
+#include <arm_neon.h>
+#endif
+
+/* 32-bit lane sums are flushed to 64 bits after this many vectors.
+ * Every lane gets two pixels per vector, so 16384 * 2 * 65535 still fits in 32 bits */
+static const size_t FLUSH_VECTORS = 16384;
+
+typedef void (*stat_kernel_t)(const unsigned short*, size_t, uint64_t&, uint64_t&);
+typedef void (*stretch_kernel_t)(const unsigned short*, size_t, float, float, unsigned char*);
+
+static void statScalar(const unsigned short* p, size_t n, uint64_t& sum, uint64_t& sq)
+{
+    uint64_t s = 0, q = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t v = p[i];
+        s += v;
+        q += v * v;
+    }
+    sum += s;
+    sq += q;
+}
+
+static inline unsigned char stretchPixel(unsigned short pix, float minVal, float scale)
+{
+    float pl = ((float)pix - minVal) * scale;
+    if (pl < 0) pl = 0;
+    if (pl > 255) pl = 255;
+    return (unsigned char)pl;
+}
+
+static void stretchScalar(const unsigned short* p, size_t n, float minVal, float scale, unsigned char* out)
+{
+    for (size_t i = 0; i < n; i++)
+        out[i] = stretchPixel(p[i], minVal, scale);
+}
+
+#ifdef IMAGESTAT_X86
+
+static void statSse2(const unsigned short* p, size_t n, uint64_t& sum, uint64_t& sq)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum64 = zero;
+    __m128i sq64 = zero;
+    size_t vecEnd = n & ~(size_t)7;
+    size_t i = 0;
+
+    while (i < vecEnd)
+    {
+        size_t blockEnd = std::min(vecEnd, i + FLUSH_VECTORS * 8);
+        __m128i sum32 = zero;
+        for (; i < blockEnd; i += 8)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+            sum32 = _mm_add_epi32(sum32, _mm_unpacklo_epi16(v, zero));
+            sum32 = _mm_add_epi32(sum32, _mm_unpackhi_epi16(v, zero));
+
+            // full 32-bit squares from the low and high halves of the 16x16 product
+            __m128i lo = _mm_mullo_epi16(v, v);
+            __m128i hi = _mm_mulhi_epu16(v, v);
+            __m128i sqA = _mm_unpacklo_epi16(lo, hi);
+            __m128i sqB = _mm_unpackhi_epi16(lo, hi);
+            sq64 = _mm_add_epi64(sq64, _mm_unpacklo_epi32(sqA, zero));
+            sq64 = _mm_add_epi64(sq64, _mm_unpackhi_epi32(sqA, zero));
+            sq64 = _mm_add_epi64(sq64, _mm_unpacklo_epi32(sqB, zero));
+            sq64 = _mm_add_epi64(sq64, _mm_unpackhi_epi32(sqB, zero));
+        }
+        sum64 = _mm_add_epi64(sum64, _mm_unpacklo_epi32(sum32, zero));
+        sum64 = _mm_add_epi64(sum64, _mm_unpackhi_epi32(sum32, zero));
+    }
+
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, sum64);
+    sum += lanes[0] + lanes[1];
+    _mm_storeu_si128((__m128i*)lanes, sq64);
+    sq += lanes[0] + lanes[1];
+
+    statScalar(p + vecEnd, n - vecEnd, sum, sq);
+}
+
+static void stretchSse2(const unsigned short* p, size_t n, float minVal, float scale, unsigned char* out)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 vmin = _mm_set1_ps(minVal);
+    const __m128 vscale = _mm_set1_ps(scale);
+    size_t vecEnd = n & ~(size_t)15;
+
+    for (size_t i = 0; i < vecEnd; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(p + i + 8));
+        __m128i q[4] = {
+            _mm_unpacklo_epi16(a, zero), _mm_unpackhi_epi16(a, zero),
+            _mm_unpacklo_epi16(b, zero), _mm_unpackhi_epi16(b, zero)
+        };
+        for (int k = 0; k < 4; k++)
+        {
+            __m128 f = _mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(q[k]), vmin), vscale);
+            q[k] = _mm_cvttps_epi32(f);
+        }
+        // saturating packs do the clamping to [0, 255]
+        __m128i w0 = _mm_packs_epi32(q[0], q[1]);
+        __m128i w1 = _mm_packs_epi32(q[2], q[3]);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(w0, w1));
+    }
+
+    stretchScalar(p + vecEnd, n - vecEnd, minVal, scale, out + vecEnd);
+}
+
+__attribute__((target("avx2")))
+static void statAvx2(const unsigned short* p, size_t n, uint64_t& sum, uint64_t& sq)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sum64 = zero;
+    __m256i sq64 = zero;
+    size_t vecEnd = n & ~(size_t)15;
+    size_t i = 0;
+
+    while (i < vecEnd)
+    {
+        size_t blockEnd = std::min(vecEnd, i + FLUSH_VECTORS * 16);
+        __m256i sum32 = zero;
+        for (; i < blockEnd; i += 16)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+            sum32 = _mm256_add_epi32(sum32, _mm256_unpacklo_epi16(v, zero));
+            sum32 = _mm256_add_epi32(sum32, _mm256_unpackhi_epi16(v, zero));
+
+            __m256i lo = _mm256_mullo_epi16(v, v);
+            __m256i hi = _mm256_mulhi_epu16(v, v);
+            __m256i sqA = _mm256_unpacklo_epi16(lo, hi);
+            __m256i sqB = _mm256_unpackhi_epi16(lo, hi);
+            sq64 = _mm256_add_epi64(sq64, _mm256_unpacklo_epi32(sqA, zero));
+            sq64 = _mm256_add_epi64(sq64, _mm256_unpackhi_epi32(sqA, zero));
+            sq64 = _mm256_add_epi64(sq64, _mm256_unpacklo_epi32(sqB, zero));
+            sq64 = _mm256_add_epi64(sq64, _mm256_unpackhi_epi32(sqB, zero));
+        }
+        sum64 = _mm256_add_epi64(sum64, _mm256_unpacklo_epi32(sum32, zero));
+        sum64 = _mm256_add_epi64(sum64, _mm256_unpackhi_epi32(sum32, zero));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, sum64);
+    sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm256_storeu_si256((__m256i*)lanes, sq64);
+    sq += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+    statScalar(p + vecEnd, n - vecEnd, sum, sq);
+}
+
+__attribute__((target("avx2")))
+static void stretchAvx2(const unsigned short* p, size_t n, float minVal, float scale, unsigned char* out)
+{
+    const __m256 vmin = _mm256_set1_ps(minVal);
+    const __m256 vscale = _mm256_set1_ps(scale);
+    size_t vecEnd = n & ~(size_t)15;
+
+    for (size_t i = 0; i < vecEnd; i += 16)
+    {
+        __m256i a = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(p + i)));
+        __m256i b = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(p + i + 8)));
+        a = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(_mm256_cvtepi32_ps(a), vmin), vscale));
+        b = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(_mm256_cvtepi32_ps(b), vmin), vscale));
+        // packs works per 128-bit lane, put the quarters back in order
+        __m256i w = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+        __m128i bytes = _mm_packus_epi16(_mm256_castsi256_si128(w), _mm256_extracti128_si256(w, 1));
+        _mm_storeu_si128((__m128i*)(out + i), bytes);
+    }
+
+    stretchScalar(p + vecEnd, n - vecEnd, minVal, scale, out + vecEnd);
+}
+
+#endif // IMAGESTAT_X86
+
+#ifdef IMAGESTAT_NEON
+
+static void statNeon(const unsigned short* p, size_t n, uint64_t& sum, uint64_t& sq)
+{
+    uint64x2_t sum64 = vdupq_n_u64(0);
+    uint64x2_t sq64 = vdupq_n_u64(0);
+    size_t vecEnd = n & ~(size_t)7;
+    size_t i = 0;
+
+    while (i < vecEnd)
+    {
+        size_t blockEnd = std::min(vecEnd, i + FLUSH_VECTORS * 8);
+        uint32x4_t sum32 = vdupq_n_u32(0);
+        for (; i < blockEnd; i += 8)
+        {
+            uint16x8_t v = vld1q_u16(p + i);
+            sum32 = vpadalq_u16(sum32, v);
+            sq64 = vpadalq_u32(sq64, vmull_u16(vget_low_u16(v), vget_low_u16(v)));
+            sq64 = vpadalq_u32(sq64, vmull_u16(vget_high_u16(v), vget_high_u16(v)));
+        }
+        sum64 = vpadalq_u32(sum64, sum32);
+    }
+
+    sum += vgetq_lane_u64(sum64, 0) + vgetq_lane_u64(sum64, 1);
+    sq += vgetq_lane_u64(sq64, 0) + vgetq_lane_u64(sq64, 1);
+
+    statScalar(p + vecEnd, n - vecEnd, sum, sq);
+}
+
+static void stretchNeon(const unsigned short* p, size_t n, float minVal, float scale, unsigned char* out)
+{
+    const float32x4_t vmin = vdupq_n_f32(minVal);
+    const float32x4_t vscale = vdupq_n_f32(scale);
+    size_t vecEnd = n & ~(size_t)7;
+
+    for (size_t i = 0; i < vecEnd; i += 8)
+    {
+        uint16x8_t v = vld1q_u16(p + i);
+        float32x4_t a = vcvtq_f32_u32(vmovl_u16(vget_low_u16(v)));
+        float32x4_t b = vcvtq_f32_u32(vmovl_u16(vget_high_u16(v)));
+        int32x4_t ia = vcvtq_s32_f32(vmulq_f32(vsubq_f32(a, vmin), vscale));
+        int32x4_t ib = vcvtq_s32_f32(vmulq_f32(vsubq_f32(b, vmin), vscale));
+        // saturating narrows do the clamping to [0, 255]
+        uint16x8_t w = vcombine_u16(vqmovun_s32(ia), vqmovun_s32(ib));
+        vst1_u8(out + i, vqmovn_u16(w));
+    }
+
+    stretchScalar(p + vecEnd, n - vecEnd, minVal, scale, out + vecEnd);
+}
+
+#endif // IMAGESTAT_NEON
+
+struct ImageStatKernels {
+    const char* name;
+    stat_kernel_t stat;
+    stretch_kernel_t stretch;
+};
+
+static ImageStatKernels selectKernels()
+{
+#if defined(IMAGESTAT_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return {"avx2", statAvx2, stretchAvx2};
+    if (__builtin_cpu_supports("sse2"))
+        return {"sse2", statSse2, stretchSse2};
+#elif defined(IMAGESTAT_NEON)
+    return {"neon", statNeon, stretchNeon};
+#endif
+    return {"scalar", statScalar, stretchScalar};
+}
+
+static const ImageStatKernels& kernels()
+{
+    static const ImageStatKernels selected = selectKernels();
+    return selected;
+}
+
+ImageStat ComputeImageStat(const unsigned short* image, size_t count)
+{
+    ImageStat stat;
+    stat.count = count;
+    if (count == 0)
+        return stat;
+
+    kernels().stat(image, count, stat.sum, stat.sumSquares);
+
+    // the sums are exact, only the final combination is done in floating point
+    stat.mean = (double)stat.sum / count;
+    if (count > 1)
+    {
+        double deltaSquared = (double)stat.sumSquares - stat.mean * (double)stat.sum;
+        stat.std = std::sqrt(std::max(deltaSquared, 0.0) / (count - 1));
+    }
+    return stat;
+}
+
+void StretchImage(const unsigned short* image, size_t count, double minVal, double maxVal, unsigned char* out)
+{
+    double range = maxVal - minVal;
+    if (range <= 0)
+        range = 1;
+    kernels().stretch(image, count, (float)minVal, (float)(255 / range), out);
+}
+
+const char* ImageStatBackend()
+{
+    return kernels().name;
+}
+
+/* AdjustImage as it was before the single pass: two double loops for mean and deviation, then the rescale */
+static void adjustReference(const unsigned short* buffer, int x, int y, unsigned char* out, double& avg, double& dev)
+{
+    double total = 0;
+    double deltaSquared = 0;
+    for (int j = 0; j < y; j++)
+        for (int i = 0; i < x; i++)
+            total += (double)buffer[((j * x) + i)];
+    avg = total / (x * y);
+    for (int j = 0; j < y; j++)
+        for (int i = 0; i < x; i++)
+            deltaSquared += std::pow((avg - buffer[((j * x) + i)]), 2);
+    dev = std::sqrt(deltaSquared / ((x * y) - 1));
+
+    double minVal = avg - dev * 3;
+    if (minVal < 0) minVal = 0;
+    double maxVal = avg + dev * 3;
+    if (maxVal > 65535) maxVal = 65535;
+    double range = maxVal - minVal;
+    if (range == 0)
+        range = 1;
+    double spread = 65535 / range;
+    for (int pix = 0; pix < x * y; pix++)
+    {
+        double pl = ((double)buffer[pix] - minVal) * spread;
+        pl = (pl * 255) / 65535;
+        if (pl > 255) pl = 255;
+        out[pix] = (unsigned char)pl;
+    }
+}
+
+int IMAGESTAT_Bench(int cols, int rows, int iterations)
+{
+    if (cols < 2 || rows < 2 || iterations < 1)
+        return 1;
+    size_t count = (size_t)cols * rows;
+
+    // dark-like frame: bias with noise, a gradient and a few saturated pixels
+    std::vector<unsigned short> image(count);
+    unsigned int seed = 12345;
+    for (size_t i = 0; i < count; i++)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        int value = 1000 + (int)(i % cols) / 8 + (int)(seed >> 24) - 128;
+        image[i] = (seed & 0xffff) < 4 ? 65535 : (unsigned short)value;
+    }
+    std::vector<unsigned char> reference(count), out(count);
+
+    double avg = 0, dev = 0;
+    uint64_t begin = LATENCY_Now();
+    for (int k = 0; k < iterations; k++)
+        adjustReference(image.data(), cols, rows, reference.data(), avg, dev);
+    double referenceMs = (LATENCY_Now() - begin) * 1E-6 / iterations;
+
+    ImageStat stat;
+    begin = LATENCY_Now();
+    for (int k = 0; k < iterations; k++)
+    {
+        stat = ComputeImageStat(image.data(), count);
+        StretchImage(image.data(), count, std::max(0., stat.mean - stat.std * 3), std::min(65535., stat.mean + stat.std * 3),
+                     out.data());
+    }
+    double singlePassMs = (LATENCY_Now() - begin) * 1E-6 / iterations;
+
+    // the rescale is done in float now, a level may round the other way
+    size_t differ = 0;
+    for (size_t i = 0; i < count; i++)
+        if (std::abs(reference[i] - out[i]) > 1)
+            differ++;
+    bool same = std::fabs(stat.mean - avg) < 1E-6 * avg && std::fabs(stat.std - dev) < 1E-6 * dev && differ == 0;
+
+    printf("Stats %dx%d: mean %.3f std %.3f, former %.3f %.3f, %zu pixels off by more than 1\n", cols, rows,
+           stat.mean, stat.std, avg, dev, differ);
+    printf("Stats: former %.2f ms, single pass (%s) %.2f ms per frame, %.1fx\n", referenceMs, ImageStatBackend(),
+           singlePassMs, referenceMs / singlePassMs);
+    return same ? 0 : 1;
+}
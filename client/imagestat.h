@@ -0,0 +1,52 @@
+#ifndef IMAGESTAT_H
+#define IMAGESTAT_H
+
+/** Statistics and display rescale for 16-bit frames. Both run in one pass over the frame
+ * with SSE2/AVX2/NEON code paths picked at runtime and a scalar fallback
+ **/
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief time the statistics and rescale of a cols x rows frame against the former double loops, see --bench-stats
+ * @return 0 - both give the same mean, deviation and display image
+ */
+int IMAGESTAT_Bench(int cols, int rows, int iterations);
+
+#ifdef __cplusplus
+}
+
+#include <cstddef>
+#include <cstdint>
+
+struct ImageStat {
+    size_t count = 0;
+    uint64_t sum = 0;
+    uint64_t sumSquares = 0;
+    double mean = 0;
+    double std = 0;      // sample standard deviation (n - 1)
+};
+
+/**
+ * @brief integer accumulation of sum and sum of squares in a single pass
+ * @param image: 16-bit pixels
+ * @param count: number of pixels
+ */
+ImageStat ComputeImageStat(const unsigned short* image, size_t count);
+
+/**
+ * @brief linear rescale [minVal, maxVal] -> [0, 255] with clamping, as used for the display image
+ */
+void StretchImage(const unsigned short* image, size_t count, double minVal, double maxVal, unsigned char* out);
+
+/**
+ * @brief name of the code path selected on this host ("avx2", "sse2", "neon" or "scalar")
+ */
+const char* ImageStatBackend();
+#endif
+
+#endif //IMAGESTAT_H
@@ -0,0 +1,120 @@
+// Project headers
+#include "latency.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <time.h>
+#include <vector>
+
+#include "queue.h"
+
+// 2^SUB_BITS buckets per power of two, values below 2^SUB_BITS ns get a bucket each
+static const int SUB_BITS = 5;
+static const int SUB_COUNT = 1 << SUB_BITS;
+static const int BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+static const char* STAGE_NAMES[LAT_STAGE_COUNT] = {
+    "exposure", "ready_wait", "readout", "calibration", "clusters", "stats",
+    "tiff", "save", "preview", "queue_wait", "ws_send", "command"
+};
+
+struct LatencyHistogram {
+    std::atomic<uint64_t> buckets[BUCKETS];
+    std::atomic<uint64_t> sumNs;
+    std::atomic<uint64_t> maxNs;
+};
+
+// zero-initialized as a static, no constructor runs before the first record
+static LatencyHistogram Histograms[LAT_STAGE_COUNT];
+
+static int bucketOf(uint64_t ns)
+{
+    if (ns < (uint64_t)SUB_COUNT)
+        return (int)ns;
+    int exponent = 63 - __builtin_clzll(ns);
+    return (exponent - SUB_BITS + 1) * SUB_COUNT + (int)((ns >> (exponent - SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+/* middle of the values falling in bucket */
+static double bucketValue(int bucket)
+{
+    if (bucket < SUB_COUNT)
+        return bucket;
+    int shift = bucket / SUB_COUNT - 1;
+    uint64_t low = (uint64_t)(SUB_COUNT + bucket % SUB_COUNT) << shift;
+    return low + ((1ull << shift) - 1) / 2.;
+}
+
+uint64_t LATENCY_Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void LATENCY_Record(latency_stage_t stage, uint64_t ns)
+{
+    if (stage < 0 || stage >= LAT_STAGE_COUNT)
+        return;
+    LatencyHistogram& histogram = Histograms[stage];
+    histogram.buckets[bucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+    histogram.sumNs.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t max = histogram.maxNs.load(std::memory_order_relaxed);
+    while (ns > max && !histogram.maxNs.compare_exchange_weak(max, ns, std::memory_order_relaxed))
+        ;
+}
+
+std::string LatencySnapshotJson(bool reset)
+{
+    static const double PERCENTILES[] = {50, 90, 99, 99.9};
+    std::string json = "{\"type\":\"latency\",\"stages\":{";
+    char text[256];
+    bool first = true;
+    std::vector<uint64_t> buckets(BUCKETS);
+    for (int stage = 0; stage < LAT_STAGE_COUNT; stage++)
+    {
+        // a copy first, records going on meanwhile may make the counts differ by a few
+        LatencyHistogram& histogram = Histograms[stage];
+        uint64_t count = 0;
+        for (int b = 0; b < BUCKETS; b++)
+        {
+            buckets[b] = reset ? histogram.buckets[b].exchange(0, std::memory_order_relaxed)
+                               : histogram.buckets[b].load(std::memory_order_relaxed);
+            count += buckets[b];
+        }
+        uint64_t sumNs = reset ? histogram.sumNs.exchange(0) : histogram.sumNs.load();
+        uint64_t maxNs = reset ? histogram.maxNs.exchange(0) : histogram.maxNs.load();
+        if (count == 0)
+            continue;
+
+        double values[4];
+        int b = 0;
+        uint64_t sum = 0;
+        for (int p = 0; p < 4; p++)
+        {
+            uint64_t target = std::max<uint64_t>(1, (uint64_t)(PERCENTILES[p] / 100. * count + 0.5));
+            while (b < BUCKETS - 1 && sum + buckets[b] < target)
+                sum += buckets[b++];
+            values[p] = std::min(bucketValue(b), (double)maxNs);
+        }
+        snprintf(text, sizeof(text),
+                 "%s\"%s\":{\"count\":%llu,\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}",
+                 first ? "" : ",", STAGE_NAMES[stage], (unsigned long long)count, sumNs / 1E6 / count,
+                 values[0] / 1E6, values[1] / 1E6, values[2] / 1E6, values[3] / 1E6, maxNs / 1E6);
+        json += text;
+        first = false;
+    }
+    // depths and drops of the outbound queue lanes (queue.h)
+    char queue[512];
+    QUEUE_StatsJson(queue, sizeof(queue));
+    json += "},\"queue\":";
+    json += queue;
+    json += ",\"unit\":\"ms\"}";
+    return json;
+}
+
+void LATENCY_PushSnapshot(int reset)
+{
+    QUEUE_NewMsg(LatencySnapshotJson(reset != 0).c_str());
+}
@@ -0,0 +1,83 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+/** Latency of the client stages, kept in one histogram per stage for the whole run.
+ * Buckets are log-linear like HDR histograms: every power of two is split in 32 buckets, so a
+ * value is known to about 3% from nanoseconds up to hours. Recording is a few relaxed atomic adds
+ * and can be done from any thread, including the libwebsockets loop (C API below)
+ **/
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    LAT_EXPOSURE,           // StartExposure to ImageReady
+    LAT_READY_WAIT,         // ImageReady later than the end of the exposure
+    LAT_READOUT,            // get_ImageArray
+    LAT_CALIBRATION,
+    LAT_CLUSTERS,
+    LAT_STATS,              // display statistics and stretch of the 8-bit TIFF
+    LAT_TIFF,
+    LAT_SAVE,               // .dat file
+    LAT_PREVIEW,
+    LAT_QUEUE_WAIT,         // frame waiting for the writer stage
+    LAT_WS_SEND,            // first to last fragment of a websocket message
+    LAT_COMMAND,            // server command received to answered
+    LAT_STAGE_COUNT
+} latency_stage_t;
+
+/* Monotonic clock in nanoseconds */
+uint64_t LATENCY_Now(void);
+
+void LATENCY_Record(latency_stage_t stage, uint64_t ns);
+
+/**
+ * @brief add a {"type":"latency",...} message with count, mean, p50, p90, p99, p99.9 and max (ms)
+ * of every stage to the client queue, and the lane depths and drops of the queue (QUEUE_StatsJson)
+ * @param reset: start the histograms over after the snapshot
+ */
+void LATENCY_PushSnapshot(int reset);
+
+#ifdef __cplusplus
+}
+
+#include <string>
+
+/* Records the time from construction to destruction (or Stop) into stage */
+class ScopedLatency {
+public:
+    explicit ScopedLatency(latency_stage_t stage) : m_stage(stage), m_start(LATENCY_Now()) {}
+    ~ScopedLatency() { Stop(); }
+
+    /* records now instead of at the end of the scope, returns the seconds */
+    double Stop()
+    {
+        if (m_done)
+            return m_sec;
+        m_done = true;
+        uint64_t ns = LATENCY_Now() - m_start;
+        LATENCY_Record(m_stage, ns);
+        m_sec = ns * 1E-9;
+        return m_sec;
+    }
+
+private:
+    latency_stage_t m_stage;
+    uint64_t m_start;
+    bool m_done = false;
+    double m_sec = 0;
+};
+
+inline void LatencyRecordSec(latency_stage_t stage, double sec)
+{
+    LATENCY_Record(stage, sec > 0 ? (uint64_t)(sec * 1E9) : 0);
+}
+
+/* JSON of the snapshot LATENCY_PushSnapshot sends */
+std::string LatencySnapshotJson(bool reset);
+#endif
+
+#endif //LATENCY_H
@@ -1,58 +1,163 @@
-TH1I* build_1dimhist(TString filename)
+#include "datreader.h"
+#include "hist16.h"
+#include "pixelstat.h"
+#include "statplanes.h"
+
+std::vector<int> fill_data(TString fname, double& time, int& cols, int& rows);
+
+// ROOT copy of a Hist16, bin i + 1 holds value i
+TH1I* hist16_to_th1i(const Hist16& hist, const char* name = "hist1d")
 {
-    TFile* f = TFile::Open(filename);
-    TH2I* hist2d = (TH2I*)f->Get("hist2d");
-    int* data = hist2d->GetArray();
+    TH1I* hist1d = new TH1I(name, name, Hist16::BINS, 0, Hist16::BINS);
+    for (int value = 0; value < Hist16::BINS; value++)
+        hist1d->SetBinContent(value + 1, hist.Bin(value));
+    hist1d->SetEntries(hist.Count());
+    return hist1d;
+}
 
-    TH1I* hist1d = new TH1I("hist1d", "hist1d", 65536, 0, 65536);
+// Pixel value histogram of one frame (.root or .dat)
+TH1I* build_1dimhist(TString filename)
+{
+    double time;
+    int cols, rows;
+    std::vector<int> data = fill_data(filename, time, cols, rows);
 
-    for (int i = 0; i < hist2d->GetEntries(); i++)
-        hist1d->Fill(data[i]);
+    Hist16 hist;
+    hist.Fill(data.data(), data.size());
+    std::cout << "median " << hist.Percentile(50) << " 99.9% " << hist.Percentile(99.9)
+              << " mode " << hist.Mode() << " saturated " << hist.Saturated() << std::endl;
 
+    TH1I* hist1d = hist16_to_th1i(hist);
     //hist1d->Draw();
     return hist1d;
 }
 
-std::pair<std::vector<double>, std::vector<double>> calc_stat(const std::vector<std::vector<int>> array)
+// Hist16 throughput against one plain histogram on full-size synthetic frames
+void bench_hist16(int frames = 20, int cols = 3388, int rows = 2712)
+{
+	size_t pixels = (size_t)cols * rows;
+	std::vector<uint16_t> image(pixels);
+	uint32_t state = 12345;
+	for (size_t i = 0; i < pixels; i++)
+	{
+	    state = state * 1664525 + 1013904223;
+	    // flat dark frame with a few saturated pixels, the worst case for repeated bins
+	    image[i] = (state >> 28) == 0 ? 65535 : 1000 + (state >> 29);
+	}
+	auto seconds = [](std::chrono::steady_clock::time_point begin) {
+	    return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	};
+
+	std::vector<uint64_t> plain(Hist16::BINS, 0);
+	auto begin = std::chrono::steady_clock::now();
+	for (int f = 0; f < frames; f++)
+	    for (size_t i = 0; i < pixels; i++)
+	        plain[image[i]]++;
+	double plainSec = seconds(begin);
+
+	int cores = std::max(1u, std::thread::hardware_concurrency());
+	for (int threads = 1; ; threads = std::min(threads * 2, cores))
+	{
+	    Hist16 hist;
+	    hist.SetThreads(threads);
+	    begin = std::chrono::steady_clock::now();
+	    for (int f = 0; f < frames; f++)
+	        hist.Fill(image.data(), pixels);
+	    double sec = seconds(begin);
+	    bool same = std::equal(plain.begin(), plain.end(), hist.Bins().begin());
+	    printf("%2d threads: %.2f Gpixel/s (plain %.2f), %s\n", threads, frames * pixels / sec / 1e9,
+	           frames * pixels / plainSec / 1e9, same ? "same bins" : "BINS DIFFER");
+	    if (threads == cores)
+	        break;
+	}
+}
+
+// Two-pass reference for PixelStat: needs every frame in memory, kept to check the streaming result
+std::pair<std::vector<double>, std::vector<double>> calc_stat(const std::vector<std::vector<int>>& array)
 {
-	std::vector<double> means;
-	means.resize(3388*2712, 0);
-	std::vector<double> devs;
-	devs.resize(3388*2712, 0);
+	size_t pixels = array.empty() ? 0 : array[0].size();
+	std::vector<double> means(pixels, 0);
+	std::vector<double> devs(pixels, 0);
 
 	for (const auto& vec: array)
 	{
-            for (int i = 0; i < vec.size(); i++)
-	    {
-	        means.at(i) += vec.at(i) * 1./ array.size();
-	    }
+            for (size_t i = 0; i < pixels; i++)
+	        means[i] += vec[i];
 	}
+	for (size_t i = 0; i < pixels; i++)
+	    means[i] /= array.size();
 
 	for (const auto& vec: array)
 	{
-            for (int i = 0; i < vec.size(); i++)
+            for (size_t i = 0; i < pixels; i++)
 	    {
-	        devs.at(i) += pow((means.at(i) - vec.at(i)) / array.size(), 2);
+	        double d = vec[i] - means[i];
+	        devs[i] += d * d;
 	    }
 	}
 
-	for (int i = 0; i < 3388*2712; i++)
-	    devs.at(i) = sqrt(devs.at(i));
+	for (size_t i = 0; i < pixels; i++)
+	    devs[i] = sqrt(devs[i] / array.size());
 
 	return {means, devs};
 }
 
-std::vector<int> fill_data(TString fname, double& time)
+// Compares the streaming PixelStat with calc_stat on a synthetic series
+void check_pixel_stat(int frames = 20, int pixels = 100000)
+{
+	TRandom3 rnd(1);
+	std::vector<std::vector<int>> array(frames, std::vector<int>(pixels));
+	PixelStat stat;
+	for (auto& vec: array)
+	{
+	    for (int i = 0; i < pixels; i++)
+	        vec[i] = rnd.Gaus(1000 + i % 50000, 5 + i % 20);
+	    stat.Add(vec.data(), vec.size());
+	}
+
+	auto [means, devs] = calc_stat(array);
+	double meanDiff = 0, devDiff = 0;
+	for (int i = 0; i < pixels; i++)
+	{
+	    meanDiff = std::max(meanDiff, fabs(stat.Mean(i) - means[i]));
+	    devDiff = std::max(devDiff, fabs(stat.Dev(i) - devs[i]));
+	}
+	std::cout << "max |mean diff| " << meanDiff << " max |dev diff| " << devDiff << std::endl;
+}
+
+std::vector<int> fill_data(TString fname, double& time, int& cols, int& rows)
 {
     std::vector<int> res;
-    // Image size 3388 x 2712
-    res.reserve(3388*2712);
+
+    if (fname.EndsWith(".dat"))
+    {
+        // straight from the acquisition output, the pixels are read from the mapped file
+        DatFile dat(fname.Data());
+        const DatMeta* meta = dat.Meta();
+        const uint16_t* pixels = dat.Pixels();
+        if (meta == nullptr || pixels == nullptr)
+        {
+            std::cout << "Broken frame " << fname << std::endl;
+            return res;
+        }
+        cols = meta->xSize;
+        rows = meta->ySize;
+        res.assign(pixels, pixels + (size_t)cols * rows);
+        time = meta->exposureTime;
+        return res;
+    }
+
     TFile* f = TFile::Open(fname);
     TH2I* hist2d = (TH2I*)f->Get("hist2d");
     int* data = hist2d->GetArray();
+    cols = hist2d->GetNbinsX();
+    rows = hist2d->GetNbinsY();
 
-    for (int i = 0; i < hist2d->GetEntries(); i++)
-        res.push_back(data[i]);
+    // the bin array has an underflow and an overflow bin on both sides of every axis
+    res.resize((size_t)cols * rows);
+    for (int j = 0; j < rows; j++)
+        std::copy(data + (size_t)(j + 1) * (cols + 2) + 1, data + (size_t)(j + 1) * (cols + 2) + 1 + cols,
+                  res.begin() + (size_t)j * cols);
 
     time = ((TParameter<double>*)f->Get("exposureTime"))->GetVal();
 
@@ -60,7 +165,135 @@ std::vector<int> fill_data(TString fname, double& time)
     return res;
 }
 
-void fill_tree(const char* dirname, const char* ext)
+// Scaling of PixelStat from 1 thread to all cores on a synthetic series
+void bench_pixel_stat(int frames = 50, int cols = 3388, int rows = 2712)
+{
+	const int DISTINCT = 5;
+	const int BATCH = 10;
+	size_t pixels = (size_t)cols * rows;
+	std::vector<std::vector<uint16_t>> images(DISTINCT, std::vector<uint16_t>(pixels));
+	for (int f = 0; f < DISTINCT; f++)
+	{
+	    uint32_t state = 12345 + f;
+	    for (size_t i = 0; i < pixels; i++)
+	    {
+	        state = state * 1664525 + 1013904223;
+	        images[f][i] = 1000 + (state >> 26);
+	    }
+	}
+	std::vector<const uint16_t*> series(frames);
+	for (int f = 0; f < frames; f++)
+	    series[f] = images[f % DISTINCT].data();
+
+	double single = 0;
+	int cores = std::max(1u, std::thread::hardware_concurrency());
+	for (int threads = 1; ; threads = std::min(threads * 2, cores))
+	{
+	    PixelStat stat;
+	    stat.SetThreads(threads);
+	    std::vector<double> means, devs;
+	    auto begin = std::chrono::steady_clock::now();
+	    for (int f = 0; f < frames; f += BATCH)
+	        stat.AddFrames(series.data() + f, std::min(BATCH, frames - f), pixels);
+	    stat.Result(means, devs);
+	    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	    if (threads == 1)
+	        single = seconds;
+	    printf("%2d threads: %.3f s, %.2f GB/s of frames, speedup %.2f\n", threads, seconds,
+	           frames * pixels * sizeof(uint16_t) / seconds / 1e9, single / seconds);
+	    if (threads == cores)
+	        break;
+	}
+}
+
+// Frames of one exposure time, fed by all reader threads
+struct ExposureGroup {
+    std::mutex mutex;
+    PixelStat stat;
+    int cols = 0;
+    int rows = 0;
+};
+
+/* Reads one frame into its exposure group, .dat pixels go from the mapped file without a copy */
+bool ingest_frame(const TString& fname, std::map<long, ExposureGroup>& array, std::mutex& arrayMutex)
+{
+    DatFile dat;
+    std::vector<int> data;
+    const uint16_t* pixels = nullptr;
+    double time = 0;
+    int cols = 0, rows = 0;
+
+    if (fname.EndsWith(".dat"))
+    {
+        const DatMeta* meta = dat.Open(fname.Data()) ? dat.Meta() : nullptr;
+        pixels = meta ? dat.Pixels() : nullptr;
+        if (pixels == nullptr)
+        {
+            std::cout << "Broken frame " << fname << std::endl;
+            return false;
+        }
+        time = meta->exposureTime;
+        cols = meta->xSize;
+        rows = meta->ySize;
+    }
+    else
+    {
+        data = fill_data(fname, time, cols, rows);
+        if (data.empty())
+            return false;
+    }
+
+    ExposureGroup* group;
+    {
+        std::lock_guard<std::mutex> lock(arrayMutex);
+        group = &array[DatExposureKey(time)];
+    }
+
+    std::lock_guard<std::mutex> lock(group->mutex);
+    if (group->stat.Frames() == 0)
+    {
+        // the readers already take all cores
+        group->stat.SetThreads(1);
+        group->cols = cols;
+        group->rows = rows;
+    }
+    else if (group->cols != cols || group->rows != rows)
+    {
+        std::cout << "Size mismatch, skipped " << fname << std::endl;
+        return false;
+    }
+    return pixels ? group->stat.Add(pixels, (size_t)cols * rows) : group->stat.Add(data.data(), data.size());
+}
+
+/* Per-pixel results as float32 planes, see statplanes.h */
+bool write_planes(const char* output, std::map<long, ExposureGroup>& array, int threads)
+{
+	StatPlanesWriter writer;
+	if (!writer.Open(output))
+	{
+	    std::cout << "Could not open " << output << std::endl;
+	    return false;
+	}
+	bool ok = true;
+	for (auto it = array.begin(); it != array.end() && ok; ++it)
+	{
+	    PixelStat& stat = it->second.stat;
+	    if (stat.Frames() == 0)
+	        continue;
+	    std::vector<float> means, devs;
+	    stat.SetThreads(threads);
+	    stat.Result(means, devs);
+	    std::cout << means[0] << " " << devs[0] << " " << it->first * 1.e-3 << " (" << stat.Frames() << " frames)" << std::endl;
+	    ok = writer.Add(it->first * 1.e-3, it->second.cols, it->second.rows, stat.Frames(), means.data(), devs.data());
+	}
+	return writer.Close() && ok;
+}
+
+/**
+ * threads: number of files read at once, 0 - all cores
+ * output: a .planes file gets the float32 planes, anything else the TTree as before
+ */
+void fill_tree(const char* dirname, const char* ext, int threads = 0, const char* output = "res.root")
 {
     TSystemDirectory dir(dirname, dirname);
     TList *files = dir.GetListOfFiles();
@@ -68,18 +301,50 @@ void fill_tree(const char* dirname, const char* ext)
         TSystemFile *file;
         TString fname;
         TIter next(files);
-	std::map<int, std::vector<std::vector<int>>> array;
-	double time;
+        std::vector<TString> names;
         while ((file=(TSystemFile*)next())) {
             fname = TString(dirname) + "/" + file->GetName();
-            if (!file->IsDirectory() && fname.EndsWith(ext)) {
-	            std::cout << fname << std::endl;
-		    auto data = fill_data(fname, time);
-		    array[time*1e3].push_back(data);
-            }
+            if (!file->IsDirectory() && fname.EndsWith(ext))
+                names.push_back(fname);
         }
 
-	TFile *res_file = new TFile("res.root", "UPDATE");
+	ROOT::EnableThreadSafety();
+	// one accumulator per exposure time, the frames themselves are not kept
+	std::map<long, ExposureGroup> array;
+	std::mutex arrayMutex, progressMutex;
+	std::atomic<size_t> done(0), bytes(0);
+	auto begin = std::chrono::steady_clock::now();
+	auto lastReport = begin;
+
+	// every reader holds one frame at a time, so memory is bounded by the thread count
+	ParallelFor(names.size(), threads, [&](int i) {
+	    struct stat st;
+	    if (stat(names[i].Data(), &st) == 0)
+	        bytes += st.st_size;
+	    ingest_frame(names[i], array, arrayMutex);
+	    done++;
+
+	    std::lock_guard<std::mutex> lock(progressMutex);
+	    auto now = std::chrono::steady_clock::now();
+	    if (now - lastReport > std::chrono::seconds(1) || done == names.size())
+	    {
+	        lastReport = now;
+	        double seconds = std::chrono::duration<double>(now - begin).count();
+	        printf("%zu/%zu files, %.1f files/s, %.1f MB/s\n", done.load(), names.size(),
+	               done / seconds, bytes / seconds / 1e6);
+	    }
+	});
+
+	auto writeBegin = std::chrono::steady_clock::now();
+	if (TString(output).EndsWith(".planes"))
+	{
+	    write_planes(output, array, threads);
+	    printf("Planes written in %.2f s\n", std::chrono::duration<double>(std::chrono::steady_clock::now() - writeBegin).count());
+	    return;
+	}
+
+	double time;
+	TFile *res_file = new TFile(output, "UPDATE");
 	TTree* tree = new TTree("tree", "tree");
 	int col, row;
 	double mean, dev;
@@ -91,20 +356,112 @@ void fill_tree(const char* dirname, const char* ext)
 	for (auto it = array.begin(); it != array.end(); ++it)
 	{
 	    time = it->first * 1.e-3;
-	    auto [means, devs] = calc_stat(it->second);
-	    std::cout << means[0] << " " << devs[0] << " " << time << std::endl;
-	    for (int i = 0; i < 3388; i++)
+	    PixelStat& stat = it->second.stat;
+	    int cols = it->second.cols, rows = it->second.rows;
+	    if (stat.Frames() == 0)
+	        continue;
+	    std::vector<double> means, devs;
+	    stat.SetThreads(threads);
+	    stat.Result(means, devs);
+	    std::cout << means[0] << " " << devs[0] << " " << time << " (" << stat.Frames() << " frames)" << std::endl;
+	    for (int i = 0; i < cols; i++)
 	    {
-	        for (int j = 0; j < 2712; j++)
+	        for (int j = 0; j < rows; j++)
 	        {
 		        row = j;
 		        col = i;
-		        mean = means.at(3388*j + i);
-		        dev = devs.at(3388*j + i);
+		        mean = means[(size_t)cols*j + i];
+		        dev = devs[(size_t)cols*j + i];
 		        tree->Fill();
 	        }
 	    }
 	}
 	tree->Write();
+	printf("Tree written in %.2f s\n", std::chrono::duration<double>(std::chrono::steady_clock::now() - writeBegin).count());
     }
 }
+
+// Size and write/read time of the float32 planes against the per-pixel TTree on synthetic results
+void compare_stat_output(int exposures = 3, int cols = 3388, int rows = 2712)
+{
+	size_t pixels = (size_t)cols * rows;
+	std::vector<float> means(pixels), devs(pixels);
+	for (size_t i = 0; i < pixels; i++)
+	{
+	    means[i] = 1000 + i % 977 * 0.1;
+	    devs[i] = 5 + i % 13 * 0.01;
+	}
+	auto seconds = [](std::chrono::steady_clock::time_point begin) {
+	    return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	};
+
+	auto begin = std::chrono::steady_clock::now();
+	{
+	    TFile file("compare.root", "RECREATE");
+	    TTree tree("tree", "tree");
+	    int col, row;
+	    double mean, dev, time;
+	    tree.Branch("col", &col);
+	    tree.Branch("row", &row);
+	    tree.Branch("mean", &mean);
+	    tree.Branch("dev", &dev);
+	    tree.Branch("time", &time);
+	    for (int e = 0; e < exposures; e++)
+	    {
+	        time = e + 1;
+	        for (int j = 0; j < rows; j++)
+	            for (int i = 0; i < cols; i++)
+	            {
+	                col = i;
+	                row = j;
+	                mean = means[(size_t)cols*j + i];
+	                dev = devs[(size_t)cols*j + i];
+	                tree.Fill();
+	            }
+	    }
+	    tree.Write();
+	}
+	double treeWrite = seconds(begin);
+
+	begin = std::chrono::steady_clock::now();
+	{
+	    StatPlanesWriter writer;
+	    writer.Open("compare.planes");
+	    for (int e = 0; e < exposures; e++)
+	        writer.Add(e + 1, cols, rows, 1, means.data(), devs.data());
+	    writer.Close();
+	}
+	double planesWrite = seconds(begin);
+
+	// read everything back, the sum keeps the reads from being optimised out
+	double treeSum = 0, planesSum = 0;
+	begin = std::chrono::steady_clock::now();
+	Long64_t treeSize;
+	{
+	    TFile file("compare.root");
+	    TTree* tree = (TTree*)file.Get("tree");
+	    double mean;
+	    tree->SetBranchAddress("mean", &mean);
+	    for (Long64_t n = 0; n < tree->GetEntries(); n++)
+	    {
+	        tree->GetEntry(n);
+	        treeSum += mean;
+	    }
+	    treeSize = file.GetSize();
+	}
+	double treeRead = seconds(begin);
+
+	begin = std::chrono::steady_clock::now();
+	StatPlanes planes("compare.planes");
+	for (size_t k = 0; k < planes.Count(); k++)
+	{
+	    const float* mean = planes.Mean(k);
+	    for (size_t i = 0; mean && i < pixels; i++)
+	        planesSum += mean[i];
+	}
+	double planesRead = seconds(begin);
+
+	printf("TTree:  %.1f MB, write %.2f s, read %.2f s\n", treeSize / 1e6, treeWrite, treeRead);
+	printf("planes: %.1f MB, write %.2f s, read %.2f s\n", planes.FileSize() / 1e6, planesWrite, planesRead);
+	printf("mean sums %.6g %.6g\n", treeSum, planesSum);
+}
@@ -10,11 +10,20 @@
 #include "app.h"
 
 #include "queue.h"
+#include "latency.h"
+#include "commands.h"
+#include "imagestat.h"
+#include "tiffwriter.h"
 // --- Config ---
 #define SECRET_WS_KEY "kdow04sd3"
 #define STATUS_SEND_INTERVAL 10
 #define RECONNECT_INTERVAL   10
 #define MAX_RECONN_ATTEMPTS  -1      // -1 = infinity, 0 = do not reconnect
+#define MAX_FRAGMENT_SIZE    65536   // bigger messages go out in several writable callbacks
+#define BATCH_MAX_BYTES      16384   // --batch: text messages go out together as one JSON array of up to
+#define BATCH_MAX_DELAY_MS   20      // this size, waiting at most this long for more messages
+
+_Static_assert(QUEUE_HEADROOM >= LWS_PRE, "queue items must reserve LWS_PRE bytes");
 
 // --- Global ---
 static struct lws_context_creation_info Info;
@@ -23,12 +32,40 @@ static struct lws_client_connect_info Connect_info;
 static struct lws *Client_wsi = NULL;
 
 static int reconnect_attempts = 0;
+static msg_queue_item_t *Sending = NULL;   // message whose fragments are being sent
+static uint64_t Sending_start = 0;         // LATENCY_Now() when its first fragment went out
 static struct lws_sorted_usec_list sul_reconnect;
 
+static int batch_enabled = 0;
+static size_t batch_max_bytes = BATCH_MAX_BYTES;
+static int batch_max_delay_ms = BATCH_MAX_DELAY_MS;
+static msg_queue_item_t *Batch_first = NULL;  // popped text messages waiting to go out in one frame
+static msg_queue_item_t *Batch_last = NULL;
+static size_t Batch_count = 0;
+static size_t Batch_bytes = 0;               // payloads and one separator each
+static msg_queue_item_t *Held = NULL;        // popped message which does not fit into the batch, goes next
+static msg_queue_item_t *Handshake = NULL;   // key message, goes first and alone on a new connection
+static struct lws_sorted_usec_list sul_batch;
+
+/* Traffic since the last report */
+static struct {
+    uint64_t since_ns;
+    unsigned long frames;
+    unsigned long messages;                  // queue messages, several in a batch frame
+    uint64_t payload;
+    uint64_t wire;                           // with websocket frame headers
+    uint64_t wire_unbatched;                 // the same messages one frame each
+} Tx;
+static unsigned long Sending_messages = 0;   // queue messages in Sending
+static msg_queue_item_t *Sending_parts = NULL; // messages joined into the Sending batch, freed once it is sent
+static uint64_t Sending_unbatched = 0;
+
 /* declaration */
 static int connect_to_server(struct lws **wsi);
 static void schedule_reconnect(void);
 static void sul_reconnect_cb(struct lws_sorted_usec_list *sul);
+static void wake_service(void);
+static void sul_batch_cb(struct lws_sorted_usec_list *sul);
 
 /** Callback for WebSocket **/
 static int callback_client(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
@@ -79,6 +116,222 @@ static void sul_reconnect_cb(struct lws_sorted_usec_list *sul)
     }
 }
 
+/**
+ * @brief Called by the queue from any thread after a new message, lws_cancel_service is the only
+ * thread-safe lws call and makes the service loop get LWS_CALLBACK_EVENT_WAIT_CANCELLED
+ */
+static void wake_service(void)
+{
+    if (Context) {
+        lws_cancel_service(Context);
+    }
+}
+
+/**
+ * @brief Bytes on the wire of a message sent in MAX_FRAGMENT_SIZE frames. Client frames are masked
+ * (4 bytes), the length takes 0, 2 or 8 more bytes
+ */
+static uint64_t wire_bytes(size_t len)
+{
+    uint64_t bytes = 0;
+    do {
+        size_t chunk = len > MAX_FRAGMENT_SIZE ? MAX_FRAGMENT_SIZE : len;
+        bytes += chunk + 2 + 4 + (chunk > 65535 ? 8 : chunk > 125 ? 2 : 0);
+        len -= chunk;
+    } while (len > 0);
+    return bytes;
+}
+
+static msg_queue_item_t *send_alone(msg_queue_item_t *item)
+{
+    if (item) {
+        Sending_messages = 1;
+        Sending_unbatched = wire_bytes(item->len);
+    }
+    return item;
+}
+
+/**
+ * @brief Join the batch into one "[msg,msg,...]" text message, a single message is sent as it is
+ */
+static msg_queue_item_t *flush_batch(void)
+{
+    msg_queue_item_t *batch = Batch_count > 1 ? QUEUE_AllocText(Batch_bytes + 1) : NULL;
+    if (NULL == batch) {
+        /* one message, or no memory for the array - send them one by one */
+        batch = Batch_first;
+        Batch_first = batch->next;
+        if (NULL == Batch_first) {
+            Batch_last = NULL;
+        }
+        Batch_count--;
+        Batch_bytes -= batch->len + 1;
+        return send_alone(batch);
+    }
+
+    Sending_messages = Batch_count;
+    Sending_unbatched = 0;
+    batch->queued_ns = Batch_first->queued_ns;
+    unsigned char *out = batch->payload;
+    *out++ = '[';
+    msg_queue_item_t *item = Batch_first;
+    while (item) {
+        msg_queue_item_t *next = item->next;
+        memcpy(out, item->payload, item->len);
+        out += item->len;
+        *out++ = next ? ',' : ']';
+        Sending_unbatched += wire_bytes(item->len);
+        item = next;
+    }
+    Sending_parts = Batch_first;
+    Batch_first = Batch_last = NULL;
+    Batch_count = 0;
+    Batch_bytes = 0;
+    return batch;
+}
+
+/**
+ * @brief Next message to send. With --batch text messages are collected until a binary or a too big one
+ * comes, the batch is full or the oldest has waited BATCH_MAX_DELAY_MS
+ * @return NULL if there is nothing to send now
+ */
+static msg_queue_item_t *next_message(void)
+{
+    if (Handshake) {
+        msg_queue_item_t *key = Handshake;
+        Handshake = NULL;
+        return send_alone(key);
+    }
+    if (!batch_enabled) {
+        return send_alone(QUEUE_PopItem());
+    }
+
+    msg_queue_item_t *item;
+    while (NULL == Held && (item = QUEUE_PopItem()) != NULL) {
+        if (item->type != MSG_TYPE_TEXT || Batch_bytes + item->len + 1 >= batch_max_bytes) {
+            Held = item;
+            break;
+        }
+        item->next = NULL;
+        if (Batch_last) {
+            Batch_last->next = item;
+        } else {
+            Batch_first = item;
+        }
+        Batch_last = item;
+        Batch_count++;
+        Batch_bytes += item->len + 1;
+    }
+
+    if (0 == Batch_count) {
+        item = Held;
+        Held = NULL;
+        return send_alone(item);
+    }
+
+    /* nothing pushes the batch out yet, wait for more messages until the oldest is due */
+    uint64_t age_ns = LATENCY_Now() - Batch_first->queued_ns;
+    uint64_t delay_ns = (uint64_t)batch_max_delay_ms * 1000000;
+    if (NULL == Held && age_ns < delay_ns) {
+        lws_sul_schedule(Context, 0, &sul_batch, sul_batch_cb, (lws_usec_t)((delay_ns - age_ns) / 1000 + 1));
+        return NULL;
+    }
+    return flush_batch();
+}
+
+/**
+ * @brief Free a list of messages linked by next
+ */
+static void free_list(msg_queue_item_t *item)
+{
+    while (item) {
+        msg_queue_item_t *next = item->next;
+        QUEUE_FreeItem(item);
+        item = next;
+    }
+}
+
+/**
+ * @brief Answers go out on the next connection, in front of their lane. Telemetry and bulk are dropped
+ */
+static void keep_or_drop(msg_queue_item_t *item)
+{
+    while (item) {
+        msg_queue_item_t *next = item->next;
+        if (QUEUE_LANE_CONTROL == item->lane) {
+            QUEUE_Requeue(item);
+        } else {
+            QUEUE_DropItem(item);
+        }
+        item = next;
+    }
+}
+
+/**
+ * @brief Messages which were not sent can not go out on this connection any more. Oldest first, so the
+ * answers put back keep their order
+ */
+static void drop_unsent(void)
+{
+    /* Sending has been given to lws_write, which masks the payload in place and writes fragment headers
+     * over the sent part, so it can not go out again. The parts of a batch were only copied from */
+    if (Sending_parts) {
+        keep_or_drop(Sending_parts);
+        QUEUE_FreeItem(Sending);
+    } else {
+        QUEUE_DropItem(Sending);
+    }
+    Sending = NULL;
+    Sending_parts = NULL;
+    keep_or_drop(Batch_first);
+    Batch_first = Batch_last = NULL;
+    Batch_count = 0;
+    Batch_bytes = 0;
+    if (Held) {
+        Held->next = NULL;
+        keep_or_drop(Held);
+        Held = NULL;
+    }
+    QUEUE_FreeItem(Handshake);
+    Handshake = NULL;
+}
+
+/**
+ * @brief Batch delay is over
+ */
+static void sul_batch_cb(struct lws_sorted_usec_list *sul)
+{
+    if (Client_wsi) {
+        lws_callback_on_writable(Client_wsi);
+    }
+}
+
+/**
+ * @brief Print frames and bytes sent since the last report and the queue lanes which are not empty or dropped
+ */
+static void report_traffic(void)
+{
+    uint64_t now = LATENCY_Now();
+    if (Tx.frames > 0 && Tx.since_ns > 0) {
+        double sec = (now - Tx.since_ns) / 1E9;
+        printf("Websocket: %lu messages in %lu frames (%.2f frames/s), %llu payload bytes, %llu on the wire, "
+               "%llu unbatched%s\n", Tx.messages, Tx.frames, Tx.frames / sec, (unsigned long long)Tx.payload,
+               (unsigned long long)Tx.wire, (unsigned long long)Tx.wire_unbatched, batch_enabled ? "" : " (off)");
+    }
+    memset(&Tx, 0, sizeof(Tx));
+    Tx.since_ns = now;
+
+    for (int i = 0; i < QUEUE_LANE_COUNT; i++) {
+        queue_lane_stats_t stats;
+        QUEUE_GetStats((queue_lane_t)i, &stats);
+        if (stats.items > 0 || stats.dropped > 0 || stats.over_budget > 0) {
+            printf("Queue %s: %zu messages, %zu of %zu bytes, %lu dropped, %lu over budget\n",
+                   QUEUE_LaneName((queue_lane_t)i), stats.items, stats.bytes, stats.budget, stats.dropped,
+                   stats.over_budget);
+        }
+    }
+}
+
 static struct lws_protocols protocols[] = {
     {
         .name = "camera-control",
@@ -99,10 +352,18 @@ static int callback_client(struct lws *wsi, enum lws_callback_reasons reason, vo
         case LWS_CALLBACK_CLIENT_ESTABLISHED:
             lwsl_info("Success! Connected to server!\n");
             lws_set_timer_usecs(wsi, STATUS_SEND_INTERVAL * LWS_USEC_PER_SEC);
+            report_traffic();
 
+            /* not queued, the server takes the first message as the key and older answers may be waiting */
             char *json = NULL;
             asprintf(&json, "{\"type\": \"onconnection\", \"key\": \"%s\"}", SECRET_WS_KEY);
-            QUEUE_NewMsg(json);
+            if (json) {
+                QUEUE_FreeItem(Handshake);
+                Handshake = QUEUE_AllocText(strlen(json));
+                if (Handshake) {
+                    memcpy(Handshake->payload, json, Handshake->len);
+                }
+            }
             free(json);
             lws_callback_on_writable(wsi);
             break;
@@ -115,38 +376,60 @@ static int callback_client(struct lws *wsi, enum lws_callback_reasons reason, vo
             break;
 
         case LWS_CALLBACK_CLIENT_WRITEABLE:
-            ; // this is not useless. If you remove it code will not be compiled. I don't like it too.
-            msg_queue_item_t *ItemToSend = QUEUE_PopItem();
-            if (NULL == ItemToSend) {
-                break;
+            if (NULL == Sending) {
+                Sending = next_message();
+                if (NULL == Sending) {
+                    break;
+                }
+                Sending_start = LATENCY_Now();
             }
 
-            /* Unfortunately libwebsocket has a disadvantage - it can not send several messages. This lib
-            * would not handle different messages, it just collect it in one buffer so we should do the way it is done here */
-            unsigned char *buf = malloc(LWS_PRE + ItemToSend->len);
-            if (buf) {
-                memcpy(buf + LWS_PRE, ItemToSend->payload, ItemToSend->len);
-                int n = lws_write(wsi, buf + LWS_PRE, ItemToSend->len,
-                ItemToSend->type == MSG_TYPE_BINARY ? LWS_WRITE_BINARY : LWS_WRITE_TEXT);
-                free(buf);
-
-                if (n < 0) {
-                    lwsl_err("Write failed\n");
-                    // Not sure what t do
-                }
+            /* Payload is sent straight from the queue item, LWS_PRE bytes in front of it are either the
+             * item headroom or the part of the payload which is already sent. Big messages are split in
+             * fragments, one per callback, so the service loop is never stuck in a long write */
+            size_t left = Sending->len - Sending->sent;
+            size_t chunk = left > MAX_FRAGMENT_SIZE ? MAX_FRAGMENT_SIZE : left;
+            int flags = lws_write_ws_flags(Sending->type == MSG_TYPE_BINARY ? LWS_WRITE_BINARY : LWS_WRITE_TEXT,
+                                           Sending->sent == 0, chunk == left);
+
+            int n = lws_write(wsi, Sending->payload + Sending->sent, chunk, (enum lws_write_protocol)flags);
+            if (n < 0) {
+                lwsl_err("Write failed\n");
+                drop_unsent();
+                return -1;
             }
 
-            free(ItemToSend->payload);
-            free(ItemToSend);
+            Tx.frames++;
+            Tx.payload += chunk;
+            Tx.wire += wire_bytes(chunk);
+            Sending->sent += chunk;
+            if (Sending->sent == Sending->len) {
+                LATENCY_Record(LAT_WS_SEND, LATENCY_Now() - Sending_start);
+                Tx.messages += Sending_messages;
+                Tx.wire_unbatched += Sending_unbatched;
+                QUEUE_FreeItem(Sending);
+                Sending = NULL;
+                free_list(Sending_parts);
+                Sending_parts = NULL;
+            }
 
             /* calls it again until messages are over */
             lws_callback_on_writable(wsi);
             break;
 
+        case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+            /* messages were added by another thread, keep bulk within its budget even while disconnected */
+            QUEUE_Trim();
+            if (Client_wsi) {
+                lws_callback_on_writable(Client_wsi);
+            }
+            break;
+
         case LWS_CALLBACK_TIMER:
             lwsl_info("Timer fired - sending status...\n");
 
             get_camera_status(); // goes to queue
+            report_traffic();
 
             lws_set_timer_usecs(wsi, STATUS_SEND_INTERVAL * LWS_USEC_PER_SEC);
             lws_callback_on_writable(wsi);
@@ -164,6 +447,11 @@ static int callback_client(struct lws *wsi, enum lws_callback_reasons reason, vo
 
         case LWS_CALLBACK_WSI_DESTROY:
             lwsl_info("WebSocket WSI destroyed\n");
+            if (wsi == Client_wsi) {
+                Client_wsi = NULL;
+                /* the rest of a fragmented message can not go to a new connection, an answer is sent again */
+                drop_unsent();
+            }
             schedule_reconnect();
             break;
 
@@ -179,7 +467,48 @@ static void sigint_handler(int sig) {
     force_exit = 1;
 }
 
-int main(void) {
+int main(int argc, char **argv) {
+    /* --bench [frames] [exposure ms]: time a photo series without the server */
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        int frames = argc > 2 ? atoi(argv[2]) : 20;
+        double exposure_ms = argc > 3 ? atof(argv[3]) : 100;
+        return run_benchmark(frames, exposure_ms);
+    }
+    /* --bench-commands [iterations]: command parser fuzz and throughput */
+    if (argc > 1 && strcmp(argv[1], "--bench-commands") == 0) {
+        return COMMANDS_Bench(argc > 2 ? atol(argv[2]) : 1000000);
+    }
+    /* --bench-stats [cols] [rows] [iterations]: display statistics against the former double loops */
+    if (argc > 1 && strcmp(argv[1], "--bench-stats") == 0) {
+        return IMAGESTAT_Bench(argc > 2 ? atoi(argv[2]) : 4096, argc > 3 ? atoi(argv[3]) : 4096,
+                               argc > 4 ? atoi(argv[4]) : 10);
+    }
+    /* --bench-tiff [cols] [rows] [iterations]: TIFF writing against the former one-row scanline layout */
+    if (argc > 1 && strcmp(argv[1], "--bench-tiff") == 0) {
+        return TIFFWRITER_Bench("bench", argc > 2 ? atoi(argv[2]) : 3326, argc > 3 ? atoi(argv[3]) : 2504,
+                                argc > 4 ? atoi(argv[4]) : 5);
+    }
+    /* --bench-queue [producers] [messages each]: lane order and balance under concurrent pushes, ops/s */
+    if (argc > 1 && strcmp(argv[1], "--bench-queue") == 0) {
+        return QUEUE_Bench(argc > 2 ? atoi(argv[2]) : 4, argc > 3 ? atol(argv[3]) : 1000000);
+    }
+
+    /* --batch [max bytes] [max delay ms]: text messages as JSON arrays, the server has to accept them */
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0) {
+        batch_enabled = 1;
+        if (argc > 2) {
+            batch_max_bytes = (size_t)atol(argv[2]);
+        }
+        if (argc > 3) {
+            batch_max_delay_ms = atoi(argv[3]);
+        }
+        /* one frame per batch */
+        if (batch_max_bytes < 2 || batch_max_bytes > MAX_FRAGMENT_SIZE) {
+            batch_max_bytes = BATCH_MAX_BYTES;
+        }
+        printf("Batching text messages up to %zu bytes and %d ms\n", batch_max_bytes, batch_max_delay_ms);
+    }
+
     signal(SIGINT, sigint_handler);
 
     //lws_set_log_level(LLL_ERR | LLL_WARN | LLL_NOTICE | LLL_INFO, NULL);
@@ -196,6 +525,8 @@ int main(void) {
         fprintf(stderr, "Error creating websocket context!\n");
         return -1;
     }
+    QUEUE_SetNotify(wake_service);
+
     const char *server_ip = "45.151.62.161"; // "localhost";
     const int port = 80;
     const char *path = "/ws/raspberry";
@@ -0,0 +1,189 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+/** Bounded processing stage: a queue of jobs served by its own thread(s). Push blocks while
+ * the queue is full, so a slow stage holds back the producer instead of eating memory.
+ * ParallelFor spreads independent pieces of one frame (bands, strips, tiles) over the cores
+ **/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Runs job(i) for i in [0, count) on up to threads threads (0 - all cores), the caller is one of them */
+template <typename Job>
+inline void ParallelFor(int count, int threads, Job job)
+{
+    if (threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(threads, count);
+
+    std::atomic<int> next(0);
+    auto loop = [&]() {
+        for (int i = next++; i < count; i = next++)
+            job(i);
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads; i++)
+        workers.emplace_back(loop);
+    loop();
+    for (auto& worker : workers)
+        worker.join();
+}
+
+template <typename Job>
+class BoundedStage {
+    typedef std::chrono::steady_clock clock;
+
+public:
+    struct Stats {
+        size_t pushed = 0;
+        size_t processed = 0;
+        size_t depth = 0;
+        size_t maxDepth = 0;
+        double blockedSec = 0;   // producer time spent waiting for a free slot
+        double waitSec = 0;      // job time spent in the queue
+        double busySec = 0;      // handler time
+    };
+
+    /* handler gets the job and the time it spent in the queue */
+    typedef std::function<void(Job&, double)> handler_t;
+
+    BoundedStage() = default;
+    BoundedStage(const BoundedStage&) = delete;
+    BoundedStage& operator=(const BoundedStage&) = delete;
+    ~BoundedStage() { Stop(); }
+
+    void Start(size_t depth, int threads, handler_t handler)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_threads.empty())
+            return;
+        m_depth = depth ? depth : 1;
+        m_handler = std::move(handler);
+        m_stop = false;
+        for (int i = 0; i < (threads > 0 ? threads : 1); i++)
+            m_threads.emplace_back(&BoundedStage::loop, this);
+    }
+
+    /* Finishes the queued jobs and joins the threads */
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_notEmpty.notify_all();
+        m_notFull.notify_all();
+        for (auto& thread : m_threads)
+            if (thread.joinable())
+                thread.join();
+        m_threads.clear();
+    }
+
+    bool Running()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return !m_threads.empty() && !m_stop;
+    }
+
+    /**
+     * @brief enqueue a job, blocks while the queue is full
+     * @return false if the stage is not running, the job is left untouched then
+     */
+    bool Push(Job& job)
+    {
+        clock::time_point begin = clock::now();
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_notFull.wait(lock, [this](){ return m_queue.size() < m_depth || m_stop; });
+        if (m_stop || m_threads.empty())
+            return false;
+
+        clock::time_point now = clock::now();
+        m_stats.blockedSec += std::chrono::duration<double>(now - begin).count();
+        m_queue.push_back({std::move(job), now});
+        m_stats.pushed++;
+        if (m_queue.size() > m_stats.maxDepth)
+            m_stats.maxDepth = m_queue.size();
+        lock.unlock();
+
+        m_notEmpty.notify_one();
+        return true;
+    }
+
+    /* Like Push but never blocks, false if the queue is full too */
+    bool TryPush(Job& job)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_stop || m_threads.empty() || m_queue.size() >= m_depth)
+            return false;
+
+        m_queue.push_back({std::move(job), clock::now()});
+        m_stats.pushed++;
+        if (m_queue.size() > m_stats.maxDepth)
+            m_stats.maxDepth = m_queue.size();
+        lock.unlock();
+
+        m_notEmpty.notify_one();
+        return true;
+    }
+
+    Stats GetStats()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Stats stats = m_stats;
+        stats.depth = m_queue.size();
+        return stats;
+    }
+
+private:
+    struct Entry {
+        Job job;
+        clock::time_point pushTime;
+    };
+
+    std::mutex m_mutex;
+    std::condition_variable m_notEmpty, m_notFull;
+    std::deque<Entry> m_queue;
+    std::vector<std::thread> m_threads;
+    handler_t m_handler;
+    size_t m_depth = 1;
+    bool m_stop = false;
+    Stats m_stats;
+
+    void loop()
+    {
+        while (true)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_notEmpty.wait(lock, [this](){ return !m_queue.empty() || m_stop; });
+            if (m_queue.empty())
+                return;     // stopped and drained
+
+            Entry entry = std::move(m_queue.front());
+            m_queue.pop_front();
+            lock.unlock();
+            m_notFull.notify_one();
+
+            clock::time_point begin = clock::now();
+            double waitSec = std::chrono::duration<double>(begin - entry.pushTime).count();
+            m_handler(entry.job, waitSec);
+            double busySec = std::chrono::duration<double>(clock::now() - begin).count();
+
+            lock.lock();
+            m_stats.processed++;
+            m_stats.waitSec += waitSec;
+            m_stats.busySec += busySec;
+        }
+    }
+};
+
+#endif //PIPELINE_H
@@ -0,0 +1,124 @@
+#ifndef PIXELSTAT_H
+#define PIXELSTAT_H
+
+/** Per-pixel mean and standard deviation over a series of frames, fed one frame at a time.
+ * Every pixel keeps an integer sum and sum of squares, which are exact for 16-bit values,
+ * so the memory does not grow with the number of frames and there is no cancellation.
+ * The pixels are cut into tiles whose sums fit in L2 and the tiles are spread over the cores;
+ * a batch of frames is summed tile by tile so every tile is loaded once per batch.
+ * Header-only so the ROOT macros can include it directly.
+ **/
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "pipeline.h"
+
+// 16K pixels per tile: 256 KB of sums plus the frame slices
+const size_t PIXELSTAT_TILE = 16384;
+
+class PixelStat {
+    int m_threads = 0;
+    size_t m_frames = 0;
+    std::vector<uint64_t> m_sum;
+    std::vector<uint64_t> m_sumSquares;
+
+public:
+    PixelStat() = default;
+
+    void Reset()
+    {
+        m_frames = 0;
+        m_sum.clear();
+        m_sumSquares.clear();
+    }
+
+    /* 0 - all cores */
+    void SetThreads(int threads) { m_threads = threads; }
+
+    /**
+     * @brief add frames of 16-bit values, the first frame sets the number of pixels
+     * @param frames: n pointers to count pixels each
+     * @return false if count differs from the previous frames, the frames are skipped then
+     */
+    template <typename T>
+    bool AddFrames(const T* const* frames, size_t n, size_t count)
+    {
+        if (m_frames == 0)
+        {
+            m_sum.assign(count, 0);
+            m_sumSquares.assign(count, 0);
+        }
+        else if (count != m_sum.size())
+            return false;
+
+        int tiles = (count + PIXELSTAT_TILE - 1) / PIXELSTAT_TILE;
+        ParallelFor(tiles, m_threads, [&](int tile) {
+            size_t begin = tile * PIXELSTAT_TILE;
+            size_t end = std::min(count, begin + PIXELSTAT_TILE);
+            uint64_t* sum = m_sum.data();
+            uint64_t* sumSquares = m_sumSquares.data();
+            for (size_t f = 0; f < n; f++)
+            {
+                const T* frame = frames[f];
+                for (size_t i = begin; i < end; i++)
+                {
+                    uint64_t value = (uint16_t)frame[i];
+                    sum[i] += value;
+                    sumSquares[i] += value * value;
+                }
+            }
+        });
+        m_frames += n;
+        return true;
+    }
+
+    template <typename T>
+    bool Add(const T* frame, size_t count)
+    {
+        return AddFrames(&frame, 1, count);
+    }
+
+    size_t Frames() const { return m_frames; }
+    size_t Pixels() const { return m_sum.size(); }
+
+    double Mean(size_t i) const
+    {
+        return m_frames ? (double)m_sum[i] / m_frames : 0;
+    }
+
+    /* population standard deviation (n), n * sum(x^2) - sum(x)^2 is computed exactly */
+    double Dev(size_t i) const
+    {
+        if (m_frames == 0)
+            return 0;
+        unsigned __int128 n = m_frames;
+        unsigned __int128 sum = m_sum[i];
+        unsigned __int128 spread = n * m_sumSquares[i] - sum * sum;
+        return std::sqrt((double)spread) / m_frames;
+    }
+
+    /* T - double, or float for the output planes */
+    template <typename T>
+    void Result(std::vector<T>& means, std::vector<T>& devs) const
+    {
+        size_t count = Pixels();
+        means.resize(count);
+        devs.resize(count);
+        int tiles = (count + PIXELSTAT_TILE - 1) / PIXELSTAT_TILE;
+        ParallelFor(tiles, m_threads, [&](int tile) {
+            size_t begin = tile * PIXELSTAT_TILE;
+            size_t end = std::min(count, begin + PIXELSTAT_TILE);
+            for (size_t i = begin; i < end; i++)
+            {
+                means[i] = Mean(i);
+                devs[i] = Dev(i);
+            }
+        });
+    }
+};
+
+#endif //PIXELSTAT_H
@@ -0,0 +1,144 @@
+// Project headers
+#include "preview.h"
+#include "imagestat.h"
+#include "queue.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <zlib.h>
+
+static const unsigned char PNG_SIGNATURE[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+// chunk length, type and crc
+static const size_t PNG_CHUNK_OVERHEAD = 12;
+static const size_t PNG_IHDR_SIZE = 13;
+
+/* Adds row to the column sums, a plain loop over contiguous data which the compiler vectorizes */
+__attribute__((optimize("tree-vectorize")))
+static void accumulateRow(const unsigned short* __restrict row, unsigned int* __restrict sums, int cols)
+{
+    for (int x = 0; x < cols; x++)
+        sums[x] += row[x];
+}
+
+static unsigned char* putBigEndian(unsigned char* out, unsigned int value)
+{
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+    return out + 4;
+}
+
+/* writes a chunk whose data is already at out + 8, returns the end of the chunk */
+static unsigned char* finishChunk(unsigned char* out, const char* type, size_t len)
+{
+    putBigEndian(out, len);
+    memcpy(out + 4, type, 4);
+    unsigned int crc = crc32(0, out + 4, len + 4);
+    return putBigEndian(out + 8 + len, crc);
+}
+
+void PreviewGenerator::Bin(const unsigned short* image, int cols, int rows, int bin, unsigned short* out)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    binImage(image, cols, rows, bin, out);
+}
+
+void PreviewGenerator::binImage(const unsigned short* image, int cols, int rows, int bin, unsigned short* out)
+{
+    int outCols = cols / bin;
+    int outRows = rows / bin;
+    unsigned int divisor = bin * bin;
+    m_rowSums.resize(cols);
+    unsigned int* sums = m_rowSums.data();
+
+    for (int r = 0; r < outRows; r++)
+    {
+        std::fill(sums, sums + cols, 0);
+        for (int k = 0; k < bin; k++)
+            accumulateRow(image + (size_t)(r * bin + k) * cols, sums, cols);
+
+        unsigned short* outRow = out + (size_t)r * outCols;
+        for (int c = 0; c < outCols; c++)
+        {
+            unsigned int sum = 0;
+            for (int k = 0; k < bin; k++)
+                sum += sums[c * bin + k];
+            outRow[c] = sum / divisor;
+        }
+    }
+}
+
+bool PreviewGenerator::Push(const unsigned short* image, int cols, int rows, int bin, PreviewStats& stats)
+{
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    if (bin < 1 || cols < bin || rows < bin)
+        return false;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    int width = cols / bin;
+    int height = rows / bin;
+    size_t count = (size_t)width * height;
+    m_binned.resize(count);
+    binImage(image, cols, rows, bin, m_binned.data());
+
+    // the same 3 sigma stretch as the TIFF display image
+    ImageStat stat = ComputeImageStat(m_binned.data(), count);
+    double minVal = std::max(0.0, stat.mean - stat.std * 3);
+    double maxVal = std::min(65535.0, stat.mean + stat.std * 3);
+    m_levels.resize(count);
+    StretchImage(m_binned.data(), count, minVal, maxVal, m_levels.data());
+
+    // PNG rows start with the filter type, "Sub" stores the difference to the left pixel
+    m_scanlines.resize((size_t)(width + 1) * height);
+    for (int y = 0; y < height; y++)
+    {
+        const unsigned char* src = m_levels.data() + (size_t)y * width;
+        unsigned char* dst = m_scanlines.data() + (size_t)y * (width + 1);
+        dst[0] = 1;
+        dst[1] = src[0];
+        for (int x = 1; x < width; x++)
+            dst[x + 1] = src[x] - src[x - 1];
+    }
+
+    uLongf idatSize = compressBound(m_scanlines.size());
+    size_t capacity = 4 + sizeof(PNG_SIGNATURE) + 3 * PNG_CHUNK_OVERHEAD + PNG_IHDR_SIZE + idatSize;
+    msg_queue_item_t* item = QUEUE_AllocBinary(capacity);
+    if (item == NULL)
+        return false;
+
+    unsigned char* out = item->payload;
+    memcpy(out, PREVIEW_MSG_TAG, 4);
+    out += 4;
+    memcpy(out, PNG_SIGNATURE, sizeof(PNG_SIGNATURE));
+    out += sizeof(PNG_SIGNATURE);
+
+    unsigned char* ihdr = out + 8;
+    putBigEndian(ihdr, width);
+    putBigEndian(ihdr + 4, height);
+    ihdr[8] = 8;     // bit depth
+    ihdr[9] = 0;     // grayscale
+    ihdr[10] = 0;    // deflate
+    ihdr[11] = 0;    // adaptive filtering
+    ihdr[12] = 0;    // no interlace
+    out = finishChunk(out, "IHDR", PNG_IHDR_SIZE);
+
+    if (compress2(out + 8, &idatSize, m_scanlines.data(), m_scanlines.size(), Z_BEST_SPEED) != Z_OK)
+    {
+        QUEUE_FreeItem(item);
+        return false;
+    }
+    out = finishChunk(out, "IDAT", idatSize);
+    out = finishChunk(out, "IEND", 0);
+
+    item->len = out - item->payload;
+    stats.width = width;
+    stats.height = height;
+    stats.bin = bin;
+    stats.bytes = item->len;
+    QUEUE_Push(item);
+
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    return true;
+}
@@ -0,0 +1,47 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+/** Small preview of a frame for the web UI: NxN binning, 3-sigma stretch to 8 bit and
+ * PNG encoding straight into a binary queue message
+ **/
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+/* Binary messages start with a 4 byte tag, the preview tag is followed by the PNG file */
+#define PREVIEW_MSG_TAG "PREV"
+
+struct PreviewStats {
+    int width = 0;
+    int height = 0;
+    int bin = 0;
+    size_t bytes = 0;     // message size
+    double seconds = 0;
+};
+
+class PreviewGenerator {
+public:
+    /**
+     * @brief average bin x bin blocks, incomplete blocks at the right and bottom edges are dropped
+     * @param out: (cols / bin) * (rows / bin) pixels
+     */
+    void Bin(const unsigned short* image, int cols, int rows, int bin, unsigned short* out);
+
+    /**
+     * @brief make the preview and add it to the client message queue
+     * @return false if the frame is smaller than one bin or there is no memory
+     */
+    bool Push(const unsigned short* image, int cols, int rows, int bin, PreviewStats& stats);
+
+private:
+    std::mutex m_mutex;
+    std::vector<unsigned int> m_rowSums;
+    std::vector<unsigned short> m_binned;
+    std::vector<unsigned char> m_levels;
+    std::vector<unsigned char> m_scanlines;
+
+    void binImage(const unsigned short* image, int cols, int rows, int bin, unsigned short* out);
+};
+
+#endif //PREVIEW_H
@@ -6,52 +6,421 @@
 /** This is file which gives an API for queue of messages (read header) **/
 #include <stdio.h>
 #include "queue.h"
+#include "latency.h"
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
-static msg_queue_item_t *QUEUE_Head = NULL;
+/* Default budgets: answers come one per command, telemetry is a single message, bulk holds a few
+ * full-size previews */
+#define CONTROL_BUDGET   (1u << 20)
+#define TELEMETRY_BUDGET (64u << 10)
+#define BULK_BUDGET      (32u << 20)
+/* --bench-queue: a few thousand bench messages */
+#define BENCH_BULK_BUDGET (16u << 10)
 
-void QUEUE_NewMsg(const char *text) {
+/* Intrusive multi-producer/single-consumer queue (D. Vyukov) per lane. Producers only swap the head pointer
+ * and link the previous head to the new item, so pushing is O(1) and never takes a lock. The only
+ * consumer walks from the tail. The stub item keeps the list non-empty, so head is never NULL.
+ * A latest-wins lane has no list, just one slot producers swap their message into */
+typedef struct {
+    msg_queue_item_t stub;
+    msg_queue_item_t *head;      /* last pushed item, producers */
+    msg_queue_item_t *tail;      /* next item to pop, consumer */
+    msg_queue_item_t *latest;    /* latest-wins slot */
+    msg_queue_item_t *front;     /* put back by QUEUE_Requeue, consumer only, goes before the rest */
+    msg_queue_item_t *front_last;
+    queue_policy_t policy;
+    size_t budget;
+    /* counters are atomic, items and bytes are added before the item is reachable and taken after */
+    size_t items;
+    size_t bytes;
+    unsigned long pushed;
+    unsigned long dropped;
+    unsigned long over_budget;
+} queue_lane_data_t;
+
+#define LANE(lane, lane_policy, lane_budget) \
+    [lane] = { .head = &QUEUE_Lanes[lane].stub, .tail = &QUEUE_Lanes[lane].stub, \
+               .policy = lane_policy, .budget = lane_budget }
+
+static queue_lane_data_t QUEUE_Lanes[QUEUE_LANE_COUNT] = {
+    LANE(QUEUE_LANE_CONTROL, QUEUE_NEVER_DROP, CONTROL_BUDGET),
+    LANE(QUEUE_LANE_TELEMETRY, QUEUE_LATEST_WINS, TELEMETRY_BUDGET),
+    LANE(QUEUE_LANE_BULK, QUEUE_DROP_OLDEST, BULK_BUDGET),
+};
+static const char *QUEUE_LaneNames[QUEUE_LANE_COUNT] = {"control", "telemetry", "bulk"};
+static queue_notify_t QUEUE_Notify = NULL;
+
+static void lane_push(queue_lane_data_t *lane, msg_queue_item_t *item) {
+    __atomic_store_n(&item->next, NULL, __ATOMIC_RELAXED);
+    msg_queue_item_t *prev = __atomic_exchange_n(&lane->head, item, __ATOMIC_ACQ_REL);
+    /* between the exchange and this store the item is not reachable by the consumer yet */
+    __atomic_store_n(&prev->next, item, __ATOMIC_RELEASE);
+}
+
+static msg_queue_item_t *lane_pop(queue_lane_data_t *lane) {
+    msg_queue_item_t *tail = lane->tail;
+    msg_queue_item_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &lane->stub) {
+        if (NULL == next) {
+            return NULL;
+        }
+        lane->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next) {
+        lane->tail = next;
+        return tail;
+    }
+
+    /* tail is the last linked item. If it is not the head, a producer is in the middle of a push
+     * and will notify when it is done */
+    if (tail != __atomic_load_n(&lane->head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    /* put the stub behind the last item so it can be taken out */
+    lane_push(lane, &lane->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        lane->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/* Oldest item of the lane, not counted out yet */
+static msg_queue_item_t *lane_take(queue_lane_data_t *lane) {
+    msg_queue_item_t *item = lane->front;
+    if (item) {
+        lane->front = item->next;
+        if (NULL == lane->front) {
+            lane->front_last = NULL;
+        }
+        return item;
+    }
+    return QUEUE_LATEST_WINS == lane->policy ? __atomic_exchange_n(&lane->latest, NULL, __ATOMIC_ACQ_REL)
+                                             : lane_pop(lane);
+}
+
+/* Counted item taken out of the lane */
+static void lane_taken(queue_lane_data_t *lane, msg_queue_item_t *item) {
+    __atomic_sub_fetch(&lane->items, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&lane->bytes, item->len, __ATOMIC_RELAXED);
+}
+
+static msg_queue_item_t *queue_alloc(message_type_t type, size_t len) {
+    /* extra byte keeps text payload zero-terminated */
+    msg_queue_item_t *item = malloc(sizeof(msg_queue_item_t) + QUEUE_HEADROOM + len + 1);
+
+    if (NULL == item) return NULL;
+
+    item->payload = (unsigned char *)(item + 1) + QUEUE_HEADROOM;
+    item->payload[len] = 0;
+    item->len = len;
+    item->sent = 0;
+    item->queued_ns = 0;
+    item->lane = QUEUE_LANE_COUNT;
+    item->type = type;
+    return item;
+}
+
+void QUEUE_PushLane(queue_lane_t lane_id, msg_queue_item_t *item) {
+    if (NULL == item) {
+        return;
+    }
+    queue_lane_data_t *lane = &QUEUE_Lanes[lane_id];
+    item->queued_ns = LATENCY_Now();
+    item->lane = lane_id;
+    __atomic_add_fetch(&lane->pushed, 1, __ATOMIC_RELAXED);
+
+    size_t budget = __atomic_load_n(&lane->budget, __ATOMIC_RELAXED);
+    if (QUEUE_LATEST_WINS == lane->policy) {
+        if (item->len > budget) {
+            __atomic_add_fetch(&lane->dropped, 1, __ATOMIC_RELAXED);
+            free(item);
+            return;
+        }
+        __atomic_add_fetch(&lane->items, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&lane->bytes, item->len, __ATOMIC_RELAXED);
+        msg_queue_item_t *old = __atomic_exchange_n(&lane->latest, item, __ATOMIC_ACQ_REL);
+        if (old) {
+            lane_taken(lane, old);
+            __atomic_add_fetch(&lane->dropped, 1, __ATOMIC_RELAXED);
+            free(old);
+        }
+    } else {
+        size_t bytes = __atomic_add_fetch(&lane->bytes, item->len, __ATOMIC_RELAXED);
+        if (QUEUE_NEVER_DROP == lane->policy && bytes > budget) {
+            __atomic_add_fetch(&lane->over_budget, 1, __ATOMIC_RELAXED);
+        }
+        __atomic_add_fetch(&lane->items, 1, __ATOMIC_RELAXED);
+        /* drop-oldest lanes are trimmed by the consumer, producers can not take items out */
+        lane_push(lane, item);
+    }
+
+    queue_notify_t notify = __atomic_load_n(&QUEUE_Notify, __ATOMIC_ACQUIRE);
+    if (notify) {
+        notify();
+    }
+}
+
+void QUEUE_Push(msg_queue_item_t *item) {
+    if (NULL == item) {
+        return;
+    }
+    QUEUE_PushLane(MSG_TYPE_TEXT == item->type ? QUEUE_LANE_CONTROL : QUEUE_LANE_BULK, item);
+}
+
+void QUEUE_NewMsgLane(queue_lane_t lane, const char *text) {
     if (NULL == text) {
         return;
     }
     size_t len = strlen(text);
-    msg_queue_item_t *item = malloc(sizeof(msg_queue_item_t));
+    msg_queue_item_t *item = queue_alloc(MSG_TYPE_TEXT, len);
+    if (NULL == item) return;
+
+    memcpy(item->payload, text, len);
+    QUEUE_PushLane(lane, item);
+}
+
+void QUEUE_NewMsg(const char *text) {
+    QUEUE_NewMsgLane(QUEUE_LANE_CONTROL, text);
+}
 
+void QUEUE_NewBinary(const unsigned char *data, size_t len) {
+    if (NULL == data || 0 == len) {
+        return;
+    }
+    msg_queue_item_t *item = queue_alloc(MSG_TYPE_BINARY, len);
     if (NULL == item) return;
 
-    item->payload = malloc(len + 1);
-    if (NULL == item->payload) {
-        free(item);
+    memcpy(item->payload, data, len);
+    QUEUE_Push(item);
+}
+
+msg_queue_item_t* QUEUE_AllocBinary(size_t len) {
+    return queue_alloc(MSG_TYPE_BINARY, len);
+}
+
+msg_queue_item_t* QUEUE_AllocText(size_t len) {
+    return queue_alloc(MSG_TYPE_TEXT, len);
+}
+
+void QUEUE_FreeItem(msg_queue_item_t *item) {
+    free(item);
+}
+
+void QUEUE_Trim(void) {
+    for (int i = 0; i < QUEUE_LANE_COUNT; i++) {
+        queue_lane_data_t *lane = &QUEUE_Lanes[i];
+        if (lane->policy != QUEUE_DROP_OLDEST) {
+            continue;
+        }
+        while (__atomic_load_n(&lane->bytes, __ATOMIC_RELAXED) > __atomic_load_n(&lane->budget, __ATOMIC_RELAXED)) {
+            msg_queue_item_t *item = lane_take(lane);
+            if (NULL == item) {
+                break;
+            }
+            lane_taken(lane, item);
+            __atomic_add_fetch(&lane->dropped, 1, __ATOMIC_RELAXED);
+            free(item);
+        }
+    }
+}
+
+msg_queue_item_t* QUEUE_PopItem() {
+    QUEUE_Trim();
+    for (int i = 0; i < QUEUE_LANE_COUNT; i++) {
+        queue_lane_data_t *lane = &QUEUE_Lanes[i];
+        msg_queue_item_t *item = lane_take(lane);
+        if (item) {
+            lane_taken(lane, item);
+            return item;
+        }
+    }
+    return NULL;
+}
+
+void QUEUE_Requeue(msg_queue_item_t *item) {
+    if (NULL == item || item->lane >= QUEUE_LANE_COUNT) {
+        QUEUE_FreeItem(item);
         return;
     }
-    memcpy(item->payload, text, len + 1);
-    item->len = len;
-    item->type = MSG_TYPE_TEXT;
+    queue_lane_data_t *lane = &QUEUE_Lanes[item->lane];
+    item->sent = 0;
     item->next = NULL;
-
-    if (NULL == QUEUE_Head) {
-        QUEUE_Head = item;
+    if (lane->front_last) {
+        lane->front_last->next = item;
     } else {
-        msg_queue_item_t *cur = QUEUE_Head;
-        while (cur->next) cur = cur->next;
-        cur->next = item;
+        lane->front = item;
+    }
+    lane->front_last = item;
+    __atomic_add_fetch(&lane->items, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&lane->bytes, item->len, __ATOMIC_RELAXED);
+}
+
+void QUEUE_DropItem(msg_queue_item_t *item) {
+    if (NULL == item) {
+        return;
     }
+    if (item->lane < QUEUE_LANE_COUNT) {
+        __atomic_add_fetch(&QUEUE_Lanes[item->lane].dropped, 1, __ATOMIC_RELAXED);
+    }
+    free(item);
+}
 
+void QUEUE_SetBudget(queue_lane_t lane, size_t bytes) {
+    __atomic_store_n(&QUEUE_Lanes[lane].budget, bytes, __ATOMIC_RELAXED);
 }
-void QUEUE_NewBinary(const unsigned char *data, size_t len);
 
-msg_queue_item_t* QUEUE_PopItem() {
-    msg_queue_item_t* item = QUEUE_Head;
-    if (item != NULL) {
-        QUEUE_Head = item->next;
+void QUEUE_GetStats(queue_lane_t lane_id, queue_lane_stats_t *stats) {
+    queue_lane_data_t *lane = &QUEUE_Lanes[lane_id];
+    stats->policy = lane->policy;
+    stats->budget = __atomic_load_n(&lane->budget, __ATOMIC_RELAXED);
+    stats->items = __atomic_load_n(&lane->items, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&lane->bytes, __ATOMIC_RELAXED);
+    stats->pushed = __atomic_load_n(&lane->pushed, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&lane->dropped, __ATOMIC_RELAXED);
+    stats->over_budget = __atomic_load_n(&lane->over_budget, __ATOMIC_RELAXED);
+}
+
+const char* QUEUE_LaneName(queue_lane_t lane) {
+    return QUEUE_LaneNames[lane];
+}
+
+int QUEUE_StatsJson(char *json, size_t size) {
+    int len = 0;
+    for (int i = 0; i < QUEUE_LANE_COUNT; i++) {
+        queue_lane_stats_t stats;
+        QUEUE_GetStats((queue_lane_t)i, &stats);
+        int room = (size_t)len < size;
+        len += snprintf(room ? json + len : NULL, room ? size - len : 0,
+                        "%s\"%s\":{\"items\":%zu,\"bytes\":%zu,\"budget\":%zu,\"pushed\":%lu,\"dropped\":%lu,\"over\":%lu}%s",
+                        i == 0 ? "{" : ",", QUEUE_LaneNames[i], stats.items, stats.bytes, stats.budget,
+                        stats.pushed, stats.dropped, stats.over_budget, i == QUEUE_LANE_COUNT - 1 ? "}" : "");
     }
-    return item;
+    return len;
 }
 
+void QUEUE_SetNotify(queue_notify_t notify) {
+    __atomic_store_n(&QUEUE_Notify, notify, __ATOMIC_RELEASE);
+}
 
+/* Bench message: producer and its sequence number over all lanes */
+typedef struct {
+    uint32_t producer;
+    uint32_t seq;
+} queue_bench_msg_t;
 
+typedef struct {
+    int producer;
+    long messages;
+    int *finished;
+} queue_bench_producer_t;
 
+static void *queue_bench_produce(void *arg) {
+    queue_bench_producer_t *producer = (queue_bench_producer_t *)arg;
+    for (long i = 0; i < producer->messages; i++) {
+        msg_queue_item_t *item = QUEUE_AllocBinary(sizeof(queue_bench_msg_t));
+        if (NULL == item) {
+            continue;
+        }
+        queue_bench_msg_t msg = {(uint32_t)producer->producer, (uint32_t)i};
+        memcpy(item->payload, &msg, sizeof(msg));
+        QUEUE_PushLane((queue_lane_t)(i % QUEUE_LANE_COUNT), item);
+    }
+    __atomic_add_fetch(producer->finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
 
+int QUEUE_Bench(int producers, long messages) {
+    if (producers < 1 || messages < 1) {
+        return 1;
+    }
+    queue_lane_stats_t before[QUEUE_LANE_COUNT];
+    for (int i = 0; i < QUEUE_LANE_COUNT; i++) {
+        QUEUE_GetStats((queue_lane_t)i, &before[i]);
+    }
+    /* last sequence number seen of every producer in every lane, -1 - none yet */
+    long *last = malloc(sizeof(long) * producers * QUEUE_LANE_COUNT);
+    pthread_t *threads = malloc(sizeof(pthread_t) * producers);
+    queue_bench_producer_t *args = malloc(sizeof(queue_bench_producer_t) * producers);
+    if (!last || !threads || !args) {
+        free(last);
+        free(threads);
+        free(args);
+        return 1;
+    }
+    for (int i = 0; i < producers * QUEUE_LANE_COUNT; i++) {
+        last[i] = -1;
+    }
+    /* a small bulk budget so the drop-oldest path runs too */
+    QUEUE_SetBudget(QUEUE_LANE_BULK, BENCH_BULK_BUDGET);
 
+    uint64_t begin = LATENCY_Now();
+    int started = 0;
+    int finished = 0;
+    for (; started < producers; started++) {
+        args[started].producer = started;
+        args[started].messages = messages;
+        args[started].finished = &finished;
+        if (pthread_create(&threads[started], NULL, queue_bench_produce, &args[started]) != 0) {
+            break;
+        }
+    }
+
+    unsigned long popped[QUEUE_LANE_COUNT] = {0};
+    unsigned long out_of_order = 0;
+    /* until the producers are done and every message is popped or dropped */
+    while (1) {
+        int done = __atomic_load_n(&finished, __ATOMIC_ACQUIRE) == started;
+        msg_queue_item_t *item = QUEUE_PopItem();
+        if (item) {
+            queue_bench_msg_t msg;
+            memcpy(&msg, item->payload, sizeof(msg));
+            long *seen = &last[msg.producer * QUEUE_LANE_COUNT + item->lane];
+            /* the never-drop lane gets every message of a producer, the others may skip dropped ones */
+            long next = *seen < 0 ? (long)item->lane : *seen + QUEUE_LANE_COUNT;
+            if (QUEUE_NEVER_DROP == QUEUE_Lanes[item->lane].policy ? (long)msg.seq != next : (long)msg.seq < next) {
+                out_of_order++;
+            }
+            *seen = msg.seq;
+            popped[item->lane]++;
+            QUEUE_FreeItem(item);
+        } else if (done) {
+            break;
+        }
+    }
+    double sec = (LATENCY_Now() - begin) * 1E-9;
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    QUEUE_SetBudget(QUEUE_LANE_BULK, before[QUEUE_LANE_BULK].budget);
+
+    int failures = started < producers || out_of_order > 0;
+    unsigned long total = 0;
+    for (int i = 0; i < QUEUE_LANE_COUNT; i++) {
+        queue_lane_stats_t stats;
+        QUEUE_GetStats((queue_lane_t)i, &stats);
+        unsigned long pushed = stats.pushed - before[i].pushed;
+        unsigned long dropped = stats.dropped - before[i].dropped;
+        int balanced = pushed == popped[i] + dropped && 0 == stats.items;
+        total += pushed;
+        printf("Queue %-9s pushed %lu, popped %lu, dropped %lu%s\n", QUEUE_LaneNames[i], pushed, popped[i], dropped,
+               balanced ? "" : ", NOT BALANCED");
+        failures += !balanced;
+    }
+    printf("Queue: %d producers, %lu messages in %.3f sec, %.2f M ops/s, %lu out of order\n", started, total, sec,
+           total / sec * 1E-6, out_of_order);
+
+    free(last);
+    free(threads);
+    free(args);
+    return failures ? 1 : 0;
+}
@@ -2,29 +2,127 @@
 #define QUEUE_H
 
 /** This is header for queue, which is really simply-designed in aims to avoid the situation then sending buffer is too big
- * for libwebsocket and some messages can be rewritten by others
+ * for libwebsocket and some messages can be rewritten by others.
+ * Any thread can add messages, only one thread (libwebsockets service loop) may pop them.
+ * Messages go in priority lanes with a byte budget and a drop policy each, so nothing piles up
+ * without a limit while the websocket is down
  **/
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Free bytes kept in front of every payload, libwebsockets needs LWS_PRE of them to write its frame
+ * header in place (checked in main.c) */
+#define QUEUE_HEADROOM 16
+
 /* Queue for messages */
 typedef enum {
     MSG_TYPE_TEXT,
     MSG_TYPE_BINARY
 } message_type_t;
 
+/* Lanes in the order they are popped */
+typedef enum {
+    QUEUE_LANE_CONTROL,          /* answers, never dropped */
+    QUEUE_LANE_TELEMETRY,        /* status, only the latest message is kept */
+    QUEUE_LANE_BULK,             /* previews and clusters, the oldest are dropped over the budget */
+    QUEUE_LANE_COUNT
+} queue_lane_t;
+
+/* Item and payload are one allocation: the struct, QUEUE_HEADROOM bytes, payload */
 typedef struct msg_queue_item {
     message_type_t type;
     unsigned char *payload;
     size_t len;
+    size_t sent;                 /* bytes already written, used by the sender for fragmented messages */
+    uint64_t queued_ns;          /* LATENCY_Now() when it was pushed */
+    queue_lane_t lane;           /* QUEUE_LANE_COUNT until it is pushed */
     struct msg_queue_item *next;
 } msg_queue_item_t;
 
+typedef enum {
+    QUEUE_NEVER_DROP,            /* over the budget is only counted */
+    QUEUE_LATEST_WINS,
+    QUEUE_DROP_OLDEST
+} queue_policy_t;
+
+typedef struct {
+    queue_policy_t policy;
+    size_t budget;               /* bytes */
+    size_t items;                /* waiting now */
+    size_t bytes;
+    unsigned long pushed;
+    unsigned long dropped;
+    unsigned long over_budget;   /* pushes which found a never-drop lane over its budget */
+} queue_lane_stats_t;
+
+typedef void (*queue_notify_t)(void);
+
+/* Both copy the data, safe to call from any thread. Text goes to the control lane, binary to bulk */
 void QUEUE_NewMsg(const char *text);
 void QUEUE_NewBinary(const unsigned char *data, size_t len);
+/* Text message to the given lane */
+void QUEUE_NewMsgLane(queue_lane_t lane, const char *text);
+
+/**
+ * @brief allocate a binary message to be filled in place and then added with QUEUE_Push (no copy)
+ * @return NULL if there is no memory
+ */
+msg_queue_item_t* QUEUE_AllocBinary(size_t len);
+/* Same for a text message, the payload is zero-terminated after len bytes */
+msg_queue_item_t* QUEUE_AllocText(size_t len);
+/* Text to the control lane, binary to bulk */
+void QUEUE_Push(msg_queue_item_t *item);
+void QUEUE_PushLane(queue_lane_t lane, msg_queue_item_t *item);
+
+/**
+ * @brief take the oldest message of the first lane which has one, only from the consumer thread.
+ * Caller frees it with QUEUE_FreeItem
+ * @return NULL if the queue is empty (or a concurrent add has not finished yet - it will notify)
+ */
 msg_queue_item_t* QUEUE_PopItem();
+void QUEUE_FreeItem(msg_queue_item_t *item);
+
+/**
+ * @brief drop the oldest messages of drop-oldest lanes over their budget, only from the consumer thread.
+ * PopItem does it too, call it on every wake up while nothing is sent (disconnected)
+ */
+void QUEUE_Trim(void);
+
+/**
+ * @brief put a popped message back in front of its lane, only from the consumer thread. Messages put back
+ * one after another keep their order and go before everything pushed. One never pushed is freed
+ */
+void QUEUE_Requeue(msg_queue_item_t *item);
+/* Free a popped message which will not be sent, counted as dropped in its lane */
+void QUEUE_DropItem(msg_queue_item_t *item);
+
+/* Any thread, takes effect from the next push (latest-wins) or trim (drop-oldest) */
+void QUEUE_SetBudget(queue_lane_t lane, size_t bytes);
+void QUEUE_GetStats(queue_lane_t lane, queue_lane_stats_t *stats);
+const char* QUEUE_LaneName(queue_lane_t lane);
+/**
+ * @brief {"control":{"items":..,"bytes":..,"budget":..,"pushed":..,"dropped":..,"over":..},...}
+ * @return length as snprintf
+ */
+int QUEUE_StatsJson(char *json, size_t size);
+
+/**
+ * @brief producers threads push messages to all lanes while this thread pops them, see --bench-queue.
+ * Checks that every producer's messages come out of each lane in order and that pushed = popped + dropped
+ * in every lane. Only while nothing else uses the queue
+ * @return 0 - no invariant broken
+ */
+int QUEUE_Bench(int producers, long messages);
+
+/**
+ * @brief set function called after every added message, e.g. to wake up the consumer thread
+ */
+void QUEUE_SetNotify(queue_notify_t notify);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,266 @@
+#ifndef RAWCODEC_H
+#define RAWCODEC_H
+
+/** Lossless coding of 16-bit frames for the .dat files.
+ * The frame is cut into bands of rows which are coded independently (and in parallel):
+ * every pixel is predicted from its left, upper and upper-left neighbours (LOCO-I median predictor),
+ * the residual is coded with adaptive Rice codes. The first row of a band only uses the left pixel,
+ * so a band can be decoded without the others.
+ * Header-only so the analysis macros can use the decoder without building the client.
+ **/
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "pipeline.h"
+
+#define RAWCODEC_NAME "rice-med"
+
+namespace rawcodec {
+
+// Unary part longer than this is an escape followed by the raw 16-bit residual
+const int ESCAPE_LIMIT = 24;
+const int MAX_K = 16;
+// Rice parameter statistics are halved after this many pixels to follow the local noise level
+const unsigned int RESET_COUNT = 64;
+
+class BitWriter {
+    std::vector<uint8_t>& m_out;
+    uint64_t m_acc = 0;
+    int m_bits = 0;
+
+public:
+    explicit BitWriter(std::vector<uint8_t>& out) : m_out(out) {}
+
+    /* n <= 32 */
+    void Put(uint32_t value, int n)
+    {
+        m_acc = (m_acc << n) | value;
+        m_bits += n;
+        while (m_bits >= 8)
+        {
+            m_bits -= 8;
+            m_out.push_back((uint8_t)(m_acc >> m_bits));
+        }
+    }
+
+    void Flush()
+    {
+        if (m_bits > 0)
+            m_out.push_back((uint8_t)(m_acc << (8 - m_bits)));
+        m_bits = 0;
+    }
+};
+
+class BitReader {
+    const uint8_t* m_data;
+    const uint8_t* m_end;
+    uint64_t m_acc = 0;   // next bits, MSB aligned
+    int m_bits = 0;
+    int m_padding = 0;    // zero bytes read past the end
+
+    void refill()
+    {
+        while (m_bits <= 56)
+        {
+            uint64_t byte = 0;
+            if (m_data < m_end)
+                byte = *m_data++;
+            else
+                m_padding++;
+            m_acc |= byte << (56 - m_bits);
+            m_bits += 8;
+        }
+    }
+
+public:
+    BitReader(const uint8_t* data, size_t size) : m_data(data), m_end(data + size) {}
+
+    uint32_t Get(int n)
+    {
+        if (n == 0)
+            return 0;
+        refill();
+        uint32_t value = (uint32_t)(m_acc >> (64 - n));
+        m_acc <<= n;
+        m_bits -= n;
+        return value;
+    }
+
+    /* number of zeros before the next one, at most ESCAPE_LIMIT */
+    int Unary()
+    {
+        refill();
+        int zeros = m_acc ? __builtin_clzll(m_acc) : 64;
+        if (zeros > ESCAPE_LIMIT)
+            zeros = ESCAPE_LIMIT;
+        m_acc <<= zeros + 1;
+        m_bits -= zeros + 1;
+        return zeros;
+    }
+
+    /* true if more bits were taken than the data has */
+    bool Overrun() const { return m_padding * 8 > m_bits; }
+};
+
+/* Adaptive Rice parameter, k is the smallest value with count * 2^k >= sum of residuals */
+struct RiceState {
+    uint32_t sum = 16;
+    uint32_t count = 1;
+
+    int K() const
+    {
+        int k = 0;
+        while ((count << k) < sum && k < MAX_K)
+            k++;
+        return k;
+    }
+
+    void Update(uint32_t value)
+    {
+        sum += value;
+        if (++count == RESET_COUNT)
+        {
+            sum >>= 1;
+            count >>= 1;
+        }
+    }
+};
+
+inline int predict(int left, int up, int upLeft)
+{
+    int lo = std::min(left, up);
+    int hi = std::max(left, up);
+    if (upLeft >= hi)
+        return lo;
+    if (upLeft <= lo)
+        return hi;
+    return left + up - upLeft;
+}
+
+/* residual modulo 2^16 folded to positive: 0, -1, 1, -2 ... -> 0, 1, 2, 3 ... */
+inline uint32_t zigzag(int pixel, int prediction)
+{
+    int16_t delta = (int16_t)(uint16_t)(pixel - prediction);
+    return (uint16_t)((delta << 1) ^ (delta >> 15));
+}
+
+inline int unzigzag(uint32_t value, int prediction)
+{
+    int delta = (int)(value >> 1) ^ -(int)(value & 1);
+    return (uint16_t)(prediction + delta);
+}
+
+/* prediction for pixel (x, y) of a band from the pixels coded before it */
+inline int predictPixel(const uint16_t* band, int cols, int x, int y)
+{
+    const uint16_t* row = band + (size_t)y * cols;
+    if (y == 0)
+        return x ? row[x - 1] : 0;
+    if (x == 0)
+        return row[x - cols];
+    return predict(row[x - 1], row[x - cols], row[x - cols - 1]);
+}
+
+inline void EncodeBand(const uint16_t* band, int cols, int rows, std::vector<uint8_t>& out)
+{
+    out.clear();
+    out.reserve((size_t)cols * rows);
+    BitWriter writer(out);
+    RiceState state;
+
+    for (int y = 0; y < rows; y++)
+    {
+        for (int x = 0; x < cols; x++)
+        {
+            int prediction = predictPixel(band, cols, x, y);
+            uint32_t value = zigzag(band[(size_t)y * cols + x], prediction);
+
+            int k = state.K();
+            uint32_t q = value >> k;
+            if (q < (uint32_t)ESCAPE_LIMIT)
+            {
+                writer.Put(1, q + 1);
+                writer.Put(value & ((1u << k) - 1), k);
+            }
+            else
+            {
+                writer.Put(1, ESCAPE_LIMIT + 1);
+                writer.Put(value, 16);
+            }
+            state.Update(value);
+        }
+    }
+    writer.Flush();
+}
+
+inline bool DecodeBand(const uint8_t* data, size_t size, int cols, int rows, uint16_t* band)
+{
+    BitReader reader(data, size);
+    RiceState state;
+
+    for (int y = 0; y < rows; y++)
+    {
+        for (int x = 0; x < cols; x++)
+        {
+            int prediction = predictPixel(band, cols, x, y);
+
+            int k = state.K();
+            int q = reader.Unary();
+            uint32_t value = q < ESCAPE_LIMIT ? ((uint32_t)q << k) | reader.Get(k) : reader.Get(16);
+            band[(size_t)y * cols + x] = unzigzag(value, prediction);
+            state.Update(value);
+        }
+    }
+    return !reader.Overrun();
+}
+
+} // namespace rawcodec
+
+inline int RawBandCount(int rows, int bandRows)
+{
+    return (rows + bandRows - 1) / bandRows;
+}
+
+/**
+ * @brief compress image band by band, bands keeps its buffers between calls
+ * @param threads: 0 - use all cores
+ */
+inline void EncodeRawBands(const uint16_t* image, int cols, int rows, int bandRows,
+                           std::vector<std::vector<uint8_t>>& bands, int threads = 0)
+{
+    int count = RawBandCount(rows, bandRows);
+    bands.resize(count);
+    ParallelFor(count, threads, [&](int band) {
+        int first = band * bandRows;
+        int height = std::min(bandRows, rows - first);
+        rawcodec::EncodeBand(image + (size_t)first * cols, cols, height, bands[band]);
+    });
+}
+
+/**
+ * @brief decode all bands, sizes holds the compressed size of every band, the bands follow each other in data
+ * @return false if a band is damaged
+ */
+inline bool DecodeRawBands(const uint8_t* data, const uint32_t* sizes, int cols, int rows, int bandRows,
+                           uint16_t* image, int threads = 0)
+{
+    int count = RawBandCount(rows, bandRows);
+    std::vector<size_t> offsets(count + 1, 0);
+    for (int band = 0; band < count; band++)
+        offsets[band + 1] = offsets[band] + sizes[band];
+
+    std::atomic<bool> ok(true);
+    ParallelFor(count, threads, [&](int band) {
+        int first = band * bandRows;
+        int height = std::min(bandRows, rows - first);
+        if (!rawcodec::DecodeBand(data + offsets[band], sizes[band], cols, height, image + (size_t)first * cols))
+            ok = false;
+    });
+    return ok;
+}
+
+#endif //RAWCODEC_H
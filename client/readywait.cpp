@@ -0,0 +1,121 @@
+// Project headers
+#include "readywait.h"
+
+#include <algorithm>
+#include <cmath>
+#include <time.h>
+
+// Wake up this long before the prediction plus a multiple of the usual prediction error
+static const double MIN_GUARD_SEC = 0.02;
+static const double GUARD_DEVIATIONS = 3;
+// Polling interval grows from the first to the last value
+static const double FIRST_POLL_SEC = 0.001;
+static const double MAX_POLL_SEC = 0.02;
+static const double POLL_GROWTH = 1.5;
+// Weight of the newest frame in the overhead estimate
+static const double LEARN_RATE = 0.25;
+
+static double threadCpuSec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+double ReadyWaiter::PredictSec(double exposureSec, const ReadoutKey& key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return exposureSec + m_models[key].overheadSec;
+}
+
+ReadyWaiter::Result ReadyWaiter::Wait(clock::time_point exposureStart, double exposureSec, const ReadoutKey& key,
+                                      const poll_t& poll, const std::atomic<bool>& keepGoing)
+{
+    double cpuStart = threadCpuSec();
+    Stats stats;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    const Model& model = m_models[key];
+    // Until the first frame is measured only the exposure itself is known for sure
+    stats.predictedSec = exposureSec + model.overheadSec;
+    double guardSec = std::max(MIN_GUARD_SEC, GUARD_DEVIATIONS * model.deviationSec);
+    double sleepUntilSec = stats.predictedSec - guardSec;
+
+    clock::time_point sleepBegin = clock::now();
+    if (sleepUntilSec > 0)
+    {
+        clock::time_point wakeTime = exposureStart + std::chrono::duration_cast<clock::duration>(
+                                                         std::chrono::duration<double>(sleepUntilSec));
+        m_wake.wait_until(lock, wakeTime, [&keepGoing](){ return !keepGoing; });
+    }
+    stats.sleepSec = std::chrono::duration<double>(clock::now() - sleepBegin).count();
+
+    Result result = Aborted;
+    double interval = FIRST_POLL_SEC;
+    while (keepGoing)
+    {
+        lock.unlock();
+        bool imageReady = false;
+        int status = poll(imageReady);
+        stats.polls++;
+        lock.lock();
+
+        if (status != 0)
+        {
+            result = Failed;
+            break;
+        }
+        if (imageReady)
+        {
+            result = Ready;
+            break;
+        }
+
+        m_wake.wait_for(lock, std::chrono::duration<double>(interval), [&keepGoing](){ return !keepGoing; });
+        interval = std::min(interval * POLL_GROWTH, MAX_POLL_SEC);
+    }
+    lock.unlock();
+
+    if (result == Ready)
+    {
+        stats.actualSec = std::chrono::duration<double>(clock::now() - exposureStart).count();
+        stats.errorSec = stats.actualSec - stats.predictedSec;
+        learn(key, exposureSec, stats.actualSec);
+    }
+    stats.cpuSec = threadCpuSec() - cpuStart;
+
+    lock.lock();
+    m_last = stats;
+    return result;
+}
+
+void ReadyWaiter::learn(const ReadoutKey& key, double exposureSec, double actualSec)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Model& model = m_models[key];
+    double overhead = std::max(0.0, actualSec - exposureSec);
+    if (model.samples == 0)
+    {
+        model.overheadSec = overhead;
+        model.deviationSec = overhead;
+    }
+    else
+    {
+        double error = overhead - model.overheadSec;
+        model.overheadSec += LEARN_RATE * error;
+        model.deviationSec += LEARN_RATE * (std::abs(error) - model.deviationSec);
+    }
+    model.samples++;
+}
+
+void ReadyWaiter::Wake()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_wake.notify_all();
+}
+
+ReadyWaiter::Stats ReadyWaiter::GetLastStats()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_last;
+}
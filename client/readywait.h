@@ -0,0 +1,75 @@
+#ifndef READYWAIT_H
+#define READYWAIT_H
+
+/** Waiting for get_ImageReady without spinning on the USB driver. The waiter sleeps until shortly
+ * before the predicted ready time, then polls with a growing interval. The prediction is the
+ * exposure time plus an overhead learned from previous frames (per readout speed and mode)
+ **/
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+class ReadyWaiter {
+public:
+    typedef std::chrono::steady_clock clock;
+    /* poll callback fills ready flag and returns the QSI result code (0 - ok) */
+    typedef std::function<int(bool&)> poll_t;
+
+    enum Result {
+        Ready,
+        Aborted,
+        Failed
+    };
+
+    /* Every readout speed and readout mode learns its own overhead */
+    struct ReadoutKey {
+        int speed = 0;      // QSICamera::ReadoutSpeed
+        int mode = 0;       // id of the window and binning
+        bool operator<(const ReadoutKey& other) const {return std::tie(speed, mode) < std::tie(other.speed, other.mode);};
+    };
+
+    struct Stats {
+        double predictedSec = 0;  // predicted time from exposure start to ready
+        double actualSec = 0;     // observed time from exposure start to ready
+        double errorSec = 0;      // actual - predicted
+        double sleepSec = 0;      // time spent in the initial sleep
+        double cpuSec = 0;        // CPU time of the waiting thread
+        int polls = 0;
+    };
+
+    /**
+     * @brief block until poll reports ready, keepGoing turns false or poll fails
+     * @param exposureStart: time StartExposure was called
+     * @param key: readout speed and mode, each has its own overhead estimate
+     * Exceptions from poll are passed to the caller
+     */
+    Result Wait(clock::time_point exposureStart, double exposureSec, const ReadoutKey& key,
+                const poll_t& poll, const std::atomic<bool>& keepGoing);
+
+    /* Wakes a waiting thread so it re-checks keepGoing */
+    void Wake();
+
+    double PredictSec(double exposureSec, const ReadoutKey& key);
+    Stats GetLastStats();
+
+private:
+    struct Model {
+        int samples = 0;
+        double overheadSec = 0;   // mean of (ready - start - exposure)
+        double deviationSec = 0;  // mean absolute prediction error
+    };
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::map<ReadoutKey, Model> m_models;
+    Stats m_last;
+
+    void learn(const ReadoutKey& key, double exposureSec, double actualSec);
+};
+
+#endif //READYWAIT_H
@@ -0,0 +1,327 @@
+// Project headers
+#include "simcamera.h"
+
+#ifdef CAMERA_SIMULATED
+
+#include "clusterfind.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+// Extra noise values so every frame can start reading the table at its own offset
+static const size_t NOISE_SPAN = 65536;
+// Temperature of the sensor with the cooler off
+static const double AMBIENT_TEMP = 20;
+
+static double envDouble(const char* name, double value)
+{
+    const char* text = getenv(name);
+    return text ? atof(text) : value;
+}
+
+void SimCameraConfig::LoadEnvironment()
+{
+    const char* sensor = getenv("SIMCAM_SENSOR");
+    long x, y;
+    if (sensor && sscanf(sensor, "%ldx%ld", &x, &y) == 2 && x > 0 && y > 0)
+    {
+        sensorX = x;
+        sensorY = y;
+    }
+    timeScale = std::max(0., envDouble("SIMCAM_TIME_SCALE", timeScale));
+    shutterSec = envDouble("SIMCAM_SHUTTER_MS", shutterSec * 1E3) / 1E3;
+    pixelRateHQ = envDouble("SIMCAM_PIXEL_RATE_HQ", pixelRateHQ);
+    pixelRateFast = envDouble("SIMCAM_PIXEL_RATE_FAST", pixelRateFast);
+    usbBytesPerSec = envDouble("SIMCAM_USB_MBPS", usbBytesPerSec / 1E6) * 1E6;
+    readNoise = envDouble("SIMCAM_READ_NOISE", readNoise);
+    sky = envDouble("SIMCAM_SKY", sky);
+    tracks = (int)envDouble("SIMCAM_TRACKS", tracks);
+    seed = (unsigned int)envDouble("SIMCAM_SEED", seed);
+}
+
+QSICamera::QSICamera() : m_abort(false), m_frameReady(false)
+{
+    m_config.LoadEnvironment();
+}
+
+QSICamera::~QSICamera()
+{
+    stopDigitizer();
+}
+
+void QSICamera::SetSimulation(const SimCameraConfig& config)
+{
+    stopDigitizer();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_config = config;
+    m_biasMap.clear();
+}
+
+int QSICamera::fail(const std::string& error)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_lastError = error;
+    }
+    throw std::runtime_error(error);
+}
+
+int QSICamera::get_DriverInfo(std::string& info)
+{
+    info = "simulated QSI camera";
+    return 0;
+}
+
+int QSICamera::get_AvailableCameras(std::string* serial, std::string* desc, int& numFound)
+{
+    serial[0] = m_serial;
+    get_Description(desc[0]);
+    numFound = 1;
+    return 0;
+}
+
+int QSICamera::get_LastError(std::string& error)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    error = m_lastError;
+    return 0;
+}
+
+int QSICamera::put_Connected(bool value)
+{
+    stopDigitizer();
+    if (value && m_biasMap.empty())
+        makeSensor();
+    m_connected = value;
+    return 0;
+}
+
+int QSICamera::put_BinX(short value)
+{
+    if (value < 1 || value > MAX_BIN)
+        return fail("Invalid BinX value");
+    m_binX = value;
+    return 0;
+}
+
+int QSICamera::put_BinY(short value)
+{
+    if (value < 1 || value > MAX_BIN)
+        return fail("Invalid BinY value");
+    m_binY = value;
+    return 0;
+}
+
+int QSICamera::get_CCDTemperature(double* value)
+{
+    *value = m_coolerOn ? m_setPoint : AMBIENT_TEMP;
+    return 0;
+}
+
+int QSICamera::get_CameraState(CameraState* state)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_exposing)
+        *state = CameraIdle;
+    else if (!m_frameReady || clock::now() < m_readyAt)
+        *state = CameraExposing;
+    else
+        *state = CameraIdle;
+    return 0;
+}
+
+int QSICamera::StartExposure(double duration, bool light)
+{
+    if (!m_connected)
+        return fail("Camera not connected");
+    double minExposure, maxExposure;
+    get_MinExposureTime(&minExposure);
+    get_MaxExposureTime(&maxExposure);
+    if (duration < minExposure || duration > maxExposure)
+        return fail("Invalid exposure duration");
+    if (m_binX != m_binY)
+        return fail("Asymmetric binning is not simulated");
+    if (m_numX <= 0 || m_numY <= 0 || m_startX < 0 || m_startY < 0 ||
+        (m_startX + m_numX) * m_binX > m_config.sensorX || (m_startY + m_numY) * m_binY > m_config.sensorY)
+        return fail("Invalid subframe");
+    bool busy;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        busy = m_exposing && !(m_frameReady && clock::now() >= m_readyAt);
+    }
+    if (busy)
+        return fail("Exposure in progress");
+    stopDigitizer();
+
+    int cols = m_numX, rows = m_numY;
+    double rate = m_readoutSpeed == HighImageQuality ? m_config.pixelRateHQ : m_config.pixelRateFast;
+    double delaySec = (m_config.shutterSec + duration + (double)cols * rows / rate) * m_config.timeScale;
+
+    char date[32];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    size_t n = strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now.tv_sec));
+    snprintf(date + n, sizeof(date) - n, ".%03ld", now.tv_nsec / 1000000);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_exposing = true;
+    m_imageValid = false;
+    m_frameReady = false;
+    m_abort = false;
+    m_exposureDate = date;
+    m_readyAt = clock::now() + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(delaySec));
+    // the camera makes the frame on its own, the host only waits for it
+    m_digitizer = std::thread(&QSICamera::digitize, this, m_startX, m_startY, cols, rows, m_binX, duration, light,
+                              m_config.seed + m_frameSeed++);
+    return 0;
+}
+
+int QSICamera::AbortExposure()
+{
+    stopDigitizer();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_exposing = false;
+    m_imageValid = false;
+    return 0;
+}
+
+int QSICamera::get_ImageReady(bool* ready)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_exposing && !m_imageValid)
+        *ready = false;
+    else
+        *ready = m_frameReady && clock::now() >= m_readyAt;
+    if (*ready)
+    {
+        m_exposing = false;
+        m_imageValid = true;
+    }
+    return 0;
+}
+
+int QSICamera::get_ImageArraySize(int& xSize, int& ySize, int& elementSize)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_imageValid)
+        xSize = ySize = 0;
+    else
+    {
+        xSize = m_frameCols;
+        ySize = m_frameRows;
+    }
+    elementSize = sizeof(uint16_t);
+    return 0;
+}
+
+int QSICamera::get_ImageArray(unsigned short* image)
+{
+    size_t bytes;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_imageValid)
+        {
+            m_lastError = "No image available";
+            throw std::runtime_error(m_lastError);
+        }
+        bytes = m_frame.size() * sizeof(uint16_t);
+        memcpy(image, m_frame.data(), bytes);
+    }
+    // the USB transfer is what the host waits for here
+    double transferSec = bytes / m_config.usbBytesPerSec * m_config.timeScale;
+    std::this_thread::sleep_for(std::chrono::duration<double>(transferSec));
+    return 0;
+}
+
+int QSICamera::get_LastExposureStartTime(std::string& date)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    date = m_exposureDate;
+    return 0;
+}
+
+void QSICamera::makeSensor()
+{
+    size_t count = (size_t)m_config.sensorX * m_config.sensorY;
+    unsigned int seed = m_config.seed;
+    auto uniform = [&seed]() {
+        seed = seed * 1664525u + 1013904223u;
+        return ((seed >> 8) + 0.5) / 16777216.;
+    };
+
+    // column pattern and a little pixel to pixel spread around the bias
+    std::vector<float> columns(m_config.sensorX);
+    for (float& column : columns)
+        column = (uniform() - 0.5) * 20;
+    m_biasMap.resize(count);
+    m_darkMap.resize(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        double bias = m_config.bias + columns[i % m_config.sensorX] + (uniform() - 0.5) * 4;
+        m_biasMap[i] = (uint16_t)std::min(65535., std::max(0., bias));
+        m_darkMap[i] = uniform() < m_config.hotFraction ? m_config.hotCurrent : m_config.darkCurrent;
+    }
+
+    // Gaussian read noise, Box-Muller
+    m_noise.resize(count + NOISE_SPAN);
+    for (size_t i = 0; i < m_noise.size(); i += 2)
+    {
+        double r = std::sqrt(-2 * std::log(uniform())) * m_config.readNoise;
+        double phi = 6.283185307179586 * uniform();
+        m_noise[i] = (int16_t)std::lround(r * std::cos(phi));
+        if (i + 1 < m_noise.size())
+            m_noise[i + 1] = (int16_t)std::lround(r * std::sin(phi));
+    }
+}
+
+void QSICamera::digitize(long startX, long startY, int cols, int rows, int bin, double duration, bool light,
+                         unsigned int seed)
+{
+    std::vector<uint16_t> frame((size_t)cols * rows);
+    size_t offset = (seed * 2654435761u) % NOISE_SPAN;
+    double sky = light ? m_config.sky * duration : 0;
+    int binned = bin * bin;
+
+    for (int y = 0; y < rows && !m_abort; y++)
+    {
+        const uint16_t* bias = m_biasMap.data() + (size_t)(startY + y) * bin * m_config.sensorX + startX * bin;
+        const float* dark = m_darkMap.data() + (size_t)(startY + y) * bin * m_config.sensorX + startX * bin;
+        const int16_t* noise = m_noise.data() + (size_t)y * cols + offset;
+        uint16_t* out = frame.data() + (size_t)y * cols;
+        for (int x = 0; x < cols; x++)
+        {
+            // one readout of the summed charge: the bias and the noise are not multiplied by the binning
+            double value = bias[x * bin] + binned * (dark[x * bin] * duration + sky) + noise[x];
+            out[x] = (uint16_t)std::min(65535., std::max(0., value));
+        }
+    }
+    if (m_abort)
+        return;
+
+    if (light && m_config.tracks > 0)
+    {
+        std::vector<SyntheticTrack> tracks;
+        AddSyntheticTracks(frame.data(), cols, rows, m_config.tracks, std::max(2, m_config.trackLength / bin),
+                           m_config.trackCharge * bin, seed, tracks);
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_frame.swap(frame);
+    m_frameCols = cols;
+    m_frameRows = rows;
+    m_frameReady = true;
+}
+
+void QSICamera::stopDigitizer()
+{
+    m_abort = true;
+    if (m_digitizer.joinable())
+        m_digitizer.join();
+    m_abort = false;
+}
+
+#endif // CAMERA_SIMULATED
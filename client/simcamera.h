@@ -0,0 +1,170 @@
+#ifndef SIMCAMERA_H
+#define SIMCAMERA_H
+
+/** Simulated QSI 6-series camera, compiled instead of the QSI SDK with -DCAMERA_SIMULATED.
+ * It has the part of the QSICamera API the client uses, with the same return codes (0 - ok) and
+ * std::runtime_error on errors. An exposure takes its (scaled) time, then the frame is "digitized"
+ * at the pixel rate of the readout speed and get_ImageReady turns true; get_ImageArray pays the
+ * USB transfer time. Frames are bias with a fixed pattern, dark current with hot pixels, read noise
+ * and, for light frames, a sky level and straight tracks (see AddSyntheticTracks), so calibration
+ * and the cluster finder have something real to work on.
+ * Every setting can be overridden by SIMCAM_* environment variables, read when the camera is made
+ **/
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct SimCameraConfig {
+    long sensorX = 3326;                // SIMCAM_SENSOR=3326x2504, KAF-8300 of the 683
+    long sensorY = 2504;
+    double timeScale = 1;               // SIMCAM_TIME_SCALE, multiplies every delay, 0 - no delays
+    double shutterSec = 0.05;           // SIMCAM_SHUTTER_MS, from StartExposure to the exposure start
+    double pixelRateHQ = 0.8E6;         // SIMCAM_PIXEL_RATE_HQ, digitized pixels per second
+    double pixelRateFast = 3.0E6;       // SIMCAM_PIXEL_RATE_FAST
+    double usbBytesPerSec = 30E6;       // SIMCAM_USB_MBPS, get_ImageArray transfer
+    int bias = 1000;                    // ADU
+    double readNoise = 8;               // ADU rms, SIMCAM_READ_NOISE
+    double darkCurrent = 0.5;           // ADU per second per pixel
+    double hotFraction = 2E-4;          // pixels with hotCurrent instead of darkCurrent
+    double hotCurrent = 200;
+    double sky = 50;                    // ADU per second on light frames, SIMCAM_SKY
+    int tracks = 100;                   // per light frame, SIMCAM_TRACKS
+    int trackLength = 40;
+    int trackCharge = 800;
+    unsigned int seed = 1;              // SIMCAM_SEED
+
+    /* SIMCAM_* variables over the defaults */
+    void LoadEnvironment();
+};
+
+class QSICamera {
+public:
+    enum CameraState { CameraIdle = 0, CameraWaiting = 1, CameraExposing = 2, CameraReading = 3,
+                       CameraDownload = 4, CameraError = 5 };
+    enum ReadoutSpeed { HighImageQuality = 0, FastReadout = 1 };
+    enum ShutterPriority { ShutterPriorityMechanical = 0, ShutterPriorityElectronic = 1 };
+    enum CameraGain { CameraGainHigh = 0, CameraGainLow = 1, CameraGainAuto = 2 };
+    enum FanMode { fanOff = 0, fanQuiet = 1, fanFull = 2 };
+    static const int MAXCAMERAS = 128;
+
+    QSICamera();
+    virtual ~QSICamera();
+
+    /* Settings of the next put_Connected(true) */
+    void SetSimulation(const SimCameraConfig& config);
+    const SimCameraConfig& GetSimulation() const {return m_config;};
+
+    int get_DriverInfo(std::string& info);
+    int get_AvailableCameras(std::string* serial, std::string* desc, int& numFound);
+    int get_SelectCamera(std::string& serial) {serial = m_serial; return 0;};
+    int put_SelectCamera(std::string serial) {return 0;};
+    int get_IsMainCamera(bool* value) {*value = true; return 0;};
+    int put_IsMainCamera(bool value) {return 0;};
+    int put_Connected(bool value);
+    int get_Connected(bool* value) {*value = m_connected; return 0;};
+    int get_SerialNumber(std::string& serial) {serial = m_serial; return 0;};
+    int get_ModelNumber(std::string& model) {model = "683wsg-8"; return 0;};
+    int get_Description(std::string& desc) {desc = "QSI 683 (simulated)"; return 0;};
+    int get_CameraState(CameraState* state);
+    int put_SoundEnabled(bool value) {return 0;};
+    int put_LEDEnabled(bool value) {return 0;};
+    int get_HasShutter(bool* value) {*value = true; return 0;};
+    int put_ManualShutterOpen(bool value) {return 0;};
+    int put_ManualShutterMode(bool value) {return 0;};
+    int put_ReadoutSpeed(ReadoutSpeed speed) {m_readoutSpeed = speed; return 0;};
+    int get_ReadoutSpeed(ReadoutSpeed& speed) {speed = m_readoutSpeed; return 0;};
+    int put_ShutterPriority(ShutterPriority priority) {m_shutterPriority = priority; return 0;};
+    int get_ShutterPriority(ShutterPriority* priority) {*priority = m_shutterPriority; return 0;};
+    int get_CameraGain(CameraGain* gain) {*gain = CameraGainHigh; return 0;};
+
+    int get_CameraXSize(long* value) {*value = m_config.sensorX; return 0;};
+    int get_CameraYSize(long* value) {*value = m_config.sensorY; return 0;};
+    /* The window is in binned pixels and checked by StartExposure, like the SDK does */
+    int put_StartX(long value) {m_startX = value; return 0;};
+    int put_StartY(long value) {m_startY = value; return 0;};
+    int put_NumX(long value) {m_numX = value; return 0;};
+    int put_NumY(long value) {m_numY = value; return 0;};
+    int get_StartX(long* value) {*value = m_startX; return 0;};
+    int get_StartY(long* value) {*value = m_startY; return 0;};
+    int get_NumX(long* value) {*value = m_numX; return 0;};
+    int get_NumY(long* value) {*value = m_numY; return 0;};
+    int put_BinX(short value);
+    int put_BinY(short value);
+    int get_BinX(short* value) {*value = m_binX; return 0;};
+    int get_BinY(short* value) {*value = m_binY; return 0;};
+    int get_MaxBinX(short* value) {*value = MAX_BIN; return 0;};
+    int get_MaxBinY(short* value) {*value = MAX_BIN; return 0;};
+
+    int get_ElectronsPerADU(double* value) {*value = 0.5; return 0;};
+    int get_FullWellCapacity(double* value) {*value = 25500; return 0;};
+    int get_MaxADU(long* value) {*value = 65535; return 0;};
+    int get_MinExposureTime(double* value) {*value = 0.03; return 0;};
+    int get_MaxExposureTime(double* value) {*value = 240 * 60; return 0;};
+    int get_LastError(std::string& error);
+
+    int get_CanSetCCDTemperature(bool* value) {*value = true; return 0;};
+    int get_CoolerOn(bool* value) {*value = m_coolerOn; return 0;};
+    int put_CoolerOn(bool value) {m_coolerOn = value; return 0;};
+    int put_SetCCDTemperature(double value) {m_setPoint = value; return 0;};
+    int get_SetCCDTemperature(double* value) {*value = m_setPoint; return 0;};
+    int get_CCDTemperature(double* value);
+    int get_HeatSinkTemperature(double* value) {*value = 25; return 0;};
+    int get_CoolerPower(double* value) {*value = m_coolerOn ? 40 : 0; return 0;};
+    int get_FanMode(FanMode& mode) {mode = m_fanMode; return 0;};
+    int put_FanMode(FanMode mode) {m_fanMode = mode; return 0;};
+
+    int get_CanAbortExposure(bool* value) {*value = true; return 0;};
+    int AbortExposure();
+    int StartExposure(double duration, bool light);
+    int get_ImageReady(bool* ready);
+    int get_ImageArraySize(int& xSize, int& ySize, int& elementSize);
+    int get_ImageArray(unsigned short* image);
+    int get_LastExposureStartTime(std::string& date);
+
+private:
+    typedef std::chrono::steady_clock clock;
+    static const short MAX_BIN = 9;
+
+    SimCameraConfig m_config;
+    std::string m_serial = "00500000";
+    std::mutex m_mutex;     // exposure state, frame and error between the caller and the digitizer
+    std::string m_lastError;
+    bool m_connected = false;
+    bool m_coolerOn = false;
+    double m_setPoint = 10;
+    FanMode m_fanMode = fanFull;
+    ReadoutSpeed m_readoutSpeed = HighImageQuality;
+    ShutterPriority m_shutterPriority = ShutterPriorityMechanical;
+    long m_startX = 0, m_startY = 0, m_numX = 0, m_numY = 0;
+    short m_binX = 1, m_binY = 1;
+
+    // the exposure in progress, the digitizer thread fills m_frame
+    std::thread m_digitizer;
+    std::atomic<bool> m_abort;
+    std::atomic<bool> m_frameReady;
+    bool m_exposing = false;
+    bool m_imageValid = false;
+    clock::time_point m_readyAt;
+    std::string m_exposureDate;
+    int m_frameCols = 0, m_frameRows = 0;
+    std::vector<uint16_t> m_frame;
+    unsigned int m_frameSeed = 0;
+
+    // made at connect: per-pixel bias and dark current, and a noise table read at a random offset
+    std::vector<uint16_t> m_biasMap;
+    std::vector<float> m_darkMap;
+    std::vector<int16_t> m_noise;
+
+    void makeSensor();
+    void digitize(long startX, long startY, int cols, int rows, int bin, double duration, bool light, unsigned int seed);
+    void stopDigitizer();
+    int fail(const std::string& error);
+};
+
+#endif //SIMCAMERA_H
@@ -0,0 +1,215 @@
+#ifndef STATPLANES_H
+#define STATPLANES_H
+
+/** Per-pixel mean and deviation of every exposure time as contiguous float32 planes.
+ * File layout: header, planes (each starts on a page), index of the exposures at the end.
+ * The geometry is implicit (pixel = row * cols + col), so a pixel costs 8 bytes per exposure.
+ * The reader mmaps the file: one plane or the slice of one pixel over all exposures only
+ * touches the pages it needs. Header-only so the ROOT macros can include it directly.
+ **/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "datreader.h"
+
+#define STATPLANES_MAGIC "PXSTAT1"
+const size_t STATPLANES_ALIGN = 4096;
+
+struct StatPlanesHeader {
+    char magic[8];
+    uint64_t indexOffset;
+    uint32_t count;
+    uint32_t reserved;
+};
+
+struct StatPlaneEntry {
+    double exposureTime;
+    uint32_t cols;
+    uint32_t rows;
+    uint64_t frames;
+    uint64_t meanOffset;
+    uint64_t devOffset;
+};
+
+class StatPlanesWriter {
+    FILE* m_file = NULL;
+    uint64_t m_offset = 0;
+    std::vector<StatPlaneEntry> m_index;
+
+    bool writePlane(const float* plane, size_t count, uint64_t& offset)
+    {
+        static const char zeros[STATPLANES_ALIGN] = {};
+        size_t pad = (STATPLANES_ALIGN - m_offset % STATPLANES_ALIGN) % STATPLANES_ALIGN;
+        if (fwrite(zeros, 1, pad, m_file) != pad)
+            return false;
+        offset = m_offset + pad;
+        m_offset = offset + count * sizeof(float);
+        return fwrite(plane, sizeof(float), count, m_file) == count;
+    }
+
+public:
+    StatPlanesWriter() = default;
+    StatPlanesWriter(const StatPlanesWriter&) = delete;
+    StatPlanesWriter& operator=(const StatPlanesWriter&) = delete;
+    ~StatPlanesWriter() { Close(); }
+
+    bool Open(const std::string& path)
+    {
+        Close();
+        m_file = fopen(path.c_str(), "wb");
+        if (m_file == NULL)
+            return false;
+        m_index.clear();
+        // the header is written again with the index offset on Close
+        StatPlanesHeader header = {};
+        m_offset = fwrite(&header, sizeof(header), 1, m_file) * sizeof(header);
+        return m_offset == sizeof(header);
+    }
+
+    bool Add(double exposureTime, int cols, int rows, uint64_t frames, const float* mean, const float* dev)
+    {
+        if (m_file == NULL)
+            return false;
+        StatPlaneEntry entry = {exposureTime, (uint32_t)cols, (uint32_t)rows, frames, 0, 0};
+        size_t count = (size_t)cols * rows;
+        if (!writePlane(mean, count, entry.meanOffset) || !writePlane(dev, count, entry.devOffset))
+            return false;
+        m_index.push_back(entry);
+        return true;
+    }
+
+    /* writes the index and the header, false if anything went wrong with the file */
+    bool Close()
+    {
+        if (m_file == NULL)
+            return false;
+        StatPlanesHeader header = {};
+        memcpy(header.magic, STATPLANES_MAGIC, sizeof(header.magic));
+        header.count = m_index.size();
+
+        // the reader uses the index in place, so it starts aligned for its doubles however odd the planes are
+        static const char zeros[alignof(StatPlaneEntry)] = {};
+        size_t pad = (alignof(StatPlaneEntry) - m_offset % alignof(StatPlaneEntry)) % alignof(StatPlaneEntry);
+        header.indexOffset = m_offset + pad;
+        bool ok = fwrite(zeros, 1, pad, m_file) == pad;
+        ok = ok && fwrite(m_index.data(), sizeof(StatPlaneEntry), m_index.size(), m_file) == m_index.size();
+        ok = ok && fseek(m_file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, m_file) == 1;
+        ok = fclose(m_file) == 0 && ok;
+        m_file = NULL;
+        return ok;
+    }
+};
+
+class StatPlanes {
+    const unsigned char* m_map = nullptr;
+    size_t m_size = 0;
+    const StatPlaneEntry* m_index = nullptr;
+    size_t m_count = 0;
+
+    const float* plane(uint64_t offset, const StatPlaneEntry& entry) const
+    {
+        if (offset % alignof(float) != 0 || offset + (uint64_t)entry.cols * entry.rows * sizeof(float) > m_size)
+            return nullptr;
+        return reinterpret_cast<const float*>(m_map + offset);
+    }
+
+public:
+    StatPlanes() = default;
+    explicit StatPlanes(const std::string& path) { Open(path); }
+    StatPlanes(const StatPlanes&) = delete;
+    StatPlanes& operator=(const StatPlanes&) = delete;
+    ~StatPlanes() { Close(); }
+
+    bool Open(const std::string& path)
+    {
+        Close();
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(StatPlanesHeader))
+        {
+            void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (map != MAP_FAILED)
+            {
+                m_map = static_cast<const unsigned char*>(map);
+                m_size = st.st_size;
+            }
+        }
+        close(fd);
+        if (m_map == nullptr)
+            return false;
+
+        const StatPlanesHeader* header = reinterpret_cast<const StatPlanesHeader*>(m_map);
+        if (memcmp(header->magic, STATPLANES_MAGIC, sizeof(header->magic)) != 0 ||
+            header->indexOffset % alignof(StatPlaneEntry) != 0 || header->indexOffset > m_size ||
+            header->count > (m_size - header->indexOffset) / sizeof(StatPlaneEntry))
+        {
+            Close();
+            return false;
+        }
+        m_index = reinterpret_cast<const StatPlaneEntry*>(m_map + header->indexOffset);
+        m_count = header->count;
+        return true;
+    }
+
+    void Close()
+    {
+        if (m_map)
+            munmap(const_cast<unsigned char*>(m_map), m_size);
+        m_map = nullptr;
+        m_size = 0;
+        m_index = nullptr;
+        m_count = 0;
+    }
+
+    size_t FileSize() const { return m_size; }
+    size_t Count() const { return m_count; }
+    const StatPlaneEntry& Entry(size_t k) const { return m_index[k]; }
+
+    /* index of the exposure with the same DatExposureKey, -1 if there is none */
+    int Find(double exposureTime) const
+    {
+        for (size_t k = 0; k < m_count; k++)
+            if (DatExposureKey(m_index[k].exposureTime) == DatExposureKey(exposureTime))
+                return k;
+        return -1;
+    }
+
+    /* cols * rows values in place, NULL if the file is cut */
+    const float* Mean(size_t k) const { return plane(m_index[k].meanOffset, m_index[k]); }
+    const float* Dev(size_t k) const { return plane(m_index[k].devOffset, m_index[k]); }
+
+    /**
+     * @brief mean and deviation of one pixel for every exposure, in index order
+     * @return false if the pixel is outside any of the planes
+     */
+    bool PixelSlice(int col, int row, std::vector<float>& means, std::vector<float>& devs) const
+    {
+        means.resize(m_count);
+        devs.resize(m_count);
+        for (size_t k = 0; k < m_count; k++)
+        {
+            const StatPlaneEntry& entry = m_index[k];
+            const float* mean = Mean(k);
+            const float* dev = Dev(k);
+            if (col < 0 || row < 0 || (uint32_t)col >= entry.cols || (uint32_t)row >= entry.rows || !mean || !dev)
+                return false;
+            size_t i = (size_t)row * entry.cols + col;
+            means[k] = mean[i];
+            devs[k] = dev[i];
+        }
+        return true;
+    }
+};
+
+#endif //STATPLANES_H
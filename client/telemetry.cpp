@@ -0,0 +1,67 @@
+// Project headers
+#include "telemetry.h"
+#include "latency.h"
+
+#include <chrono>
+#include <stdexcept>
+
+void TelemetrySampler::Start(int periodMs, read_t read)
+{
+    Stop();
+    m_periodMs = periodMs;
+    m_read = read;
+    m_stop = false;
+    m_thread = std::thread(&TelemetrySampler::loop, this);
+}
+
+void TelemetrySampler::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    if (m_thread.joinable())
+        m_thread.join();
+    m_snapshot.Store(TelemetrySnapshot());
+}
+
+TelemetryCounters TelemetrySampler::GetCounters() const
+{
+    TelemetryCounters counters;
+    counters.samples = m_samples;
+    counters.skipped = m_skipped;
+    counters.failed = m_failed;
+    return counters;
+}
+
+void TelemetrySampler::loop()
+{
+    TelemetrySnapshot snapshot;
+    while (true)
+    {
+        // start from the last values, a partial read leaves the rest as they were
+        TelemetrySnapshot sample = snapshot;
+        try
+        {
+            if (m_read(sample))
+            {
+                sample.valid = true;
+                sample.sampleNs = LATENCY_Now();
+                snapshot = sample;
+                m_snapshot.Store(snapshot);
+                m_samples++;
+            }
+            else
+                m_skipped++;
+        }
+        catch (std::runtime_error&)
+        {
+            m_failed++;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_wake.wait_for(lock, std::chrono::milliseconds(m_periodMs.load()), [this](){ return m_stop; }))
+            return;
+    }
+}
@@ -0,0 +1,111 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+/** Camera telemetry read by a background thread at a fixed rate. The last sample is published
+ * through a seqlock, so the websocket loop gets it with a few loads and never waits on USB.
+ * The sampler skips a sample rather than wait when the camera is busy (see the read callback)
+ **/
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+
+/* Single writer, any number of readers that retry while a write is going on */
+template <typename T>
+class Seqlock {
+    static_assert(std::is_trivially_copyable<T>::value, "Seqlock needs a trivially copyable type");
+
+public:
+    Seqlock()
+    {
+        for (auto& word : m_words)
+            word.store(0, std::memory_order_relaxed);
+    }
+
+    void Store(const T& value)
+    {
+        uint64_t words[WORDS] = {};
+        memcpy(words, &value, sizeof(T));
+        uint32_t seq = m_seq.load(std::memory_order_relaxed);
+        m_seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (int i = 0; i < WORDS; i++)
+            m_words[i].store(words[i], std::memory_order_relaxed);
+        m_seq.store(seq + 2, std::memory_order_release);
+    }
+
+    T Load() const
+    {
+        uint64_t words[WORDS];
+        uint32_t before, after;
+        do
+        {
+            before = m_seq.load(std::memory_order_acquire);
+            for (int i = 0; i < WORDS; i++)
+                words[i] = m_words[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = m_seq.load(std::memory_order_relaxed);
+        } while ((before & 1) || before != after);
+
+        T value;
+        memcpy(&value, words, sizeof(T));
+        return value;
+    }
+
+private:
+    static const int WORDS = (sizeof(T) + 7) / 8;
+    std::atomic<uint32_t> m_seq{0};
+    std::atomic<uint64_t> m_words[WORDS];
+};
+
+struct TelemetrySnapshot {
+    bool valid = false;         // false until the first sample
+    double ccdTemp = 0;
+    double sinkTemp = 0;
+    double coolerPower = 0;     // percent
+    double setPoint = 0;
+    bool coolerOn = false;
+    int fanMode = 0;            // QSICamera::FanMode
+    int cameraState = 0;        // QSICamera::CameraState
+    uint64_t sampleNs = 0;      // LATENCY_Now() of the sample
+};
+
+struct TelemetryCounters {
+    uint64_t samples = 0;
+    uint64_t skipped = 0;       // camera busy, previous values kept
+    uint64_t failed = 0;        // getter threw or returned an error
+};
+
+class TelemetrySampler {
+public:
+    /* fills the snapshot, returns false to skip this sample (busy); exceptions count as failed samples */
+    typedef std::function<bool(TelemetrySnapshot&)> read_t;
+
+    ~TelemetrySampler() { Stop(); }
+
+    void Start(int periodMs, read_t read);
+    void Stop();
+    void SetPeriod(int periodMs) { m_periodMs = periodMs; }
+
+    TelemetrySnapshot Get() const { return m_snapshot.Load(); }
+    TelemetryCounters GetCounters() const;
+
+private:
+    Seqlock<TelemetrySnapshot> m_snapshot;
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    bool m_stop = false;
+    std::atomic<int> m_periodMs{1000};
+    read_t m_read;
+    std::atomic<uint64_t> m_samples{0}, m_skipped{0}, m_failed{0};
+
+    void loop();
+};
+
+#endif //TELEMETRY_H
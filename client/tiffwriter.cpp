@@ -0,0 +1,219 @@
+// Project headers
+#include "tiffwriter.h"
+#include "latency.h"
+#include "pipeline.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "tiffio.h"
+
+// About 430 KB per strip for the full frame
+static const int ROWS_PER_STRIP = 64;
+// Fastest deflate level, the SD card is slower than zlib anyway
+static const int DEFLATE_LEVEL = 1;
+
+/* Horizontal differencing of every row (TIFF predictor 2) and deflate of the whole strip */
+bool TiffWriter::deflateStrip(const unsigned short* strip, int cols, int rows, std::vector<unsigned char>& out)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit(&stream, DEFLATE_LEVEL) != Z_OK)
+        return false;
+
+    out.resize(deflateBound(&stream, sizeof(unsigned short) * cols * rows));
+    stream.next_out = out.data();
+    stream.avail_out = out.size();
+
+    std::vector<unsigned short> row(cols);
+    bool ok = true;
+    for (int y = 0; y < rows && ok; y++)
+    {
+        const unsigned short* src = strip + (size_t)y * cols;
+        row[0] = src[0];
+        for (int x = 1; x < cols; x++)
+            row[x] = src[x] - src[x - 1];
+
+        stream.next_in = reinterpret_cast<Bytef*>(row.data());
+        stream.avail_in = sizeof(unsigned short) * cols;
+        int flush = y + 1 == rows ? Z_FINISH : Z_NO_FLUSH;
+        int status = deflate(&stream, flush);
+        ok = flush == Z_FINISH ? status == Z_STREAM_END : status == Z_OK;
+    }
+
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return ok;
+}
+
+bool TiffWriter::Write(const unsigned short* image, int cols, int rows, const std::string& filename,
+                       TiffCompression compression, TiffStats& stats)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+    TIFF* tif = TIFFOpen(filename.c_str(), "w");
+    if (tif == NULL)
+    {
+        printf("Could not open %s for writing\n", filename.c_str());
+        return false;
+    }
+
+    TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, cols);
+    TIFFSetField(tif, TIFFTAG_IMAGELENGTH, rows);
+    TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 16);
+    TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
+    TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT);
+    TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, ROWS_PER_STRIP);
+    TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+    TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+
+    switch (compression)
+    {
+        case TIFF_COMPRESS_DEFLATE:
+            TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_ADOBE_DEFLATE);
+            TIFFSetField(tif, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
+            break;
+        case TIFF_COMPRESS_LZW:
+            TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+            TIFFSetField(tif, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
+            break;
+        default:
+            TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+            break;
+    }
+
+    int strips = (rows + ROWS_PER_STRIP - 1) / ROWS_PER_STRIP;
+    m_strips.resize(strips);
+    bool ok = true;
+    stats.bytes = 0;
+
+    if (compression == TIFF_COMPRESS_DEFLATE)
+    {
+        std::atomic<bool> compressed(true);
+        ParallelFor(strips, 0, [&](int strip) {
+            int first = strip * ROWS_PER_STRIP;
+            int height = std::min(ROWS_PER_STRIP, rows - first);
+            if (!deflateStrip(image + (size_t)first * cols, cols, height, m_strips[strip]))
+                compressed = false;
+        });
+        ok = compressed;
+
+        for (int strip = 0; strip < strips && ok; strip++)
+        {
+            ok = TIFFWriteRawStrip(tif, strip, m_strips[strip].data(), m_strips[strip].size()) >= 0;
+            stats.bytes += m_strips[strip].size();
+        }
+    }
+    else
+    {
+        for (int strip = 0; strip < strips && ok; strip++)
+        {
+            int first = strip * ROWS_PER_STRIP;
+            int height = std::min(ROWS_PER_STRIP, rows - first);
+            size_t size = sizeof(unsigned short) * cols * height;
+            void* data = const_cast<unsigned short*>(image + (size_t)first * cols);
+            if (compression == TIFF_COMPRESS_LZW)
+            {
+                // the libtiff predictor works in place, so it gets a copy
+                std::vector<unsigned char>& buffer = m_strips[strip];
+                buffer.resize(size);
+                memcpy(buffer.data(), data, size);
+                data = buffer.data();
+            }
+            ok = TIFFWriteEncodedStrip(tif, strip, data, size) >= 0;
+            stats.bytes += size;
+        }
+    }
+
+    TIFFClose(tif);
+    stats.strips = strips;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    return ok;
+}
+
+/* The writer as it was before TiffWriter: one row per strip, a TIFFWriteScanline call per row */
+static bool writeScanlines(const void* image, int cols, int rows, int bits, const std::string& filename)
+{
+    TIFF* tif = TIFFOpen(filename.c_str(), "w");
+    if (tif == NULL)
+        return false;
+    TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, cols);
+    TIFFSetField(tif, TIFFTAG_IMAGELENGTH, rows);
+    TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, bits);
+    TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
+    TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, 1);
+    TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+    TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+    TIFFSetField(tif, TIFFTAG_FILLORDER, FILLORDER_MSB2LSB);
+    TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tif, TIFFTAG_XRESOLUTION, 150.0);
+    TIFFSetField(tif, TIFFTAG_YRESOLUTION, 150.0);
+    TIFFSetField(tif, TIFFTAG_RESOLUTIONUNIT, RESUNIT_INCH);
+
+    size_t rowBytes = (size_t)cols * bits / 8;
+    bool ok = true;
+    for (int y = 0; y < rows && ok; y++)
+        ok = TIFFWriteScanline(tif, (unsigned char*)image + rowBytes * y, y) >= 0;
+    TIFFClose(tif);
+    return ok;
+}
+
+int TIFFWRITER_Bench(const char* dir, int cols, int rows, int iterations)
+{
+    if (cols < 1 || rows < 1 || iterations < 1)
+        return 1;
+    mkdir(dir, 0755);
+    size_t count = (size_t)cols * rows;
+
+    // dark-like frame: bias with noise and a gradient, compresses about as a real one
+    std::vector<unsigned short> image(count);
+    std::vector<unsigned char> display(count);
+    unsigned int seed = 12345;
+    for (size_t i = 0; i < count; i++)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        image[i] = 1000 + (i % cols) / 8 + (seed >> 27);
+        display[i] = image[i] >> 4;
+    }
+
+    static const char* NAMES[] = {"scanline 8", "scanline 16", "strips 16", "deflate 16", "lzw 16"};
+    TiffWriter writer;
+    int failures = 0;
+    double formerMs = 0;
+    printf("%-12s %10s %10s %12s\n", "tiff", "ms", "MB/s", "bytes");
+    for (int mode = 0; mode < 5; mode++)
+    {
+        std::string filename = std::string(dir) + "/bench_tiff.tif";
+        bool ok = true;
+        uint64_t begin = LATENCY_Now();
+        for (int k = 0; k < iterations && ok; k++)
+        {
+            TiffStats stats;
+            if (mode < 2)
+                ok = writeScanlines(mode == 0 ? (void*)display.data() : (void*)image.data(), cols, rows,
+                                    mode == 0 ? 8 : 16, filename);
+            else
+                ok = writer.Write(image.data(), cols, rows, filename, (TiffCompression)(mode - 2), stats);
+        }
+        double ms = (LATENCY_Now() - begin) * 1E-6 / iterations;
+        if (mode == 1)
+            formerMs = ms;
+
+        struct stat file;
+        long long bytes = ok && stat(filename.c_str(), &file) == 0 ? (long long)file.st_size : -1;
+        remove(filename.c_str());
+        failures += !ok;
+        printf("%-12s %10.2f %10.1f %12lld%s", NAMES[mode], ms, (mode == 0 ? 1 : 2) * count / ms * 1E-3, bytes,
+               ok ? "" : " FAILED");
+        if (mode > 1 && formerMs > 0)
+            printf("  %.1fx scanline 16", formerMs / ms);
+        printf("\n");
+    }
+    return failures ? 1 : 0;
+}
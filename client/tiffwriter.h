@@ -0,0 +1,59 @@
+#ifndef TIFFWRITER_H
+#define TIFFWRITER_H
+
+/** Full 16-bit TIFF output with large strips. Deflate strips are predicted and compressed in
+ * parallel by the client and written with TIFFWriteRawStrip, LZW strips go through libtiff
+ **/
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief write a synthetic cols x rows frame in dir with the former one-row scanline layout and with every
+ * TiffWriter compression, and print time, throughput and size of each, see --bench-tiff
+ * @return 0 - every file was written
+ */
+int TIFFWRITER_Bench(const char* dir, int cols, int rows, int iterations);
+
+#ifdef __cplusplus
+}
+
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <vector>
+
+enum TiffCompression {
+    TIFF_COMPRESS_NONE,
+    TIFF_COMPRESS_DEFLATE,   // horizontal predictor + deflate, parallel per strip
+    TIFF_COMPRESS_LZW        // horizontal predictor + LZW by libtiff, serial
+};
+
+struct TiffStats {
+    size_t bytes = 0;       // strip bytes handed to libtiff, compressed for deflate
+    int strips = 0;
+    double seconds = 0;
+};
+
+class TiffWriter {
+public:
+    /**
+     * @brief write image as a 16-bit grayscale TIFF
+     * @return false if the file can not be written
+     */
+    bool Write(const unsigned short* image, int cols, int rows, const std::string& filename,
+               TiffCompression compression, TiffStats& stats);
+
+private:
+    std::mutex m_mutex;
+    std::vector<std::vector<unsigned char>> m_strips;
+
+    bool deflateStrip(const unsigned short* strip, int cols, int rows, std::vector<unsigned char>& out);
+};
+
+#endif
+
+#endif //TIFFWRITER_H
@@ -11,7 +11,7 @@ This is site made in aims to provide images from detector of muon beams
 """
 
 from fastapi import FastAPI, Body, Request, HTTPException, WebSocket, WebSocketException, WebSocketDisconnect
-from fastapi.responses import HTMLResponse, StreamingResponse, RedirectResponse
+from fastapi.responses import HTMLResponse, JSONResponse, StreamingResponse, RedirectResponse
 from fastapi.templating import Jinja2Templates
 from fastapi.staticfiles import StaticFiles
 from datetime import datetime
@@ -19,6 +19,9 @@ import uvicorn
 import numpy
 import asyncio
 import json
+import os
+import re
+import struct
 
 
 # my modules
@@ -27,6 +30,10 @@ import auth
 
 #constants 
 APP_STD_TIMEOUT = 10 #sec
+PREVIEW_PATH = "static/preview.png"  # last preview sent by the camera
+HITS_PATH = "static/hits.jsonl"  # cluster records of every frame, one line per frame
+HITS_HEADER = struct.Struct("<IIIIfIII")  # cols, rows, count, dropped, exposure time, start x, start y, binning
+HITS_RECORD = struct.Struct("<ffII4H")  # x, y, size, charge, x min, y min, x max, y max
 
 # server
 app = FastAPI()
@@ -41,6 +48,10 @@ templates = Jinja2Templates(directory="templates")
 
 # units of measurement which possibly can be sent to camera
 fan_speed_values = ("off", "quiet", "full")
+# TIFF the client saves next to every .dat file
+tiff_modes = ("off", "display", "16", "deflate", "lzw")
+# how the client combines a master dark series
+combine_methods = ("median", "sigmaclip")
 exposure_time_units = {"ms": 1,
                        "sec": 1000,
                        "min": 60*1000,
@@ -49,11 +60,13 @@ exposure_time_units = {"ms": 1,
                        }
 
 class PhotoTask():
-    def __init__(self, expos_t: int, num_photos: int):
+    def __init__(self, expos_t: int, num_photos: int, roi=None, binning: int = 1):
         """ This is conditions in photo was made """
         
         self.exposure_time = expos_t
         self.photos_amount = num_photos
+        self.roi = roi  # [x, y, width, height] in sensor pixels, None - full frame
+        self.binning = binning
         print(self.exposure_time, flush=True)
 
         self.ready_flag = 0
@@ -105,6 +118,19 @@ class TaskManager():
         self.current_task = task
         
 
+def _append_hits(payload: bytes, time: str):
+    """ Decode a HITS message and append it to HITS_PATH as one JSON line, runs in a worker thread """
+    cols, rows, count, dropped, exposure, start_x, start_y, binning = HITS_HEADER.unpack_from(payload)
+    clusters = [
+        {"x": x, "y": y, "size": size, "charge": charge, "bbox": [x0, y0, x1, y1]}
+        for x, y, size, charge, x0, y0, x1, y1 in HITS_RECORD.iter_unpack(payload[HITS_HEADER.size:])
+    ]
+    with open(HITS_PATH, "a") as fd:
+        fd.write(json.dumps({"time": time, "exposure": exposure, "cols": cols, "rows": rows, "dropped": dropped,
+                             "start": [start_x, start_y], "bin": binning, "clusters": clusters}) + "\n")
+    return count, dropped
+
+
 class Device():
     def __init__(self):
         self.connection_state = asyncio.Event()
@@ -112,6 +138,11 @@ class Device():
         self.params_are_set = asyncio.Event()
         self.photo_task_started = asyncio.Event()
         self.canceled_without_err = asyncio.Event()
+        self.new_latency = asyncio.Event()
+        self.calibration_set = asyncio.Event()
+        self.clusters_set = asyncio.Event()
+        self.compression_set = asyncio.Event()
+        self.tiff_mode_set = asyncio.Event()
         
         self.websocket = None
         self.listener = None
@@ -119,6 +150,12 @@ class Device():
         self.ccd_temp = None
         self.heat_sink_temp = None
         self.fan_speed = None
+        self.preview_url = None
+        self.last_hits = None  # summary of the last cluster message
+        self.last_latency = None  # stage latency percentiles of the client, ms
+        self.last_queue = None  # depths and drops of the client outbound queue lanes
+        self.command_id = 0  # sent in front of every command as "@<id>", answers carry it back
+        self.last_answer = None
                
     def is_connected(self) -> bool:
         return self.websocket is not None
@@ -150,50 +187,106 @@ class Device():
         if message is not None:
             try:
                 data = json.loads(message)
-                type_ = data.get("type")
-        
-                match type_:
-                    case "info":  
-                        if "ccd" in data and "sink" in data and "fan" in data:
-                            self.ccd_temp = data["ccd"]
-                            self.heat_sink_temp = data["sink"]
-                            self.fan_speed = data["fan"]
-                            self.new_status_info.set()
-                        
-                        elif "ready" in data:
-                            pass
-
-                    case "answer":
-                        match data["oncommand"]:
-                            case "connect":
-                                if data["status"] == "success":
-                                    self.connection_state.set()
-                            case "set":
-                                if data["status"] == "success":
-                                    self.params_are_set.set()
-                            case "disconnect":
-                                if data["status"] == "success":
-                                    pass
-                            case "phototask":
-                                if data["status"] == "success":
-                                    self.photo_task_started.set()
-                            case "cancel":
-                                if data["status"] == "success":
-                                    self.canceled_without_err.set()
-                    case "error":
-                        pass
-                    case _:
-                        pass
+                # a client started with --batch sends several messages in one frame as a JSON array
+                for item in data if isinstance(data, list) else [data]:
+                    await self._handle_data(item)
 
             except json.JSONDecodeError as e:
                 print(f"Ошибка парсинга JSON: {e}")
+
+    async def _handle_data(self, data: dict):
+        type_ = data.get("type")
+        
+        match type_:
+            case "info":  
+                if "ccd" in data and "sink" in data and "fan" in data:
+                    self.ccd_temp = data["ccd"]
+                    self.heat_sink_temp = data["sink"]
+                    self.fan_speed = data["fan"]
+                    self.new_status_info.set()
+                
+                elif "ready" in data:
+                    pass
+
+            case "answer":
+                # the client runs commands on its own thread, latency is receive to answer in ms
+                self.last_answer = {"id": data.get("id"), "oncommand": data["oncommand"],
+                                    "status": data["status"], "latency": data.get("latency")}
+                match data["oncommand"]:
+                    case "connect":
+                        if data["status"] == "success":
+                            self.connection_state.set()
+                    case "set":
+                        if data["status"] == "success":
+                            self.params_are_set.set()
+                    case "disconnect":
+                        if data["status"] == "success":
+                            pass
+                    case "phototask":
+                        if data["status"] == "success":
+                            self.photo_task_started.set()
+                    case "cancel":
+                        if data["status"] == "success":
+                            self.canceled_without_err.set()
+                    case "calib":
+                        if data["status"] == "success":
+                            self.calibration_set.set()
+                    case "clusters":
+                        if data["status"] == "success":
+                            self.clusters_set.set()
+                    case "compress":
+                        if data["status"] == "success":
+                            self.compression_set.set()
+                    case "tiff":
+                        if data["status"] == "success":
+                            self.tiff_mode_set.set()
+            case "latency":
+                self.last_latency = data.get("stages")
+                self.last_queue = data.get("queue")
+                self.new_latency.set()
+            case "error":
+                pass
+            case _:
+                pass
             
+    async def _handle_binary(self, data: bytes):
+        """ Binary messages start with 4 byte tag """
+        tag, payload = data[:4], data[4:]
+        match tag:
+            case b"PREV":
+                # PNG preview of the last frame, replace the file at once so readers never see half of it
+                tmp_path = PREVIEW_PATH + ".tmp"
+                with open(tmp_path, "wb") as fd:
+                    fd.write(payload)
+                os.replace(tmp_path, PREVIEW_PATH)
+                self.preview_url = "/" + PREVIEW_PATH
+            case b"HITS":
+                # clusters found on the camera, appended so a run can be analysed later. A bad message is
+                # only dropped, the session goes on
+                if len(payload) < HITS_HEADER.size or (len(payload) - HITS_HEADER.size) % HITS_RECORD.size != 0:
+                    print(f"Dropped HITS message of {len(payload)} bytes", flush=True)
+                    return
+                try:
+                    count, dropped = await asyncio.to_thread(_append_hits, payload, datetime.now().isoformat())
+                except (struct.error, OSError) as e:
+                    print(f"Dropped HITS message: {e}", flush=True)
+                    return
+                self.last_hits = {"count": count, "dropped": dropped}
+            case _:
+                print(f"Unknown binary message {tag}", flush=True)
+
     async def _listen_messages(self):
         try:
            while self.is_connected():  
-               message = await self.websocket.receive_text()
-               print(f"Received from camera: {message}", flush=True)
-               await self._handle_message(message)
+               message = await self.websocket.receive()
+               if message["type"] == "websocket.disconnect":
+                   raise WebSocketDisconnect(message.get("code", 1000))
+               if message.get("bytes") is not None:
+                   print(f"Received {len(message['bytes'])} bytes from camera", flush=True)
+                   await self._handle_binary(message["bytes"])
+               elif message.get("text") is not None:
+                   print(f"Received from camera: {message['text']}", flush=True)
+                   await self._handle_message(message["text"])
                
         except WebSocketDisconnect:
             print("Camera disconnected!")
@@ -231,6 +324,8 @@ class Device():
             return False
         
         try:
+            self.command_id += 1
+            text = f"@{self.command_id} {text}"
             await self.websocket.send_text(text)
             print(f"Отправка сообщения {text}!", flush=True)
             return True
@@ -287,6 +382,10 @@ class Device():
         self.photo_task_started.clear()
         try:
             command = f"phototask {task.exposure_time} {task.photos_amount}"
+            if task.roi:
+                command += " roi " + " ".join(str(value) for value in task.roi)
+            if task.binning > 1:
+                command += f" bin {task.binning}"
             if await asyncio.wait_for(self._send_to_camera(command), timeout):
                     
                 print("ЖДЕМ ОТВЕТА ОТ КЛИЕНТА!!", flush=True)
@@ -298,6 +397,68 @@ class Device():
             return False
         return True #TODO
 
+    async def camera_get_latency(self, reset: bool = False, timeout: float = APP_STD_TIMEOUT):
+        """ Ask the camera for its stage latency histograms, None if it does not answer """
+        self.new_latency.clear()
+        try:
+            command = "latency reset" if reset else "latency"
+            if await asyncio.wait_for(self._send_to_camera(command), timeout):
+                await asyncio.wait_for(self.new_latency.wait(), timeout=timeout)
+                return self.last_latency
+            return None
+        except asyncio.TimeoutError:
+            return None
+
+    async def camera_calibration(self, mode: str, frames: int = 0, method: str = "median",
+                                 timeout: float = APP_STD_TIMEOUT) -> bool:
+        """ Send command "calib": dark correction on/off or a master dark series to collect """
+        self.calibration_set.clear()
+        try:
+            command = f"calib collect {frames} {method}" if mode == "collect" else f"calib {mode}"
+            if await asyncio.wait_for(self._send_to_camera(command), timeout):
+                await asyncio.wait_for(self.calibration_set.wait(), timeout=timeout)
+                return True
+            return False
+        except asyncio.TimeoutError:
+            return False
+
+    async def camera_clusters(self, on: bool, keep_raw: bool = True, noise_map=None,
+                              timeout: float = APP_STD_TIMEOUT) -> bool:
+        """ Send command "clusters", noise_map is (file, exposure ms, nsigma) or None """
+        self.clusters_set.clear()
+        try:
+            command = f"clusters {'on' if on else 'off'} {'keep' if keep_raw else 'drop'}"
+            if noise_map:
+                command += " noisemap " + " ".join(str(value) for value in noise_map)
+            if await asyncio.wait_for(self._send_to_camera(command), timeout):
+                await asyncio.wait_for(self.clusters_set.wait(), timeout=timeout)
+                return True
+            return False
+        except asyncio.TimeoutError:
+            return False
+
+    async def camera_compression(self, on: bool, timeout: float = APP_STD_TIMEOUT) -> bool:
+        """ Send command "compress": lossless compressed pixels in the .dat files """
+        self.compression_set.clear()
+        try:
+            if await asyncio.wait_for(self._send_to_camera(f"compress {'on' if on else 'off'}"), timeout):
+                await asyncio.wait_for(self.compression_set.wait(), timeout=timeout)
+                return True
+            return False
+        except asyncio.TimeoutError:
+            return False
+
+    async def camera_tiff_mode(self, mode: str, timeout: float = APP_STD_TIMEOUT) -> bool:
+        """ Send command "tiff": what is saved as TIFF next to every .dat file """
+        self.tiff_mode_set.clear()
+        try:
+            if await asyncio.wait_for(self._send_to_camera(f"tiff {mode}"), timeout):
+                await asyncio.wait_for(self.tiff_mode_set.wait(), timeout=timeout)
+                return True
+            return False
+        except asyncio.TimeoutError:
+            return False
+
 app.state.device = Device()
 app.state.task_manager = TaskManager()
 
@@ -479,10 +640,19 @@ async def camera_make_photo(request: Request, body=Body()):
                 num_photos = int(body["num_photos"])
                 exp_time_value = int(body["exposure_value"])
                 exp_time_unit = body["exposure_unit"]
+                # optional readout window and binning
+                roi = body.get("roi")
+                if roi is not None:
+                    roi = [int(value) for value in roi]
+                    if len(roi) != 4 or min(roi) < 0 or roi[2] == 0 or roi[3] == 0:
+                        raise ValueError("roi")
+                binning = int(body.get("bin", 1))
+                if not 1 <= binning <= 8:
+                    raise ValueError("bin")
 
                 if 0 < num_photos <= 15 and exp_time_unit in exposure_time_units.keys():
                         
-                    task = PhotoTask(exp_time_value*exposure_time_units[exp_time_unit], num_photos)
+                    task = PhotoTask(exp_time_value*exposure_time_units[exp_time_unit], num_photos, roi, binning)
                     if await app.state.device.camera_send_task(task):  
                         app.state.task_manager.new_task(task)
                         
@@ -497,6 +667,111 @@ async def camera_make_photo(request: Request, body=Body()):
             return HTMLResponse(content=f'Camera is in use by {app.state.active_user}!', status_code=423)
     raise HTTPException(status_code=400, detail="Unauthorized")
 
+@app.post("/calibration")
+async def camera_calibration(request: Request, body=Body()):
+    is_authenticated, email = auth.check_auth(request)
+    if is_authenticated:
+        if app.state.active_user == email:
+
+            # validation, the client takes at most 32 darks in a series
+            try:
+                mode = body["mode"].lower()
+                frames = int(body.get("frames", 0))
+                method = body.get("method", "median").lower()
+                if mode in ("on", "off") or (mode == "collect" and 1 <= frames <= 32 and
+                                             method in combine_methods):
+                    if await app.state.device.camera_calibration(mode, frames, method):
+                        return HTMLResponse(content="Success! Calibration is set!", status_code=200)
+                    return HTMLResponse(content="Something wrong! Failed to set calibration!", status_code=500)
+            except (AttributeError, KeyError, TypeError, ValueError):
+                pass
+            return HTMLResponse(content="Wrong params! Mode is on, off or collect with 1-32 frames!", status_code=400)
+        elif None == app.state.active_user:
+            return HTMLResponse(content="Connect to the camera firstly!", status_code=400)
+        else:
+            return HTMLResponse(content=f'Camera is in use by {app.state.active_user}!', status_code=423)
+    raise HTTPException(status_code=401, detail="Unauthorized!")
+
+
+@app.post("/clusters")
+async def camera_clusters(request: Request, body=Body()):
+    is_authenticated, email = auth.check_auth(request)
+    if is_authenticated:
+        if app.state.active_user == email:
+
+            # validation, the client takes only a relative .planes file name
+            try:
+                on = bool(body["on"])
+                keep_raw = bool(body.get("keep_raw", True))
+                noise_map = body.get("noise_map")
+                if noise_map is not None:
+                    noise_map = (str(noise_map["file"]), float(noise_map["exposure_ms"]), float(noise_map["nsigma"]))
+                    if (not re.fullmatch(r"[A-Za-z0-9_./-]{1,56}\.planes", noise_map[0]) or noise_map[0].startswith("/") or
+                            ".." in noise_map[0] or not 0 < noise_map[1] <= 240 * 60 * 1000 or not 0 < noise_map[2] <= 100):
+                        raise ValueError("noise_map")
+                if await app.state.device.camera_clusters(on, keep_raw, noise_map):
+                    return HTMLResponse(content="Success! Cluster finding is set!", status_code=200)
+                return HTMLResponse(content="Something wrong! Failed to set cluster finding!", status_code=500)
+            except (KeyError, TypeError, ValueError):
+                return HTMLResponse(content="Wrong params!", status_code=400)
+        elif None == app.state.active_user:
+            return HTMLResponse(content="Connect to the camera firstly!", status_code=400)
+        else:
+            return HTMLResponse(content=f'Camera is in use by {app.state.active_user}!', status_code=423)
+    raise HTTPException(status_code=401, detail="Unauthorized!")
+
+
+@app.post("/compression")
+async def camera_compression(request: Request, body=Body()):
+    is_authenticated, email = auth.check_auth(request)
+    if is_authenticated:
+        if app.state.active_user == email:
+            try:
+                on = bool(body["on"])
+            except (KeyError, TypeError):
+                return HTMLResponse(content="Wrong params!", status_code=400)
+            if await app.state.device.camera_compression(on):
+                return HTMLResponse(content="Success! Compression is set!", status_code=200)
+            return HTMLResponse(content="Something wrong! Failed to set compression!", status_code=500)
+        elif None == app.state.active_user:
+            return HTMLResponse(content="Connect to the camera firstly!", status_code=400)
+        else:
+            return HTMLResponse(content=f'Camera is in use by {app.state.active_user}!', status_code=423)
+    raise HTTPException(status_code=401, detail="Unauthorized!")
+
+
+@app.post("/tiff-mode")
+async def camera_tiff_mode(request: Request, body=Body()):
+    is_authenticated, email = auth.check_auth(request)
+    if is_authenticated:
+        if app.state.active_user == email:
+            try:
+                mode = str(body["mode"]).lower()
+            except (KeyError, TypeError):
+                mode = None
+            if mode not in tiff_modes:
+                return HTMLResponse(content=f"Wrong params! Mode is one of {', '.join(tiff_modes)}!", status_code=400)
+            if await app.state.device.camera_tiff_mode(mode):
+                return HTMLResponse(content="Success! TIFF mode is set!", status_code=200)
+            return HTMLResponse(content="Something wrong! Failed to set TIFF mode!", status_code=500)
+        elif None == app.state.active_user:
+            return HTMLResponse(content="Connect to the camera firstly!", status_code=400)
+        else:
+            return HTMLResponse(content=f'Camera is in use by {app.state.active_user}!', status_code=423)
+    raise HTTPException(status_code=401, detail="Unauthorized!")
+
+
+@app.get("/latency")
+async def camera_latency(request: Request, reset: bool = False):
+    is_authenticated, email = auth.check_auth(request)
+    if is_authenticated:
+        stages = await app.state.device.camera_get_latency(reset)
+        if stages is None:
+            return HTMLResponse(content="Camera did not answer!", status_code=504)
+        return JSONResponse(content={"unit": "ms", "stages": stages, "queue": app.state.device.last_queue})
+    raise HTTPException(status_code=401, detail="Unauthorized!")
+
+
 @app.post("/cancel-photo")
 async def cancel_photo(request: Request):
     is_authenticated, email = auth.check_auth(request)
@@ -546,7 +821,7 @@ async def status_stream(request: Request):
             if app.state.task_manager.current_task != None:
                 if app.state.task_manager.current_task.get_ready_flag():
                     # Задача завершена успешно
-                    result_url = "/static/photo.jpg"  # например: "/photos/latest.jpg"
+                    result_url = app.state.device.preview_url or "/static/photo.jpg"
                     data = {"photo_url": result_url}
                     yield sse_format("finished", data)
     